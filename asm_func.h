@@ -10,6 +10,7 @@ void cpu_hlt(void);   /* Stop CPU forever */
 void dispatch(vcpu_t *vcpu);  /* dispatcher for hypervisor */
 void vcpu_freg_save(vcpu_t *vcpu);
 void vcpu_freg_restore(vcpu_t *vcpu);
+void dcache_clean_inval_range(phys_addr_t addr, uint64_t size); /* DC CIVAC to PoC */
 
 
 // Assembly defines for C
@@ -0,0 +1,72 @@
+/*
+ * asm_offsets.c
+ * Generate structure offsets for assembly
+ *
+ * This file is compiled only into assembly (-S),
+ * and "->SYMBOL value" markers are converted into asm_offsets.h by Makefile.
+ * Do not edit asm_offsets.h by hand.
+ */
+
+#include "typedef.h"
+#include "pcpu.h"
+#include "vcpu.h"
+#include "vm.h"
+#include "schedule.h"
+#include "hyp_security.h"
+#include "vcpu_stat.h"
+
+#define DEFINE(sym, val) \
+  asm volatile("\n.ascii \"->" #sym " %0\"" : : "i" (val))
+
+#define OFFSET(sym, type, member) \
+  DEFINE(sym, offsetof(type, member))
+
+/* 
+ * The exit path saves $x0 ~ $x30 and reads pc, cpsr, vic and security.
+ * Keep them in the first cache lines of vcpu_t.
+ */
+_Static_assert(offsetof(vcpu_t, reg) % CACHE_LINE_SIZE == 0,
+    "vcpu_t.reg must be cache line aligned");
+_Static_assert(offsetof(vcpu_t, stat) < offsetof(vcpu_t, freg),
+    "hot fields of vcpu_t must be placed before the cold region");
+_Static_assert(offsetof(vcpu_t, freg) <= 6*CACHE_LINE_SIZE,
+    "hot region of vcpu_t must fit in 6 cache lines");
+_Static_assert(offsetof(vcpu_t, freg) % CACHE_LINE_SIZE == 0,
+    "cold region of vcpu_t must be cache line aligned");
+_Static_assert(sizeof(vcpu_t) % CACHE_LINE_SIZE == 0,
+    "vcpus[] must not share a cache line");
+_Static_assert(sizeof(((vcpu_t *)0)->vic.vserror_pending) == 4
+    && sizeof(((pcpu_t *)0)->schedule_is_needed) == 4
+    && sizeof(((scheduler_t *)0)->ready_vcpu_num) == 4,
+    "the fast exit path loads these fields as 32bit");
+_Static_assert(offsetof(pcpu_t, current_vcpu) + sizeof(((pcpu_t *)0)->current_vcpu)
+    <= CACHE_LINE_SIZE,
+    "per-cpu data used by the vectors must fit in the first cache line");
+
+void asm_offsets(void){
+  /* vcpu_t */
+  OFFSET(VCPU_OFF_VM,         vcpu_t, vm);
+  OFFSET(VCPU_OFF_PHYS_CPU,   vcpu_t, phys_cpu);
+  OFFSET(VCPU_OFF_REG_X0,     vcpu_t, reg.x);
+  OFFSET(VCPU_OFF_FREG_Q0,    vcpu_t, freg.q);
+  OFFSET(VCPU_OFF_REG_PC,     vcpu_t, sysreg.pc);
+  OFFSET(VCPU_OFF_REG_CPSR,   vcpu_t, sysreg.cpsr);
+  OFFSET(VCPU_OFF_SEC_ERROR,  vcpu_t, security.error);
+  OFFSET(VCPU_OFF_SEC_RET_CNT, vcpu_t, security.sec_ret_counter);
+  OFFSET(VCPU_OFF_SEC_BLR_CNT, vcpu_t, security.sec_blr_counter);
+  OFFSET(VCPU_OFF_VIC_VSERROR_PENDING, vcpu_t, vic.vserror_pending);
+  OFFSET(VCPU_OFF_VIC_VIRQ_PENDING,    vcpu_t, vic.virq_pending);
+  OFFSET(VCPU_OFF_VIC_VFIQ_PENDING,    vcpu_t, vic.vfiq_pending);
+  OFFSET(VCPU_OFF_EXIT_CYCLE, vcpu_t, exit_cycle);
+  OFFSET(VCPU_OFF_STAT,       vcpu_t, stat);
+
+  /* pcpu_t */
+  OFFSET(PCPU_OFF_SELF,               pcpu_t, self);
+  OFFSET(PCPU_OFF_STACK_TOP,          pcpu_t, stack_top);
+  OFFSET(PCPU_OFF_CURRENT_VCPU,       pcpu_t, current_vcpu);
+  OFFSET(PCPU_OFF_SCHEDULE_IS_NEEDED, pcpu_t, schedule_is_needed);
+  OFFSET(PCPU_OFF_SCHEDULER,          pcpu_t, scheduler);
+
+  /* scheduler_t */
+  OFFSET(SCHED_OFF_READY_VCPU_NUM, scheduler_t, ready_vcpu_num);
+}
@@ -50,6 +50,15 @@
 #define HCR_CD  (1 << 32) // Disable Stage 2 Data cache
 #define HCR_ID  (1 << 33) // Disable Stage 2 Instruction cache
 
+/*
+ * Architectural Feature Trap Register (EL2)
+ * CPTR_EL2
+ */
+#define CPTR_EL2_RES1 0x33FF  // bits [13:12] and [9:0] are RES1
+#define CPTR_TFP  (1 << 10)   // Trap SIMD and floating-point register accesses
+#define CPTR_TTA  (1 << 20)   // Trap trace register accesses
+#define CPTR_TCPAC (1 << 31)  // Trap CPACR_EL1 accesses
+
 /* 
  * Current Program Status Register in AArch64
  * CPSR, SPSR_ELx
@@ -59,6 +68,7 @@
 #define CPSR_M_EL1h 0b0101  // the exception SP is determined by the ELx
 #define CPSR_M_EL2t 0b1000  // the SP is always SP0.
 #define CPSR_M_EL2h 0b1001  // the exception SP is determined by the ELx
+#define CPSR_M_MASK 0b1111
 
 #define CPSR_F  (1 << 6) // Diasble FIQ
 #define CPSR_I  (1 << 7) // Disable IRQ
@@ -142,8 +152,8 @@
 
 #define EC_PC_ALIGN_FAULT         0x22  /* Misaligned PC exception */
 /* EC 0x23 is not used in ARMv8.0 */
-#define EC_INST_ABORT_LOWER_EL    0x24  /* Data Abort from a lower Exception level */
-#define EC_INST_ABORT_CUR_EL      0x25  /* Data Abort taken without a change in Exception level */
+#define EC_DATA_ABORT_LOWER_EL    0x24  /* Data Abort from a lower Exception level */
+#define EC_DATA_ABORT_CUR_EL      0x25  /* Data Abort taken without a change in Exception level */
 #define EC_SP_ALIGN_FAULT         0x26  /* Misaligned Stack Pointer exception, this is taken only from AArch64 */
 /* EC 0x27 is not used in ARMv8.0 */
 #define EC_FP_EXCEP_A32      0x28   /* Floating-point exception taken from AArch32*/
@@ -0,0 +1,335 @@
+/*
+ * credit_schedule.c :
+ *   Credit-based proportional share scheduler
+ *
+ * Every CREDIT_ACCT_MSEC, the cpu time of the physical cpus of this scheduler
+ * is given to the vms as credit in proportion to vm->sched_param.weight,
+ * and split among the vcpus of each vm.
+ * A vcpu burns its credit by the CNTPCT_EL0 ticks it runs.
+ *  - UNDER : vcpus with credit left run first,
+ *  - OVER  : vcpus without credit run only when no UNDER vcpu is ready,
+ *  - BOOST : a vcpu woken by an interrupt with credit left
+ *            preempts UNDER and OVER vcpus until the next tick.
+ * A vm with vm->sched_param.cap gets at most cap % of one cpu per period,
+ * and its vcpus without credit are parked (READY but not in credit_runqueue)
+ * until the next accounting.
+ * Vcpus of the same class share a cpu in CREDIT_TICK_MSEC slices.
+ */
+
+
+#include "typedef.h"
+#include "lib.h"
+#include "log.h"
+#include "asm_func.h"
+#include "vm.h"
+#include "smp_mbox.h"
+#include "vcpu.h"
+#include "runqueue.h"
+#include "hyp_timer.h"
+#include "spinlock.h"
+#include "schedule.h"
+
+static scheduler_init_fn_t    credit_scheduler_init;
+static scheduler_add_fn_t     credit_scheduler_add;
+static scheduler_remove_fn_t  credit_scheduler_remove;
+static schedule_fn_t          credit_schedule;
+static scheduler_dump_ready_vcpu_fn_t  credit_dump_ready_vcpu;
+
+scheduler_t credit_scheduler = {
+  {NULL, NULL, NULL, NULL},
+  0,
+  1,
+  1,
+  credit_scheduler_init,
+  credit_scheduler_add,
+  credit_scheduler_remove,
+  credit_schedule,
+  credit_dump_ready_vcpu,
+  NULL,
+};
+
+/* Classes of vcpus, the priorities in credit_runqueue */
+#define CREDIT_PRIO_BOOST 0
+#define CREDIT_PRIO_UNDER 1
+#define CREDIT_PRIO_OVER  2
+
+#define CREDIT_TICK_MSEC      100 /* resolution of timer events, see hyp_timer.c */
+#define CREDIT_TICKS_PER_ACCT 3
+#define CREDIT_ACCT_MSEC      (CREDIT_TICK_MSEC * CREDIT_TICKS_PER_ACCT)
+#define CREDIT_DEFAULT_WEIGHT 256
+
+static runqueue_t credit_runqueue;
+
+/* Accounting of each physical cpu */
+static struct {
+  vcpu_t *vcpu;         // vcpu charged for the time from run_start
+  uint64_t run_start;   // CNTPCT_EL0
+  int slice_expired;    // the tick lets a vcpu of the same class run
+} credit_pcpu[CPU_NUM];
+
+static int credit_acct_tick;
+
+static void credit_tick(pcpu_t *phys_cpu, uint64_t arg);
+
+static inline uint64_t credit_now(void){
+  uint64_t t;
+
+  READ_SYSREG(t, CNTPCT_EL0);
+  return t;
+}
+
+/* Counter ticks of one physical cpu in an accounting period */
+static uint64_t credit_period(void){
+  return credit_scheduler.phys_cpu[0]->freq * CREDIT_ACCT_MSEC / 1000;
+}
+
+static inline uint32_t credit_weight(vm_t *vm){
+  return (vm->sched_param.weight == 0)? CREDIT_DEFAULT_WEIGHT : vm->sched_param.weight;
+}
+
+static inline int credit_prio(vcpu_t *vcpu){
+  return (vcpu->sched.credit > 0)? CREDIT_PRIO_UNDER : CREDIT_PRIO_OVER;
+}
+
+/* A capped vcpu without credit must not run */
+static inline int credit_is_parked(vcpu_t *vcpu){
+  return vcpu->vm->sched_param.cap != 0 && vcpu->sched.credit <= 0;
+}
+
+/* Charge the vcpu which ran on this cpu since run_start */
+static void credit_charge(pcpu_t *phys_cpu, uint64_t now){
+  int id = phys_cpu->cpu_id;
+
+  if(credit_pcpu[id].vcpu != NULL)
+    credit_pcpu[id].vcpu->sched.credit -= now - credit_pcpu[id].run_start;
+  credit_pcpu[id].run_start = now;
+}
+
+/* Let the physical cpus which run a vcpu of a lower class than prio schedule */
+static void credit_kick(int prio){
+  pcpu_t *phys_cpu;
+  int i;
+
+  for(i=0; i<credit_scheduler.pcpu_num; i++){
+    phys_cpu = credit_scheduler.phys_cpu[i];
+    if(phys_cpu->current_vcpu != NULL && phys_cpu->current_vcpu->sched.prio <= prio)
+      continue;
+
+    phys_cpu->schedule_is_needed = 1;
+    if(phys_cpu != get_current_phys_cpu())
+      smp_send_mailbox(phys_cpu->cpu_id, MAIL_TYPE_SCHEDULE);
+  }
+}
+
+/*
+ * credit_scheduler_init() is called in scheduler_init()
+ * after credit_scheduler.phys_cpu and credit_scheduler.pcpu_num are set.
+ */
+static void credit_scheduler_init(void){
+  int i;
+
+  runqueue_init(&credit_runqueue);
+  credit_acct_tick = 0;
+
+  for(i=0; i<CPU_NUM; i++){
+    credit_pcpu[i].vcpu = NULL;
+    credit_pcpu[i].run_start = 0;
+    credit_pcpu[i].slice_expired = 0;
+  }
+
+  for(i=0; i<credit_scheduler.pcpu_num; i++){
+    timer_event_add(credit_scheduler.phys_cpu[i],
+        credit_tick, CREDIT_TICK_MSEC, 0);
+  }
+}
+
+/* Add vcpu to the tail of its class */
+static void credit_scheduler_add(vcpu_t *vcpu){
+  if(vcpu->sched.woken && vcpu->sched.credit > 0)
+    vcpu->sched.prio = CREDIT_PRIO_BOOST;
+  else
+    vcpu->sched.prio = credit_prio(vcpu);
+
+  /* credit_account() adds it when the vm gets credit again */
+  if(credit_is_parked(vcpu))
+    return;
+
+  runqueue_add(&credit_runqueue, &vcpu->rq_node, vcpu->sched.prio);
+  credit_kick(vcpu->sched.prio);
+}
+
+static void credit_scheduler_remove(vcpu_t *vcpu){
+  /* Parked vcpus are not in the runqueue */
+  if(!rq_node_is_queued(&vcpu->rq_node))
+    return;
+
+  runqueue_remove(&credit_runqueue, &vcpu->rq_node);
+}
+
+/*
+ * Give credit of an accounting period to the vcpus of the vms of this scheduler.
+ * Called by credit_tick() with the lock.
+ */
+static void credit_account(void){
+  uint64_t period = credit_period();
+  uint64_t total = period * credit_scheduler.pcpu_num;
+  uint64_t weight_sum = 0;
+  int64_t share;
+  int vcpu_num[VM_MAX_NUM];
+  vm_t *vm;
+  vcpu_t *vcpu;
+  int i, j, prio;
+
+  /* Vms which have vcpus other than VCPU_STATE_INIT take part */
+  for(i=0; i<VM_MAX_NUM; i++){
+    vcpu_num[i] = 0;
+    vm = vm_get_by_id(i);
+    if(vm == NULL || vm->scheduler != &credit_scheduler)
+      continue;
+
+    for(j=0; j<vm->vcpu_num; j++){
+      if(vm->vcpu[j] != 0 && vm->vcpu[j]->state != VCPU_STATE_INIT)
+        vcpu_num[i]++;
+    }
+    if(vcpu_num[i] != 0)
+      weight_sum += credit_weight(vm);
+  }
+
+  if(weight_sum == 0)
+    return;
+
+  for(i=0; i<VM_MAX_NUM; i++){
+    if(vcpu_num[i] == 0)
+      continue;
+    vm = vm_get_by_id(i);
+
+    share = total * credit_weight(vm) / weight_sum;
+    if(vm->sched_param.cap != 0 && share > period * vm->sched_param.cap / 100)
+      share = period * vm->sched_param.cap / 100;
+    share /= vcpu_num[i];
+    /* A vcpu cannot use more than one cpu */
+    if(share > period)
+      share = period;
+
+    for(j=0; j<vm->vcpu_num; j++){
+      vcpu = vm->vcpu[j];
+      if(vcpu == 0 || vcpu->state == VCPU_STATE_INIT)
+        continue;
+
+      /* Idle vcpus do not save credit, and debt is kept for one period */
+      vcpu->sched.credit += share;
+      if(vcpu->sched.credit > share)
+        vcpu->sched.credit = share;
+      if(vcpu->sched.credit < -(int64_t)period)
+        vcpu->sched.credit = -(int64_t)period;
+
+      if(vcpu->state != VCPU_STATE_READY){
+        if(vcpu->sched.prio != CREDIT_PRIO_BOOST)
+          vcpu->sched.prio = credit_prio(vcpu);
+        continue;
+      }
+
+      /* Move the READY vcpu to its new class, or unpark it */
+      prio = credit_prio(vcpu);
+      if(rq_node_is_queued(&vcpu->rq_node)){
+        if(vcpu->sched.prio == CREDIT_PRIO_BOOST || vcpu->sched.prio == prio)
+          continue;
+        runqueue_remove(&credit_runqueue, &vcpu->rq_node);
+      }else if(credit_is_parked(vcpu)){
+        continue;
+      }
+      vcpu->sched.prio = prio;
+      runqueue_add(&credit_runqueue, &vcpu->rq_node, prio);
+      credit_kick(prio);
+    }
+  }
+}
+
+/*
+ * Timer event of each cpu.
+ * Charge the running vcpu, end its boost,
+ * and let it be preempted if its slice is over.
+ */
+static void credit_tick(pcpu_t *phys_cpu, uint64_t arg){
+  vcpu_t *vcpu;
+  rq_node_t *node;
+
+  timer_event_add(phys_cpu, credit_tick, CREDIT_TICK_MSEC, 0);
+
+  spin_lock(&credit_scheduler.lock);
+
+  vcpu = phys_cpu->current_vcpu;
+  if(vcpu != NULL && vcpu == credit_pcpu[phys_cpu->cpu_id].vcpu){
+    credit_charge(phys_cpu, credit_now());
+    vcpu->sched.prio = credit_prio(vcpu);
+
+    node = runqueue_peek(&credit_runqueue);
+    if(credit_is_parked(vcpu)
+        || (node != NULL && node->prio <= vcpu->sched.prio)){
+      credit_pcpu[phys_cpu->cpu_id].slice_expired = 1;
+      phys_cpu->schedule_is_needed = 1;
+    }
+  }
+
+  if(phys_cpu == credit_scheduler.phys_cpu[0]
+      && ++credit_acct_tick == CREDIT_TICKS_PER_ACCT){
+    credit_acct_tick = 0;
+    credit_account();
+  }
+
+  spin_unlock(&credit_scheduler.lock);
+}
+
+static void credit_schedule(pcpu_t *phys_cpu){
+  int id = phys_cpu->cpu_id;
+  vcpu_t *vcpu = phys_cpu->current_vcpu;
+  rq_node_t *node;
+  uint64_t now = credit_now();
+
+  credit_charge(phys_cpu, now);
+
+  /* Preempt the running vcpu for a higher class, or at the end of its slice */
+  if(vcpu != NULL){
+    node = runqueue_peek(&credit_runqueue);
+    if(credit_is_parked(vcpu)
+        || (node != NULL && node->prio < vcpu->sched.prio)
+        || (node != NULL && node->prio == vcpu->sched.prio && credit_pcpu[id].slice_expired))
+      vcpu_preempt(vcpu);
+  }
+  credit_pcpu[id].slice_expired = 0;
+
+  if(phys_cpu->current_vcpu == NULL){
+    node = runqueue_pop(&credit_runqueue);
+    if(node != NULL)
+      phys_cpu->current_vcpu = RQ_NODE_ENTRY(node, vcpu_t, rq_node); /* Set as current vcpu */
+  }
+
+  credit_pcpu[id].vcpu = phys_cpu->current_vcpu;
+  credit_pcpu[id].run_start = now;
+
+  /* credit_kick() by vcpu_preempt() above needs no more scheduling on this cpu */
+  phys_cpu->schedule_is_needed = 0;
+}
+
+static void credit_dump_ready_vcpu(log_level_t level){
+  int i;
+  rq_node_t *node;
+  vcpu_t *t_vcpu;
+  static const char *prio_name[] = {"BOOST", "UNDER", "OVER"};
+
+  log_printf(level, "Start dump vcpu in credit scheduler ready que\n");
+
+  for(i = CREDIT_PRIO_BOOST; i <= CREDIT_PRIO_OVER; i++){
+    if(!(credit_runqueue.bitmap & RQ_PRIO_BIT(i)))
+      continue;
+
+    log_printf(level, "Class : %s\n", prio_name[i]);
+    for(node = credit_runqueue.head[i].next; node != &credit_runqueue.head[i]; node = node->next){
+      t_vcpu = RQ_NODE_ENTRY(node, vcpu_t, rq_node);
+      log_printf(level, "ready vm:%s vcpu_id:%d credit:%d\n",
+          t_vcpu->vm->name, t_vcpu->vcpu_id, t_vcpu->sched.credit);
+    }
+  }
+
+  log_printf(level, "=================   End   =================\n");
+}
@@ -0,0 +1,448 @@
+/*
+ * edf_schedule.c :
+ *   Earliest deadline first scheduler with Constant Bandwidth Servers
+ *
+ * Each vcpu is a CBS server with the budget and the period
+ * of vm->sched_param, in counter ticks of CNTPCT_EL0.
+ *  - The ready vcpu with the earliest server deadline runs.
+ *    edf_runqueue is kept sorted by deadline, so the pick is its head.
+ *  - The running vcpu burns its budget (vcpu->sched.credit).
+ *    The hyp timer alarm of the cpu fires when the budget runs out,
+ *    then the budget is refilled and the deadline is postponed by a period,
+ *    so a vcpu never takes more than budget / period of a cpu
+ *    from the vcpus with earlier deadlines.
+ *  - A woken vcpu keeps its deadline if its budget left fits in its bandwidth
+ *    until the deadline, otherwise it gets a full budget and a new deadline.
+ * vm_create() asks edf_scheduler_admit() first, which rejects a vm
+ * if the total utilisation exceeds the bound of global EDF on the pcpus.
+ *
+ * With CONFIG_EDF_MIXED_CRITICALITY, a budget overrun of a VM_CRIT_HI vcpu
+ * (its budget runs out while it is still running) switches the scheduler
+ * to the high criticality mode, where the vcpus of VM_CRIT_LO vms are
+ * suspended (READY but not in edf_runqueue). It goes back to the low
+ * criticality mode at the end of the server period the overrunning vcpu
+ * got for the overrun, or earlier when a cpu finds nothing to run.
+ */
+
+
+#include "typedef.h"
+#include "lib.h"
+#include "log.h"
+#include "asm_func.h"
+#include "hyp_config.h"
+#include "vm.h"
+#include "smp_mbox.h"
+#include "vcpu.h"
+#include "runqueue.h"
+#include "hyp_timer.h"
+#include "spinlock.h"
+#include "schedule.h"
+
+static scheduler_init_fn_t    edf_scheduler_init;
+static scheduler_add_fn_t     edf_scheduler_add;
+static scheduler_remove_fn_t  edf_scheduler_remove;
+static schedule_fn_t          edf_schedule;
+static scheduler_dump_ready_vcpu_fn_t  edf_dump_ready_vcpu;
+static scheduler_admit_fn_t   edf_scheduler_admit;
+
+scheduler_t edf_scheduler = {
+  {NULL, NULL, NULL, NULL},
+  0,
+  1,
+  1,
+  edf_scheduler_init,
+  edf_scheduler_add,
+  edf_scheduler_remove,
+  edf_schedule,
+  edf_dump_ready_vcpu,
+  edf_scheduler_admit,
+};
+
+/* Utilisation in parts per million */
+#define EDF_UTIL_ONE  1000000
+
+#define EDF_VCPU(node)  RQ_NODE_ENTRY(node, vcpu_t, rq_node)
+
+/* All vcpus are queued at priority 0 in order of deadline */
+static runqueue_t edf_runqueue;
+
+/* Accounting of each physical cpu */
+static struct {
+  vcpu_t *vcpu;         // vcpu charged for the time from run_start
+  uint64_t run_start;   // CNTPCT_EL0
+} edf_pcpu[CPU_NUM];
+
+#if CONFIG_EDF_MIXED_CRITICALITY
+static int edf_hi_mode;
+static uint64_t edf_hi_mode_end;  // CNTPCT_EL0 to leave the high criticality mode
+#endif
+
+static inline uint64_t edf_now(void){
+  uint64_t t;
+
+  READ_SYSREG(t, CNTPCT_EL0);
+  return t;
+}
+
+static inline uint64_t edf_usec2ticks(uint64_t usec){
+  return edf_scheduler.phys_cpu[0]->freq * usec / 1000000;
+}
+
+static inline uint64_t edf_util(vm_sched_param_t *param){
+  return (uint64_t)param->budget_usec * EDF_UTIL_ONE / param->period_usec;
+}
+
+static inline int edf_is_lo(vcpu_t *vcpu){
+  return vcpu->vm->sched_param.criticality != VM_CRIT_HI;
+}
+
+/* Insert vcpu before the first vcpu with a later deadline */
+static void edf_insert(vcpu_t *vcpu){
+  rq_node_t *head = &edf_runqueue.head[0];
+  rq_node_t *pos;
+
+  for(pos = head->next; pos != head; pos = pos->next){
+    if(EDF_VCPU(pos)->sched.deadline > vcpu->sched.deadline)
+      break;
+  }
+  runqueue_add_before(&edf_runqueue, &vcpu->rq_node, 0, pos);
+}
+
+/* Let an idle cpu, or the cpu running the latest deadline, schedule vcpu */
+static void edf_kick(vcpu_t *vcpu){
+  pcpu_t *phys_cpu;
+  pcpu_t *target = NULL;
+  uint64_t latest = vcpu->sched.deadline;
+  int i;
+
+  for(i=0; i<edf_scheduler.pcpu_num; i++){
+    phys_cpu = edf_scheduler.phys_cpu[i];
+    if(phys_cpu->current_vcpu == NULL){
+      target = phys_cpu;
+      break;
+    }
+    if(phys_cpu->current_vcpu->sched.deadline > latest){
+      latest = phys_cpu->current_vcpu->sched.deadline;
+      target = phys_cpu;
+    }
+  }
+  if(target == NULL)
+    return;
+
+  target->schedule_is_needed = 1;
+  if(target != get_current_phys_cpu())
+    smp_send_mailbox(target->cpu_id, MAIL_TYPE_SCHEDULE);
+}
+
+/*
+ * CBS wakeup rule.
+ * Keep the deadline if credit / (deadline - now) <= budget / period,
+ * otherwise start a new server period.
+ */
+static void edf_server_wakeup(vcpu_t *vcpu, uint64_t now){
+  vcpu_sched_t *s = &vcpu->sched;
+
+  if(now >= s->deadline || s->credit <= 0
+      || (uint64_t)s->credit * s->period > (s->deadline - now) * s->budget){
+    s->deadline = now + s->period;
+    s->credit = s->budget;
+  }
+}
+
+#if CONFIG_EDF_MIXED_CRITICALITY
+/*
+ * Suspend the vcpus of VM_CRIT_LO vms until the deadline overrun got
+ * from its refill. Called with the lock
+ */
+static void edf_enter_hi_mode(vcpu_t *overrun){
+  rq_node_t *head = &edf_runqueue.head[0];
+  rq_node_t *node, *next;
+  pcpu_t *phys_cpu;
+  int i;
+
+  if(edf_hi_mode){
+    if(overrun->sched.deadline > edf_hi_mode_end)
+      edf_hi_mode_end = overrun->sched.deadline;
+    return;
+  }
+
+  edf_hi_mode = 1;
+  edf_hi_mode_end = overrun->sched.deadline;
+  log_warn("edf_scheduler : vm %s overran its budget, suspend low criticality vms\n",
+      overrun->vm->name);
+
+  for(node = head->next; node != head; node = next){
+    next = node->next;
+    if(edf_is_lo(EDF_VCPU(node)))
+      runqueue_remove(&edf_runqueue, node);
+  }
+
+  /* Running VM_CRIT_LO vcpus are preempted by edf_schedule() */
+  for(i=0; i<edf_scheduler.pcpu_num; i++){
+    phys_cpu = edf_scheduler.phys_cpu[i];
+    if(phys_cpu->current_vcpu == NULL || !edf_is_lo(phys_cpu->current_vcpu))
+      continue;
+    phys_cpu->schedule_is_needed = 1;
+    if(phys_cpu != get_current_phys_cpu())
+      smp_send_mailbox(phys_cpu->cpu_id, MAIL_TYPE_SCHEDULE);
+  }
+}
+
+/* Resume the suspended vcpus. Called with the lock */
+static void edf_leave_hi_mode(uint64_t now){
+  vm_t *vm;
+  vcpu_t *vcpu;
+  int i, j;
+
+  edf_hi_mode = 0;
+  log_info("edf_scheduler : resume low criticality vms\n");
+
+  for(i=0; i<VM_MAX_NUM; i++){
+    vm = vm_get_by_id(i);
+    if(vm == NULL || vm->scheduler != &edf_scheduler)
+      continue;
+
+    for(j=0; j<vm->vcpu_num; j++){
+      vcpu = vm->vcpu[j];
+      if(vcpu == 0 || vcpu->state != VCPU_STATE_READY || rq_node_is_queued(&vcpu->rq_node))
+        continue;
+      edf_server_wakeup(vcpu, now);
+      edf_insert(vcpu);
+      edf_kick(vcpu);
+    }
+  }
+}
+#endif
+
+/*
+ * Charge the vcpu which ran on this cpu since run_start.
+ * An exhausted running vcpu gets its budget back with a later deadline.
+ */
+static void edf_charge(pcpu_t *phys_cpu, uint64_t now){
+  int id = phys_cpu->cpu_id;
+  vcpu_t *vcpu = edf_pcpu[id].vcpu;
+
+  if(vcpu == NULL)
+    return;
+
+  vcpu->sched.credit -= now - edf_pcpu[id].run_start;
+  edf_pcpu[id].run_start = now;
+  if(vcpu->sched.credit > 0)
+    return;
+
+  /* A sleeping vcpu is refilled by edf_server_wakeup() */
+  if(vcpu->state != VCPU_STATE_RUN)
+    return;
+  while(vcpu->sched.credit <= 0){
+    vcpu->sched.credit += vcpu->sched.budget;
+    vcpu->sched.deadline += vcpu->sched.period;
+  }
+
+#if CONFIG_EDF_MIXED_CRITICALITY
+  if(!edf_is_lo(vcpu))
+    edf_enter_hi_mode(vcpu);
+#endif
+}
+
+/* The budget of the running vcpu has run out */
+static void edf_budget_alarm(pcpu_t *phys_cpu){
+  spin_lock(&edf_scheduler.lock);
+
+  if(phys_cpu->current_vcpu != NULL
+      && phys_cpu->current_vcpu == edf_pcpu[phys_cpu->cpu_id].vcpu)
+    phys_cpu->schedule_is_needed = 1;
+
+  spin_unlock(&edf_scheduler.lock);
+}
+
+/*
+ * edf_scheduler_init() is called in scheduler_init()
+ * after edf_scheduler.phys_cpu and edf_scheduler.pcpu_num are set.
+ */
+static void edf_scheduler_init(void){
+  int i;
+
+  runqueue_init(&edf_runqueue);
+#if CONFIG_EDF_MIXED_CRITICALITY
+  edf_hi_mode = 0;
+  edf_hi_mode_end = 0;
+#endif
+
+  for(i=0; i<CPU_NUM; i++){
+    edf_pcpu[i].vcpu = NULL;
+    edf_pcpu[i].run_start = 0;
+  }
+}
+
+/*
+ * Global EDF on m cpus meets all deadlines
+ * if U <= m - (m - 1) * Umax (Goossens, Funk and Baruah),
+ * which is U <= 1 on one cpu.
+ * vm_create() creates only the first vcpu of a vm,
+ * so a vm with more vcpus is rejected rather than charged for vcpus it lacks.
+ */
+static int edf_scheduler_admit(vm_sched_param_t *param, int vcpu_num){
+  uint64_t util, util_sum, util_max, bound;
+  uint64_t m = edf_scheduler.pcpu_num;
+  vm_t *vm;
+  int i, j;
+
+  if(m == 0){
+    log_error("edf_scheduler has no physical cpu\n");
+    return -1;
+  }
+  if(param->period_usec == 0 || param->budget_usec == 0
+      || param->budget_usec > param->period_usec){
+    log_error("Illegal CBS parameters; budget : %d usec, period : %d usec\n",
+        param->budget_usec, param->period_usec);
+    return -1;
+  }
+  if(vcpu_num != 1){
+    log_error("edf_scheduler supports only vms with one vcpu; vcpu num : %d\n", vcpu_num);
+    return -1;
+  }
+
+  util = edf_util(param);
+  util_sum = util;
+  util_max = util;
+
+  spin_lock(&edf_scheduler.lock);
+
+  /* Vms which have vcpus other than VCPU_STATE_INIT are admitted */
+  for(i=0; i<VM_MAX_NUM; i++){
+    vm = vm_get_by_id(i);
+    if(vm == NULL || vm->scheduler != &edf_scheduler)
+      continue;
+
+    util = edf_util(&vm->sched_param);
+    for(j=0; j<vm->vcpu_num; j++){
+      if(vm->vcpu[j] == 0 || vm->vcpu[j]->state == VCPU_STATE_INIT)
+        continue;
+      util_sum += util;
+      if(util > util_max)
+        util_max = util;
+    }
+  }
+
+  spin_unlock(&edf_scheduler.lock);
+
+  bound = m * EDF_UTIL_ONE - (m - 1) * util_max;
+  log_info("edf_scheduler : utilisation %d ppm, bound %d ppm\n", util_sum, bound);
+
+  if(util_sum > bound){
+    log_error("edf_scheduler : utilisation %d ppm exceeds the bound %d ppm\n",
+        util_sum, bound);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void edf_scheduler_add(vcpu_t *vcpu){
+  uint64_t now = edf_now();
+
+  /* The first wakeup starts the CBS server */
+  if(vcpu->sched.period == 0){
+    vcpu->sched.budget = edf_usec2ticks(vcpu->vm->sched_param.budget_usec);
+    vcpu->sched.period = edf_usec2ticks(vcpu->vm->sched_param.period_usec);
+    vcpu->sched.deadline = 0;
+    vcpu->sched.credit = 0;
+  }
+
+  /* A preempted vcpu keeps its server state */
+  if(vcpu->sched.woken || vcpu->sched.deadline == 0)
+    edf_server_wakeup(vcpu, now);
+
+#if CONFIG_EDF_MIXED_CRITICALITY
+  /* edf_leave_hi_mode() adds it */
+  if(edf_hi_mode && edf_is_lo(vcpu))
+    return;
+#endif
+
+  edf_insert(vcpu);
+  edf_kick(vcpu);
+}
+
+static void edf_scheduler_remove(vcpu_t *vcpu){
+  /* Suspended vcpus are not in the runqueue */
+  if(!rq_node_is_queued(&vcpu->rq_node))
+    return;
+
+  runqueue_remove(&edf_runqueue, &vcpu->rq_node);
+}
+
+static void edf_schedule(pcpu_t *phys_cpu){
+  int id = phys_cpu->cpu_id;
+  vcpu_t *vcpu = phys_cpu->current_vcpu;
+  rq_node_t *node;
+  uint64_t now = edf_now();
+  uint64_t alarm;
+
+  edf_charge(phys_cpu, now);
+
+#if CONFIG_EDF_MIXED_CRITICALITY
+  /* The server period of the overrun is over */
+  if(edf_hi_mode && now >= edf_hi_mode_end)
+    edf_leave_hi_mode(now);
+#endif
+
+  /* Preempt the running vcpu for an earlier deadline */
+  if(vcpu != NULL){
+    node = runqueue_peek(&edf_runqueue);
+#if CONFIG_EDF_MIXED_CRITICALITY
+    if(edf_hi_mode && edf_is_lo(vcpu))
+      vcpu_preempt(vcpu);
+    else
+#endif
+    if(node != NULL && EDF_VCPU(node)->sched.deadline < vcpu->sched.deadline)
+      vcpu_preempt(vcpu);
+  }
+
+  if(phys_cpu->current_vcpu == NULL){
+    node = runqueue_pop(&edf_runqueue);
+#if CONFIG_EDF_MIXED_CRITICALITY
+    if(node == NULL && edf_hi_mode){
+      edf_leave_hi_mode(now);
+      node = runqueue_pop(&edf_runqueue);
+    }
+#endif
+    if(node != NULL)
+      phys_cpu->current_vcpu = EDF_VCPU(node); /* Set as current vcpu */
+  }
+
+  edf_pcpu[id].vcpu = phys_cpu->current_vcpu;
+  edf_pcpu[id].run_start = now;
+
+  /* Enforce the budget */
+  if(phys_cpu->current_vcpu != NULL){
+    alarm = now + phys_cpu->current_vcpu->sched.credit;
+#if CONFIG_EDF_MIXED_CRITICALITY
+    /* Also schedule again when the high criticality mode ends */
+    if(edf_hi_mode && edf_hi_mode_end < alarm)
+      alarm = edf_hi_mode_end;
+#endif
+    hyp_timer_alarm_set(phys_cpu, alarm, edf_budget_alarm);
+  }else
+    hyp_timer_alarm_cancel(phys_cpu);
+
+  /* edf_kick() by vcpu_preempt() above needs no more scheduling on this cpu */
+  phys_cpu->schedule_is_needed = 0;
+}
+
+static void edf_dump_ready_vcpu(log_level_t level){
+  rq_node_t *node;
+  vcpu_t *t_vcpu;
+
+  log_printf(level, "Start dump vcpu in edf scheduler ready que\n");
+#if CONFIG_EDF_MIXED_CRITICALITY
+  log_printf(level, "Criticality mode : %s\n", edf_hi_mode? "HI" : "LO");
+#endif
+
+  for(node = edf_runqueue.head[0].next; node != &edf_runqueue.head[0]; node = node->next){
+    t_vcpu = EDF_VCPU(node);
+    log_printf(level, "ready vm:%s vcpu_id:%d deadline:%#x budget:%d\n",
+        t_vcpu->vm->name, t_vcpu->vcpu_id, t_vcpu->sched.deadline, t_vcpu->sched.credit);
+  }
+
+  log_printf(level, "=================   End   =================\n");
+}
@@ -12,6 +12,7 @@
 #include "vm.h"
 #include "smp_mbox.h"
 #include "vcpu.h"
+#include "runqueue.h"
 #include "schedule.h"
 
 static scheduler_init_fn_t    fcfs_scheduler_init;
@@ -30,90 +31,59 @@ scheduler_t fcfs_scheduler = {
   fcfs_scheduler_remove,
   fcfs_schedule,
   fcfs_dump_ready_vcpu,
+  NULL,
 };
 
 #define MAX_PRIORITY 15
 
 #define PRIORITY_NUM  MAX_PRIORITY+1
 
-static struct {
-  vcpu_t *head;
-  vcpu_t *tail;
-} ready_vcpu[PRIORITY_NUM];
+/* Priority 0 is the highest */
+static runqueue_t fcfs_runqueue;
 
 /*
  * fcfs_scheduler_init() is called in scheduler_init()
  * after fcfs_scheduler.phys_cpu and fcfs_scheduler.pcpu%num are set.
  */
 static void fcfs_scheduler_init(void){
-  int i;
-
-  for (i = 0; i < PRIORITY_NUM; i++) {
-    ready_vcpu[i].head = NULL;
-    ready_vcpu[i].tail = NULL;
-  }
+  runqueue_init(&fcfs_runqueue);
 }
 
 /* Add vcpu to the tail of ready que */
 static void fcfs_scheduler_add(vcpu_t *vcpu){
   int i;
-  vcpu_t *t_vcpu;
 
-  if(vcpu->vm->priority > MAX_PRIORITY)
-    hyp_panic("Illegal priority : %d\n", vcpu->vm->priority);
+  if(vcpu->vm->sched_param.priority < 0 || vcpu->vm->sched_param.priority > MAX_PRIORITY)
+    hyp_panic("Illegal priority : %d\n", vcpu->vm->sched_param.priority);
 
   /* Set schedule need flag of each cpu which uses this scheduler */
   for(i=0; i<fcfs_scheduler.pcpu_num; i++){
     fcfs_scheduler.phys_cpu[i]->schedule_is_needed = 1;
+    if(fcfs_scheduler.phys_cpu[i] != get_current_phys_cpu())
+      smp_send_mailbox(fcfs_scheduler.phys_cpu[i]->cpu_id, MAIL_TYPE_SCHEDULE);
   }
 
-  if(ready_vcpu[vcpu->vm->priority].head ==NULL)
-    ready_vcpu[vcpu->vm->priority].head = vcpu;
-  else
-    ready_vcpu[vcpu->vm->priority].tail->next = vcpu;
-  
-  ready_vcpu[vcpu->vm->priority].tail = vcpu;
-  vcpu->next = NULL;
+  runqueue_add(&fcfs_runqueue, &vcpu->rq_node, vcpu->vm->sched_param.priority);
 }
 
 static void fcfs_scheduler_remove(vcpu_t *vcpu){
   int i;
-  vcpu_t *t_vcpu;
   
   log_debug("Remove a vcpu from fcfs scheduler's ready vcpu : vm name : %s, priority : %d\n",
-      vcpu->vm->name, vcpu->vm->priority);
+      vcpu->vm->name, vcpu->vm->sched_param.priority);
 
-  if(ready_vcpu[vcpu->vm->priority].head == NULL){
+  if(!rq_node_is_queued(&vcpu->rq_node)){
     log_warn("You shoudn't try to remove vcpu which has already removed from  ready vcpu.\n");
     return;
   }
 
-  if(vcpu == ready_vcpu[vcpu->vm->priority].head){
-    ready_vcpu[vcpu->vm->priority].head = vcpu->next;
-    if(vcpu == ready_vcpu[vcpu->vm->priority].tail)
-      ready_vcpu[vcpu->vm->priority].tail = NULL;
-  }else{
-    for(t_vcpu = ready_vcpu[vcpu->vm->priority].head; ;  t_vcpu = t_vcpu->next){
-
-      // This vcpu has already removed from  ready vcpu
-      if(t_vcpu == ready_vcpu[vcpu->vm->priority].tail){
-        log_warn("You shoudn't try to remove vcpu which has already removed from  ready vcpu.\n");
-        return;
-      }
-      if(t_vcpu->next == vcpu)
-        break;
-    }
-    //prev_vcpu->next = vcpu->next
-    t_vcpu->next = t_vcpu->next->next;
-    if(vcpu == ready_vcpu[vcpu->vm->priority].tail)
-      ready_vcpu[vcpu->vm->priority].tail = t_vcpu;
-  }
-
-  vcpu->next = NULL;
+  runqueue_remove(&fcfs_runqueue, &vcpu->rq_node);
 
   /* Set schedule need flag of each cpu which uses this scheduler */
   for(i=0; i<fcfs_scheduler.pcpu_num; i++){
     fcfs_scheduler.phys_cpu[i]->schedule_is_needed = 1;
+    if(fcfs_scheduler.phys_cpu[i] != get_current_phys_cpu())
+      smp_send_mailbox(fcfs_scheduler.phys_cpu[i]->cpu_id, MAIL_TYPE_SCHEDULE);
   }
 
 }
@@ -121,25 +91,19 @@ static void fcfs_scheduler_remove(vcpu_t *vcpu){
 /* TODO : Support multi core */
 static void fcfs_schedule(pcpu_t *phys_cpu){
   int i;
+  rq_node_t *node;
 
   phys_cpu->schedule_is_needed = 0;
 
-  /* Find a vcpu with the highest priority in readyque */
-  for (i = 0; i < PRIORITY_NUM; i++) {
-    if (ready_vcpu[i].head != NULL)
-      break;
-  }
+  /* Take a vcpu with the highest priority from readyque */
+  /* Do not use scheduler_remove for flags  */
+  node = runqueue_pop(&fcfs_runqueue);
   
   /* Not found */
-  if (i == PRIORITY_NUM)
+  if (node == NULL)
     return;
 
-  phys_cpu->current_vcpu = ready_vcpu[i].head; /* Set as current vcpu */
-  
-  /* Remove this vcpu from readyque */
-  /* Do not use scheduler_remove for flags  */
-  ready_vcpu[i].head = ready_vcpu[i].head->next;
-  phys_cpu->current_vcpu->next = NULL;
+  phys_cpu->current_vcpu = RQ_NODE_ENTRY(node, vcpu_t, rq_node); /* Set as current vcpu */
 
   /* 
    * check whether the other physical cpu(s) which use this scheduler need to schedule,
@@ -155,19 +119,19 @@ static void fcfs_schedule(pcpu_t *phys_cpu){
 
 static void fcfs_dump_ready_vcpu(log_level_t level){
   int i;
+  rq_node_t *node;
   vcpu_t *t_vcpu;
 
   log_printf(level, "Start dump vcpu in fcfs scheduler ready que\n");
   
   for (i = 0; i < PRIORITY_NUM; i++) {
-    if (ready_vcpu[i].head == NULL)
+    if (!(fcfs_runqueue.bitmap & RQ_PRIO_BIT(i)))
       continue;
 
     log_printf(level, "Priority level : %d\n", i);
-    t_vcpu = ready_vcpu[i].head;
-    while(t_vcpu != NULL){
+    for(node = fcfs_runqueue.head[i].next; node != &fcfs_runqueue.head[i]; node = node->next){
+      t_vcpu = RQ_NODE_ENTRY(node, vcpu_t, rq_node);
       log_printf(level, "ready vm:%s vcpu_id:%d\n", t_vcpu->vm->name, t_vcpu->vcpu_id);
-      t_vcpu = t_vcpu->next;
     }
   }
   log_printf(level, "=================   End   =================\n");
@@ -0,0 +1,376 @@
+/*
+ * bench.c
+ * Virtualization microbenchmarks run as a guest of semzhu-visor
+ *
+ * Every result is sent to the hypervisor by HYP_CALL_PUTS
+ * as one machine-readable line on the hypervisor's UART :
+ *
+ *  BENCH_BEGIN version=1 cntfrq=<Hz>
+ *  BENCH name=<test> n=<samples> min=<v> avg=<v> max=<v> miss=<n> unit=<cycles|ticks>
+ *  BENCH_STAMP name=vcpu_switch i=<k> out=<ticks> in=<ticks>
+ *  BENCH_END
+ *
+ * "cycles" are PMCCNTR_EL0 counts and "ticks" are CNTVCT_EL0 counts.
+ * Run it by "make run" of the hypervisor (QEMU with -icount)
+ * after setting CONFIG_GUEST_BENCH in hyp_config.h.
+ */
+
+#include "typedef.h"
+#include "lib.h"
+#include "bench.h"
+
+#define __stringify_1(x) #x
+#define __stringify(x)   __stringify_1(x)
+
+#define HYP_CALL(num) asm volatile("hvc #" __stringify(num) : : : "memory")
+
+#define READ_SYSREG(dst, sys_reg) \
+  asm volatile("mrs %0, " __stringify(sys_reg) : "=r" (dst))
+#define WRITE_SYSREG(sys_reg, v) \
+  asm volatile("msr " __stringify(sys_reg) ", %0" : : "r" ((uint64_t)(v)))
+#define ISB   asm volatile("isb" : : : "memory")
+
+/* BCM2836 Interrupt Controller, fully virtualized */
+#define ARM_CORE_GPU_IRQ_ROUTING          0x4000000C
+#define ARM_CORE0_CORE_TIMER_INT_CONTROL  0x40000040
+#define ARM_CORE0_MAILBOX_INT_CONTROL     0x40000050
+#define ARM_CORE_IRQ_CNTVIRQ    3
+
+/* GPIO, exclusively virtualized */
+#define GPLEV0    0x3F200034
+#define GPPUD     0x3F200094
+
+#define CNTV_CTL_ENABLE   (1 << 0)
+#define ISR_EL1_I         (1 << 7)
+
+#define BENCH_LOOP_NUM      1000
+#define BENCH_IRQ_LOOP_NUM  32
+#define BENCH_STAMP_NUM     8
+#define BENCH_SPIN_TIMEOUT  1000000
+
+static char *hyp_msg = (char *)(0x100000);
+static char *msg_p;
+static uint64_t cntfrq;
+
+typedef struct _bench_stat_t {
+  uint64_t n;
+  uint64_t min;
+  uint64_t max;
+  uint64_t sum;
+  uint64_t miss;  // samples which timed out or woke up too early
+} bench_stat_t;
+
+/*
+ * Output via HYP_CALL_PUTS
+ */
+static void msg_begin(void){
+  msg_p = hyp_msg;
+}
+
+static void msg_str(const char *s){
+  while(*s)
+    *(msg_p++) = *(s++);
+}
+
+static void msg_u64(uint64_t v){
+  char buf[20];
+  int i = 0;
+
+  do{
+    buf[i++] = '0' + v % 10;
+    v /= 10;
+  }while(v);
+
+  while(i)
+    *(msg_p++) = buf[--i];
+}
+
+static void msg_field(const char *key, uint64_t v){
+  msg_str(key);
+  msg_u64(v);
+}
+
+static void msg_end(void){
+  *(msg_p++) = '\n';
+  *msg_p = '\0';
+  HYP_CALL(HYP_CALL_PUTS);
+}
+
+/*
+ * Counters
+ */
+static inline uint64_t cycles(void){
+  uint64_t v;
+  ISB;
+  READ_SYSREG(v, PMCCNTR_EL0);
+  return v;
+}
+
+static inline uint64_t ticks(void){
+  uint64_t v;
+  ISB;
+  READ_SYSREG(v, CNTVCT_EL0);
+  return v;
+}
+
+static void stat_init(bench_stat_t *s){
+  s->n = 0;
+  s->min = ~0ULL;
+  s->max = 0;
+  s->sum = 0;
+  s->miss = 0;
+}
+
+static void stat_add(bench_stat_t *s, uint64_t v){
+  s->n++;
+  s->sum += v;
+  if(v < s->min)
+    s->min = v;
+  if(v > s->max)
+    s->max = v;
+}
+
+static void stat_print(const char *name, bench_stat_t *s, const char *unit){
+  msg_begin();
+  msg_str("BENCH name=");
+  msg_str(name);
+  msg_field(" n=", s->n);
+  msg_field(" min=", s->n ? s->min : 0);
+  msg_field(" avg=", s->n ? s->sum / s->n : 0);
+  msg_field(" max=", s->max);
+  msg_field(" miss=", s->miss);
+  msg_str(" unit=");
+  msg_str(unit);
+  msg_end();
+}
+
+/*
+ * MMIO accessors
+ * Keep Rt in $x0~$x9 so that the fast exit path can emulate the load.
+ */
+static inline uint32_t mmio_read32(phys_addr_t addr){
+  register phys_addr_t x0 asm("x0") = addr;
+  register uint32_t w1 asm("w1");
+  asm volatile("ldr %w0, [%1]" : "=r" (w1) : "r" (x0) : "memory");
+  return w1;
+}
+
+static inline void mmio_write32(phys_addr_t addr, uint32_t value){
+  register phys_addr_t x0 asm("x0") = addr;
+  register uint32_t w1 asm("w1") = value;
+  asm volatile("str %w1, [%0]" : : "r" (x0), "r" (w1) : "memory");
+}
+
+/*
+ * Virtual timer
+ * Its interrupt is routed to this vcpu by the virtual BCM2836 IC.
+ */
+static inline void vtimer_arm(uint64_t cval){
+  WRITE_SYSREG(CNTV_CVAL_EL0, cval);
+  WRITE_SYSREG(CNTV_CTL_EL0, CNTV_CTL_ENABLE);
+  ISB;
+}
+
+static inline void vtimer_disarm(void){
+  WRITE_SYSREG(CNTV_CTL_EL0, 0);
+  ISB;
+}
+
+static inline uint64_t virq_is_pending(void){
+  uint64_t isr;
+  READ_SYSREG(isr, ISR_EL1);
+  return isr & ISR_EL1_I;
+}
+
+/*
+ * A virtual IRQ stays asserted in HCR_EL2.VI until the next slow exit.
+ * Take one so that the next sample starts without a pending virtual IRQ.
+ */
+static void virq_drain(void){
+  int i;
+
+  vtimer_disarm();
+  for(i = 0; i < BENCH_SPIN_TIMEOUT && virq_is_pending(); i++)
+    mmio_read32(ARM_CORE0_MAILBOX_INT_CONTROL);
+}
+
+/*
+ * Benchmarks
+ */
+
+/* Cost of the measurement itself */
+static void bench_overhead(void){
+  bench_stat_t s;
+  uint64_t t0;
+  int i;
+
+  stat_init(&s);
+  for(i = 0; i < BENCH_LOOP_NUM; i++){
+    t0 = cycles();
+    stat_add(&s, cycles() - t0);
+  }
+  stat_print("overhead", &s, "cycles");
+}
+
+/* HVC round trip, handled in the fast exit path */
+static void bench_hvc(void){
+  bench_stat_t s;
+  uint64_t t0;
+  int i;
+
+  stat_init(&s);
+  for(i = 0; i < BENCH_LOOP_NUM; i++){
+    t0 = cycles();
+    HYP_CALL(HYP_CALL_NULL);
+    stat_add(&s, cycles() - t0);
+  }
+  stat_print("hvc_null", &s, "cycles");
+}
+
+static void bench_mmio_read(const char *name, phys_addr_t addr){
+  bench_stat_t s;
+  uint64_t t0;
+  int i;
+
+  stat_init(&s);
+  for(i = 0; i < BENCH_LOOP_NUM; i++){
+    t0 = cycles();
+    mmio_read32(addr);
+    stat_add(&s, cycles() - t0);
+  }
+  stat_print(name, &s, "cycles");
+}
+
+static void bench_mmio_write(const char *name, phys_addr_t addr, uint32_t value){
+  bench_stat_t s;
+  uint64_t t0;
+  int i;
+
+  stat_init(&s);
+  for(i = 0; i < BENCH_LOOP_NUM; i++){
+    t0 = cycles();
+    mmio_write32(addr, value);
+    stat_add(&s, cycles() - t0);
+  }
+  stat_print(name, &s, "cycles");
+}
+
+/*
+ * Virtual IRQ injection latency :
+ * from arming an already expired virtual timer
+ * to ISR_EL1.I becoming visible to this vcpu.
+ */
+static void bench_virq_inject(void){
+  bench_stat_t s;
+  uint64_t t0, t1;
+  int i, j;
+
+  stat_init(&s);
+  for(i = 0; i < BENCH_IRQ_LOOP_NUM; i++){
+    virq_drain();
+
+    t0 = cycles();
+    vtimer_arm(ticks());
+    for(j = 0; j < BENCH_SPIN_TIMEOUT && !virq_is_pending(); j++)
+      ;
+    t1 = cycles();
+
+    if(j == BENCH_SPIN_TIMEOUT)
+      s.miss++;
+    else
+      stat_add(&s, t1 - t0);
+  }
+  virq_drain();
+  stat_print("virq_inject", &s, "cycles");
+}
+
+/*
+ * WFI to wake latency :
+ * from the virtual timer deadline to the return from WFI.
+ */
+static void bench_wfi_wake(void){
+  bench_stat_t s;
+  uint64_t deadline, now;
+  int i;
+
+  stat_init(&s);
+  for(i = 0; i < BENCH_IRQ_LOOP_NUM; i++){
+    virq_drain();
+
+    deadline = ticks() + cntfrq / 1000;  /* 1msec */
+    vtimer_arm(deadline);
+    asm volatile("wfi");
+    now = ticks();
+
+    if(now < deadline)
+      s.miss++;
+    else
+      stat_add(&s, now - deadline);
+  }
+  virq_drain();
+  stat_print("wfi_wake", &s, "ticks");
+}
+
+/*
+ * vCPU switch latency between two VMs :
+ * Each bench VM prints when it left (WFI) and when it resumed.
+ * CNTVCT_EL0 is common to the VMs (CNTVOFF_EL2 is 0),
+ * so the switch latency from VM A to VM B is
+ * the "in" stamp of B minus the preceding "out" stamp of A on the same cpu.
+ */
+static void bench_vcpu_switch(void){
+  uint64_t out, in;
+  int i;
+
+  for(i = 0; i < BENCH_STAMP_NUM; i++){
+    virq_drain();
+
+    vtimer_arm(ticks() + cntfrq / 1000);
+    out = ticks();
+    asm volatile("wfi");
+    in = ticks();
+
+    msg_begin();
+    msg_str("BENCH_STAMP name=vcpu_switch");
+    msg_field(" i=", i);
+    msg_field(" out=", out);
+    msg_field(" in=", in);
+    msg_end();
+  }
+  virq_drain();
+}
+
+void bench_run(void){
+  READ_SYSREG(cntfrq, CNTFRQ_EL0);
+
+  /* Enable and reset the cycle counter */
+  HYP_CALL(HYP_CALL_CYCLE_COUNT_START);
+
+  /* Route the virtual timer interrupt to this vcpu */
+  mmio_write32(ARM_CORE0_CORE_TIMER_INT_CONTROL, 1 << ARM_CORE_IRQ_CNTVIRQ);
+
+  msg_begin();
+  msg_field("BENCH_BEGIN version=", BENCH_FORMAT_VERSION);
+  msg_field(" cntfrq=", cntfrq);
+  msg_end();
+
+  bench_overhead();
+  bench_hvc();
+  bench_mmio_read("mmio_ic_read_fast", ARM_CORE_GPU_IRQ_ROUTING);
+  bench_mmio_read("mmio_ic_read", ARM_CORE0_MAILBOX_INT_CONTROL);
+  bench_mmio_write("mmio_ic_write", ARM_CORE_GPU_IRQ_ROUTING, 0);
+  bench_mmio_read("mmio_gpio_read", GPLEV0);
+  bench_mmio_write("mmio_gpio_write", GPPUD, 0);
+  bench_virq_inject();
+  bench_wfi_wake();
+  bench_vcpu_switch();
+
+  msg_begin();
+  msg_str("BENCH_END");
+  msg_end();
+
+  /* Hypervisor side view of the same run, see vcpu_stat.c */
+  register uint64_t x0 asm("x0") = 1;
+  asm volatile("hvc #" __stringify(HYP_CALL_EXIT_STAT_DUMP) : : "r" (x0) : "memory");
+  HYP_CALL(HYP_CALL_CYCLE_COUNT_STOP);
+}
@@ -0,0 +1,16 @@
+#ifndef _BENCH_H_INCLUDED_
+#define _BENCH_H_INCLUDED_
+
+/* Hypervisor call numbers, keep in sync with ../hyp_call.h */
+#define HYP_CALL_PUTS       0
+#define HYP_CALL_CYCLE_COUNT_START 4
+#define HYP_CALL_CYCLE_COUNT_STOP  6
+#define HYP_CALL_NULL       7
+#define HYP_CALL_EXIT_STAT_DUMP 8
+
+/* Version of the BENCH line format, bump it when a field changes */
+#define BENCH_FORMAT_VERSION  1
+
+void bench_run(void);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _TYPEDEF_H_INCLUDED_
+#define _TYPEDEF_H_INCLUDED_
+
+#define NULL ((void *)0)
+
+typedef unsigned char   uint8_t;
+typedef unsigned short  uint16_t;
+typedef unsigned int    uint32_t;
+typedef unsigned long long  uint64_t;
+
+typedef uint64_t  phys_addr_t;
+
+#endif
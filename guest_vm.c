@@ -1,3 +1,4 @@
+#include "hyp_config.h"
 #include "vm.h"
 #include "virt_mmio.h"
 #include "schedule.h"
@@ -22,7 +23,7 @@ mmp_t linux_mmp[] = {
     {.mem_start = 0, .mem_end = 0x7FFFF, .flag = 0},
     {.mem_start = 0x80000, .mem_end = 0x800000 - 1, .img_start = &_linux_img_start, .img_end = &_linux_img_end, .flag = MEM_VM_IMG},
     {.mem_start = 0x800000, .mem_end = 0x800000 + 0x200000 - 1, .img_start = &_bcm2837_rpi_3_b_img_start, .img_end = &_bcm2837_rpi_3_b_img_end, .flag = MEM_VM_IMG},
-    {.mem_start = 0x800000 + 0x200000, .mem_end = 0x8000000 - 1, .flag = 0},
+    {.mem_start = 0x800000 + 0x200000, .mem_end = 0x8000000 - 1, .flag = MEM_ON_DEMAND},
     {.mem_start = 0x8000000, .mem_end = 0x10000000 - 1, .img_start = &_initrd_img_start, .img_end = &_initrd_img_end, .flag = MEM_VM_IMG},
     //{.mem_start = 0x6000000, .mem_end = 0xFFFFFFF, .img_start = &_initrd_img_start, .img_end = &_initrd_img_end, .flag = MEM_VM_IMG}},
     // {.mem_start = 0x100000, .mem_end = 0x100FFF, .flag = MEM_HYP_VM_MSG},
@@ -39,9 +40,35 @@ mmp_t sample_mmp[] = {
     {.mem_start = 0x100000, .mem_end = 0x100FFF, .flag = MEM_HYP_VM_MSG},
 };
 
+/* Each benchmark VM needs its own mmp because vm_create() fills phys_addr */
+mmp_t bench1_mmp[] = {
+    {.mem_start = 0, .mem_end = 0x7FFFF, .flag = 0},
+    {.mem_start = 0x80000, .mem_end = 0xFFFFF, .img_start = &_sampleos_img_start, .img_end = &_sampleos_img_end, .flag = MEM_VM_IMG},
+    {.mem_start = 0x100000, .mem_end = 0x100FFF, .flag = MEM_HYP_VM_MSG},
+};
+
+mmp_t bench2_mmp[] = {
+    {.mem_start = 0, .mem_end = 0x7FFFF, .flag = 0},
+    {.mem_start = 0x80000, .mem_end = 0xFFFFF, .img_start = &_sampleos_img_start, .img_end = &_sampleos_img_end, .flag = MEM_VM_IMG},
+    {.mem_start = 0x100000, .mem_end = 0x100FFF, .flag = MEM_HYP_VM_MSG},
+};
+
+vm_sched_param_t bench_sched_param = {.priority = 3};
+vm_sched_param_t linux_sched_param = {.priority = 6};
+vm_sched_param_t kozos_sched_param = {.priority = 2};
+
 void init_vm_create(void){
+#if CONFIG_GUEST_BENCH
+  /* 
+   * Two guest_os benchmark VMs on the same scheduler,
+   * see guest_os/bench.c for the output format.
+   */
+  vm_create("bench1", 1, &fcfs_scheduler, &bench_sched_param, 0x80000, bench1_mmp, sizeof(bench1_mmp)/sizeof(bench1_mmp[0]), 0, 0, 0, 0, 0);
+  vm_create("bench2", 1, &fcfs_scheduler, &bench_sched_param, 0x80000, bench2_mmp, sizeof(bench2_mmp)/sizeof(bench2_mmp[0]), 0, 0, 0, 0, 0);
+#else
   /* Create vm */
-  vm_create("linux1", 1, &fcfs_scheduler, 6, 0x80000,linux_mmp, sizeof(linux_mmp)/sizeof(linux_mmp[0]), 0, VIRT_INTR_UART, VIRT_MMIO_PL011|VIRT_MMIO_AUX, 0x000fffff00000000);
-  // vm_create("kozos1", 1, &fcfs_scheduler, 2, 0x0000, kozos_mmp, sizeof(kozos_mmp) / sizeof(kozos_mmp[0]), 0, 0, 0, 0);
-  // vm_create("sample1", 1, &fcfs_scheduler, 3, 0x80000, sample_mmp, sizeof(sample_mmp)/sizeof(sample_mmp[0]), 0, 0, 0, 0);
+  vm_create("linux1", 1, &fcfs_scheduler, &linux_sched_param, 0x80000,linux_mmp, sizeof(linux_mmp)/sizeof(linux_mmp[0]), 0, VIRT_INTR_UART, VIRT_MMIO_PL011|VIRT_MMIO_AUX, 0x000fffff00000000, 0);
+  // vm_create("kozos1", 1, &fcfs_scheduler, &kozos_sched_param, 0x0000, kozos_mmp, sizeof(kozos_mmp) / sizeof(kozos_mmp[0]), 0, 0, 0, 0, 0);
+  // vm_create("sample1", 1, &fcfs_scheduler, &bench_sched_param, 0x80000, sample_mmp, sizeof(sample_mmp)/sizeof(sample_mmp[0]), 0, 0, 0, 0, 0);
+#endif
 }
@@ -7,19 +7,17 @@
 #include "vcpu.h"
 #include "vm.h"
 #include "hyp_call.h"
+#include "hyp_ring.h"
 #include "hyp_mmu.h"
-
-#define HYP_CALL_PUTS       0
-#define HYP_CALL_FORCE_SHUTDOWN 1
-#define HYP_CALL_SEND_MAIL  2
-#define HYP_CALL_RECV_MAIL  3
-#define HYP_CALL_CYCLE_COUNT_START 4
-#define HYP_CALL_CYCLE_COUNT_READ  5
-#define HYP_CALL_CYCLE_COUNT_STOP  6
+#include "malloc.h"
+#include "vm_checkpoint.h"
+#include "vm_mem.h"
+#include "vcpu_stat.h"
 
 void hyp_call(vcpu_t *vcpu, uint64_t type){
 
   log_debug("HVC #%#x\n", type);
+  vcpu_stat_hvc(vcpu, type);
 
   switch(type){
     case HYP_CALL_PUTS:
@@ -48,6 +46,52 @@ void hyp_call(vcpu_t *vcpu, uint64_t type){
     case HYP_CALL_CYCLE_COUNT_STOP: 
       log_info("CPU execute cycle count : %#x\n", cycle_count_stop());
       break;
+
+    case HYP_CALL_NULL:
+      /* Usually handled in fast_exit_hvc */
+      break;
+
+    case HYP_CALL_EXIT_STAT_DUMP:
+#if CONFIG_EXIT_STAT
+      {
+        int i;
+
+        for(i=0; i<vcpu->vm->vcpu_num; i++){
+          vcpu_stat_dump(vcpu->vm->vcpu[i], LOG_INFO);
+          if(vcpu->reg.x[0])
+            vcpu_stat_reset(vcpu->vm->vcpu[i]);
+        }
+      }
+#else
+      log_warn("VM exit stat is disabled. Set CONFIG_EXIT_STAT in hyp_config.h\n");
+#endif
+      break;
+
+    case HYP_CALL_RING_SUBMIT:
+      vcpu->reg.x[0] = hyp_ring_submit(vcpu);
+      break;
+
+    case HYP_CALL_CHECKPOINT:
+      vcpu->reg.x[0] = vm_checkpoint(vcpu->vm);
+      break;
+
+    case HYP_CALL_BALLOON_INFLATE:
+      vcpu->reg.x[0] = vm_mem_balloon_inflate(vcpu->vm, vcpu->reg.x[0], vcpu->reg.x[1]);
+      break;
+
+    case HYP_CALL_BALLOON_DEFLATE:
+      vcpu->reg.x[0] = vm_mem_balloon_deflate(vcpu->vm, vcpu->reg.x[0], vcpu->reg.x[1]);
+      break;
+
+    case HYP_CALL_MEM_STAT:
+      {
+        mem_stat_t stat;
+
+        mem_stat_dump(LOG_INFO);
+        mem_stat_get(&stat);
+        vcpu->reg.x[0] = stat.free_page_num * PAGE_SIZE;
+      }
+      break;
     
     default:
       log_error("Illegal Hypervisor call : HVC #%#x\n", type);
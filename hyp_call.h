@@ -1,11 +1,31 @@
 #ifndef _HYP_CALL_H_INCLUDED_
 #define _HYP_CALL_H_INCLUDED_
 
- #include "typedef.h"
-
 #define HYP_VM_MSG_SIZE  0x1000
 
+/* Hypervisor call numbers (HVC #imm16) */
+#define HYP_CALL_PUTS       0
+#define HYP_CALL_FORCE_SHUTDOWN 1
+#define HYP_CALL_SEND_MAIL  2
+#define HYP_CALL_RECV_MAIL  3
+#define HYP_CALL_CYCLE_COUNT_START 4
+#define HYP_CALL_CYCLE_COUNT_READ  5
+#define HYP_CALL_CYCLE_COUNT_STOP  6
+#define HYP_CALL_NULL       7   /* Do nothing, handled in the fast exit path */
+#define HYP_CALL_EXIT_STAT_DUMP 8 /* Dump VM exit stat of the vm, reset it if x0 != 0 */
+#define HYP_CALL_RING_SUBMIT 9  /* Execute the queued entries of the ring in hyp_msg, see hyp_ring.h */
+#define HYP_CALL_CHECKPOINT 10  /* Copy the pages written since the last checkpoint, see vm_checkpoint.c. x0 = -1 without VM_OPT_CHECKPOINT, -2 if out of memory */
+#define HYP_CALL_BALLOON_INFLATE 11 /* Give back [x0, x0 + x1) of guest memory, see vm_mem.c */
+#define HYP_CALL_BALLOON_DEFLATE 12 /* Take back [x0, x0 + x1) of guest memory, x0 = -2 if the host is out of memory */
+#define HYP_CALL_MEM_STAT   13  /* Dump the hypervisor memory statistics, return the free bytes in x0 */
+
+#ifndef __ASSEMBLER__
+
+#include "typedef.h"
+
 /* Hypervisor Call */
 void hyp_call(vcpu_t *vcpu, uint64_t type);
 
 #endif
+
+#endif
@@ -4,6 +4,12 @@
 #define CONFIG_DEBUG 0
 #define CONFIG_USE_PMU 1
   #define CONFIG_DUMP_CPU_USAGE 0
+  #define CONFIG_EXIT_STAT 0  /* Per-vcpu VM exit statistics, see vcpu_stat.c */
+
+#define CONFIG_GUEST_BENCH 0 /* Run guest_os benchmark VMs instead of linux, see guest_os/bench.c */
+#define CONFIG_VM_IMG_ZERO_COPY 1 /* Map page aligned guest images in place, see vm_mem.c */
+#define CONFIG_MEM_BENCH 0  /* Measure memset() and memcpy() at boot, see mem_bench.c */
+#define CONFIG_EDF_MIXED_CRITICALITY 1 /* Suspend VM_CRIT_LO vms on a VM_CRIT_HI budget overrun, see edf_schedule.c */
 
 #define CONFIG_ 0
 
@@ -7,7 +7,10 @@
 #include "lib.h"
 #include "coproc_def.h"
 #include "asm_func.h"
+#include "spinlock.h"
+#include "pcpu.h"
 #include "hyp_mmu.h"
+#include "slab.h"
 
 /* 
  * Stage 2 MMU control registers are :
@@ -19,12 +22,12 @@
 #define VTCR_RES  (1 << 31) // Reserved value
 #define TTBL_VALID_MASK			  1
 #define TTBL_TABLE_MASK		    0b10
-#define MAX_PAGE_TABLE_NUM    512
 
 typedef uint64_t ttbl_t;
 
-static void map_ttbl(ttbl_t *l1_ttbl, phys_addr_t IA, phys_addr_t OA);
+static void map_ttbl(ttbl_t *l1_ttbl, uint64_t vmid, phys_addr_t IA, phys_addr_t OA, uint64_t size, uint64_t attr);
 static ttbl_t *alloc_ttbl(void);
+static void free_ttbl(ttbl_t *ttbl);
 
 /* TODO : Support smp */
 void mmu_init(void)
@@ -64,95 +67,665 @@ void mmu_switch(ttbl_t stage1_ttbr, ttbl_t stage2_ttbr){
   asm volatile("tlbi vmalle1");
 }
 
-void set_vttbr(uint64_t vttbr){
+/*
+ * Stage 2 translations and their TLB entries are tagged with an 8bit VMID,
+ * so switching VTTBR_EL2 between VMs does not need a TLB flush.
+ */
+void set_vttbr(uint64_t vttbr, uint64_t vmid){
   /* clear pipeline */
   asm volatile("dsb sy");
-  
-  asm volatile("tlbi vmalle1");
 
   /* VTTBR_EL2 */
+  vttbr = (vttbr & ~VTTBR_VMID_MASK) | ((vmid & VMID_MASK) << VTTBR_VMID_SHIFT);
   asm volatile ("msr vttbr_el2, %0" : : "r" ((phys_addr_t)vttbr));
   asm volatile ("isb");
 }
 
+/*
+ * VMID allocation
+ *
+ * vm->vmid holds (generation << VMID_BITS) | VMID.
+ * A VMID is valid only while its generation is vmid_generation.
+ * VMIDs are never reused in a generation.
+ * When they run out, the generation is rolled over,
+ * all TLB entries of EL1&0 are invalidated once,
+ * and the VMIDs which are running on physical cpus are carried over.
+ *
+ * active_vmid[] is written by each cpu without vmid_lock.
+ * The rollover exchanges it with 0 and keeps the VMID in reserved_vmid[]
+ * until the cpu switches VMIDs, so the fast path of vmid_update()
+ * sets it by compare and exchange from a non zero value,
+ * which fails once a rollover has taken it (as Linux does).
+ */
+static uint64_t vmid_generation = VMID_NUM;   // Generation 1
+static uint64_t vmid_map[VMID_NUM / 64] = {1}; // VMID 0 is not used
+static uint64_t vmid_next = 1;
+static uint64_t active_vmid[CPU_NUM];
+static uint64_t reserved_vmid[CPU_NUM];
+static int vmid_lock = 0;
+
+#define VMID_MAP_TEST(n)  (vmid_map[(n) / 64] & (1ULL << ((n) % 64)))
+#define VMID_MAP_SET(n)   (vmid_map[(n) / 64] |= (1ULL << ((n) % 64)))
+
+/* Called with vmid_lock */
+static void vmid_rollover(void){
+  uint64_t vmid;
+  int i;
+
+  memset(vmid_map, 0, sizeof(vmid_map));
+  VMID_MAP_SET(0);
+  __atomic_store_n(&vmid_generation, vmid_generation + VMID_NUM, __ATOMIC_RELAXED);
+  vmid_next = 1;
+
+  for(i=0; i<CPU_NUM; i++){
+    vmid = __atomic_exchange_n(&active_vmid[i], 0, __ATOMIC_RELAXED);
+    /* A cpu which has not switched since the last rollover keeps its VMID */
+    if(vmid == 0)
+      vmid = reserved_vmid[i];
+    reserved_vmid[i] = vmid;
+    if(vmid != 0)
+      VMID_MAP_SET(vmid & VMID_MASK);
+  }
+
+  asm volatile("dsb ishst");
+  asm volatile("tlbi alle1is");
+  asm volatile("dsb ish");
+  asm volatile("isb");
+}
+
+static uint64_t vmid_alloc(void){
+  uint64_t n;
+
+  for(n = vmid_next; n < VMID_NUM; n++){
+    if(!VMID_MAP_TEST(n))
+      break;
+  }
+
+  if(n == VMID_NUM){
+    vmid_rollover();
+    for(n = vmid_next; VMID_MAP_TEST(n); n++)
+      ;
+  }
+
+  VMID_MAP_SET(n);
+  vmid_next = n + 1;
+  return vmid_generation | n;
+}
+
+/* Whether vmid was carried over by a rollover. Called with vmid_lock */
+static int vmid_is_reserved(uint64_t vmid){
+  int i;
+
+  for(i=0; i<CPU_NUM; i++){
+    if(vmid != 0 && reserved_vmid[i] == vmid)
+      return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Make *vmid valid in the current generation,
+ * mark it as running on this physical cpu and return the 8bit VMID.
+ */
+uint64_t vmid_update(uint64_t *vmid){
+  uint32_t cpu_id = get_current_phys_cpu()->cpu_id;
+  uint64_t old_active;
+  uint64_t new_vmid;
+  int i;
+
+  /*
+   * Fast path : The VMID is still valid.
+   * The exchange fails if a rollover has cleared active_vmid meanwhile.
+   */
+  old_active = __atomic_load_n(&active_vmid[cpu_id], __ATOMIC_RELAXED);
+  if(old_active != 0
+      && (*vmid & ~VMID_MASK) == __atomic_load_n(&vmid_generation, __ATOMIC_RELAXED)
+      && __atomic_compare_exchange_n(&active_vmid[cpu_id], &old_active, *vmid,
+          0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    return *vmid & VMID_MASK;
+
+  spin_lock(&vmid_lock);
+
+  if((*vmid & ~VMID_MASK) != vmid_generation){
+    /* A vmid running on a physical cpu at the rollover keeps its VMID */
+    if(vmid_is_reserved(*vmid)){
+      new_vmid = vmid_generation | (*vmid & VMID_MASK);
+      for(i=0; i<CPU_NUM; i++){
+        if(reserved_vmid[i] == *vmid)
+          reserved_vmid[i] = new_vmid;
+      }
+      *vmid = new_vmid;
+    }else{
+      *vmid = vmid_alloc();
+    }
+
+    log_debug("New vmid : %#x\n", *vmid);
+  }
+  __atomic_store_n(&active_vmid[cpu_id], *vmid, __ATOMIC_RELAXED);
+
+  spin_unlock(&vmid_lock);
+
+  return *vmid & VMID_MASK;
+}
+
+/*
+ * TLBI IPAS2E1IS and VMALLS12E1IS use the VMID of VTTBR_EL2,
+ * so switch to vmid temporarily and return the original VTTBR_EL2.
+ */
+static uint64_t vttbr_switch_vmid(uint64_t vmid){
+  uint64_t vttbr;
+
+  READ_SYSREG(vttbr, VTTBR_EL2);
+  WRITE_SYSREG(VTTBR_EL2, (vttbr & ~VTTBR_VMID_MASK)
+      | ((vmid & VMID_MASK) << VTTBR_VMID_SHIFT));
+  asm volatile("isb");
+
+  return vttbr;
+}
+
+/*
+ * Whether vmid may have TLB entries.
+ * The entries of an old generation were invalidated by the rollover,
+ * unless the rollover carried the VMID over for a running vm which
+ * has not updated its vm->vmid yet.
+ */
+static int vmid_may_be_cached(uint64_t vmid){
+  int cached;
+
+  if((vmid & ~VMID_MASK) == __atomic_load_n(&vmid_generation, __ATOMIC_RELAXED))
+    return 1;
+
+  spin_lock(&vmid_lock);
+  cached = vmid_is_reserved(vmid);
+  spin_unlock(&vmid_lock);
+
+  return cached;
+}
+
+/*
+ * Invalidate the stage 2 TLB entries of ipa
+ * after the mapping of ipa was changed or removed.
+ */
+void tlb_flush_ipa(uint64_t vmid, phys_addr_t ipa){
+  uint64_t vttbr;
+
+  if(!vmid_may_be_cached(vmid))
+    return;
+
+  vttbr = vttbr_switch_vmid(vmid);
+
+  asm volatile("dsb ishst");
+  asm volatile("tlbi ipas2e1is, %0" : : "r" (ipa >> 12));
+  asm volatile("dsb ish");
+  /* Combined stage 1 and 2 entries are not tagged by ipa */
+  asm volatile("tlbi vmalle1is");
+  asm volatile("dsb ish");
+
+  WRITE_SYSREG(VTTBR_EL2, vttbr);
+  asm volatile("isb");
+}
+
+/* Invalidate every TLB and walk cache entry of vmid */
+void tlb_flush_vmid(uint64_t vmid){
+  uint64_t vttbr;
+
+  if(!vmid_may_be_cached(vmid))
+    return;
+
+  vttbr = vttbr_switch_vmid(vmid);
+
+  asm volatile("dsb ishst");
+  asm volatile("tlbi vmalls12e1is");
+  asm volatile("dsb ish");
+
+  WRITE_SYSREG(VTTBR_EL2, vttbr);
+  asm volatile("isb");
+}
+
+/* Descriptor address mask of a table, a block or a page */
+#define TTBL_ADDR_MASK  0xFFFFFFFFF000
+
+/* 
+ * Attributes of stage 2 block and page descriptors
+ * Memory types and permissions are given by the callers, see hyp_mmu.h.
+ */
+#define TTBL_S2_ATTR  (1<<10)   /* AF, The Access flag */
+
+#define TTBL_IS_TABLE(desc) (((desc)&(TTBL_TABLE_MASK|TTBL_VALID_MASK)) == (TTBL_TABLE_MASK|TTBL_VALID_MASK))
+#define TTBL_IS_BLOCK(desc) (((desc)&(TTBL_TABLE_MASK|TTBL_VALID_MASK)) == TTBL_VALID_MASK)
+
+/*
+ * Page tables
+ *
+ * Tables are allocated from ttbl_cache and released tables are recycled.
+ * The private data of each table in its slab counts its valid descriptors,
+ * and a level 2 or 3 table is released when the count drops to 0 by unmapping.
+ * The page tables of all the vms are protected by ttbl_lock.
+ */
+static slab_cache_t ttbl_cache = SLAB_CACHE_INIT("ttbl", sizeof(ttbl_t) * 512, sizeof(uint16_t));
+static int ttbl_lock = 0;
+
+#define TTBL_REFCNT(ttbl) (*(uint16_t *)slab_obj_priv(&ttbl_cache, (ttbl)))
+#define TTBL_NEXT(desc)   ((ttbl_t *)((desc)&TTBL_ADDR_MASK))
+
+/* Write desc to ttbl[index] and keep the reference count of ttbl */
+static void set_desc(ttbl_t *ttbl, int index, ttbl_t desc){
+  if(!(ttbl[index]&TTBL_VALID_MASK) && (desc&TTBL_VALID_MASK))
+    TTBL_REFCNT(ttbl)++;
+  else if((ttbl[index]&TTBL_VALID_MASK) && !(desc&TTBL_VALID_MASK))
+    TTBL_REFCNT(ttbl)--;
+
+  ttbl[index] = desc;
+}
+
+/* Release ttbl of level and all the tables under it */
+static void free_ttbl_tree(ttbl_t *ttbl, int level){
+  int i;
+
+  if(level < 3){
+    for(i=0; i<512; i++){
+      if(TTBL_IS_TABLE(ttbl[i]))
+        free_ttbl_tree(TTBL_NEXT(ttbl[i]), level + 1);
+    }
+  }
+
+  free_ttbl(ttbl);
+}
+
+/* Invalidate ttbl[index] of level, the tables under it are released */
+static void clear_desc(ttbl_t *ttbl, int index, int level){
+  if(level < 3 && TTBL_IS_TABLE(ttbl[index]))
+    free_ttbl_tree(TTBL_NEXT(ttbl[index]), level + 1);
+
+  set_desc(ttbl, index, 0);
+}
+
+/*
+ * Break before make : invalidate ttbl[index] of level which maps IA
+ * and its TLB entries before the descriptor is replaced.
+ * The tables under it are released after the walk caches are invalidated,
+ * since they may be reused by another vm at once.
+ */
+static void break_desc(ttbl_t *ttbl, int index, int level, uint64_t vmid, phys_addr_t IA){
+  ttbl_t desc = ttbl[index];
+
+  if(!(desc&TTBL_VALID_MASK))
+    return;
+
+  set_desc(ttbl, index, 0);
+
+  if(level < 3 && TTBL_IS_TABLE(desc)){
+    tlb_flush_vmid(vmid);
+    free_ttbl_tree(TTBL_NEXT(desc), level + 1);
+  }else{
+    tlb_flush_ipa(vmid, IA);
+  }
+}
+
+/*
+ * Return the next level table of ttbl[index] which maps IA.
+ * If the descriptor is invalid, allocate a table.
+ * If the descriptor is a block, split it into a table of smaller blocks or pages.
+ * The live block is invalidated and flushed from the TLB of vmid
+ * before the table is installed (break before make).
+ */
+static ttbl_t *next_ttbl(ttbl_t *ttbl, int index, uint64_t entry_size, uint64_t vmid, phys_addr_t IA){
+  ttbl_t desc = ttbl[index];
+  ttbl_t *next;
+  int i;
+
+  if(TTBL_IS_TABLE(desc))
+    return TTBL_NEXT(desc);
+
+  next = alloc_ttbl();
+
+  if(TTBL_IS_BLOCK(desc)){
+    for(i=0; i<512; i++){
+      next[i] = (desc&~TTBL_ADDR_MASK) + (desc&TTBL_ADDR_MASK) + i*entry_size;
+      /* Level 3 descriptors are pages */
+      if(entry_size == PAGE_SIZE)
+        next[i] |= TTBL_TABLE_MASK;
+    }
+    TTBL_REFCNT(next) = 512;
+
+    set_desc(ttbl, index, 0);
+    tlb_flush_ipa(vmid, IA);
+  }
+
+  set_desc(ttbl, index, (phys_addr_t)next | TTBL_TABLE_MASK | TTBL_VALID_MASK);
+  return next;
+}
+
 /**
  * @fn
+ * Map a block or a page
  * @param (l1_ttbl) pointer to leval 1 page table address
+ * @param (vmid) vm->vmid of the page table
  * @param (IA)  Intermediate physical address
  * @param (OA)  Physical address
+ * @param (size) BLOCK_1G_SIZE, BLOCK_2M_SIZE or PAGE_SIZE
+ * @param (attr) S2_ATTR_* or a combination of S2_MEMATTR_*, S2AP_* and S2_XN
  */
-static void map_ttbl(ttbl_t *l1_ttbl, phys_addr_t IA, phys_addr_t OA){
+static void map_ttbl(ttbl_t *l1_ttbl, uint64_t vmid, phys_addr_t IA, phys_addr_t OA, uint64_t size, uint64_t attr){
   ttbl_t * l2_ttbl;
   ttbl_t * l3_ttbl;
 
-  /* Setup level1 table */
-  if(l1_ttbl[(IA>>30)&0x1ff]&TTBL_VALID_MASK){
-    l2_ttbl = l1_ttbl[IA>>30]&0xFFFFFFFFF000;
-  }else{
-    l2_ttbl = alloc_ttbl();
-    l1_ttbl[(IA>>30)&0x1ff] = (phys_addr_t)l2_ttbl | TTBL_TABLE_MASK | TTBL_VALID_MASK;
+  /* Setup level1 block or table */
+  if(size == BLOCK_1G_SIZE){
+    break_desc(l1_ttbl, (IA>>30)&0x1ff, 1, vmid, IA);
+    set_desc(l1_ttbl, (IA>>30)&0x1ff, OA | TTBL_S2_ATTR | attr | TTBL_VALID_MASK);
+    return;
   }
+  l2_ttbl = next_ttbl(l1_ttbl, (IA>>30)&0x1ff, BLOCK_2M_SIZE, vmid, IA);
 
-  /* Setup level2 table */
-  if(l2_ttbl[(IA>>21)&0x1ff]&TTBL_VALID_MASK){
-    l3_ttbl = l2_ttbl[IA>>21]&0xFFFFFFFFF000;
-  }else{
-    l3_ttbl = alloc_ttbl();
-    l2_ttbl[(IA>>21)&0x1ff] = (phys_addr_t)l3_ttbl | TTBL_TABLE_MASK | TTBL_VALID_MASK;
-    //log_debug("%#x,\n",&l2_ttbl[IA>>21]);
+  /* Setup level2 block or table */
+  if(size == BLOCK_2M_SIZE){
+    break_desc(l2_ttbl, (IA>>21)&0x1ff, 2, vmid, IA);
+    set_desc(l2_ttbl, (IA>>21)&0x1ff, OA | TTBL_S2_ATTR | attr | TTBL_VALID_MASK);
+    return;
   }
+  l3_ttbl = next_ttbl(l2_ttbl, (IA>>21)&0x1ff, PAGE_SIZE, vmid, IA);
   
-  /* Setup level3 block */
-  l3_ttbl[(IA>>12)&0x1ff] = (0b100<<2) | OA  | TTBL_TABLE_MASK | TTBL_VALID_MASK |
-                                  (1<<10) |   // AF, The Access flag
-                                  (0b11<<6);  // S2AP = 11 RW ... options are 00=Nnne, 01=RO, 10=WO, 11=RW, ... Data access permissions
+  /* Setup level3 page */
+  break_desc(l3_ttbl, (IA>>12)&0x1ff, 3, vmid, IA);
+  set_desc(l3_ttbl, (IA>>12)&0x1ff, OA | TTBL_S2_ATTR | attr | TTBL_TABLE_MASK | TTBL_VALID_MASK);
   
   //log_debug("l1_page_table addr : %#x\nl2_page_table addr : %#x, index:%#x \nl3_page_table addr : %#x\n", l1_ttbl, l2_ttbl, (IA>>21)&0x1ff, l3_ttbl);
   //log_debug("IPA : %#8x to PA : %#8x\n", IA, OA);
 }
 
-uint64_t map_page_table(uint64_t ttbr,  phys_addr_t IA_start,
+/*
+ * Change the access permission of a block or a page from IA within length
+ * and return the size of the changed range.
+ * A block which is partly changed is split.
+ */
+static uint64_t attr_ttbl(ttbl_t *l1_ttbl, uint64_t vmid, phys_addr_t IA, uint64_t length, uint64_t attr){
+  int l1_index = (IA>>30)&0x1ff;
+  int l2_index = (IA>>21)&0x1ff;
+  int l3_index = (IA>>12)&0x1ff;
+  ttbl_t *l2_ttbl;
+  ttbl_t *l3_ttbl;
+
+  /* Level1 */
+  if(!(l1_ttbl[l1_index]&TTBL_VALID_MASK))
+    return BLOCK_1G_SIZE - (IA&(BLOCK_1G_SIZE-1));
+  if(TTBL_IS_BLOCK(l1_ttbl[l1_index])
+      && (IA&(BLOCK_1G_SIZE-1)) == 0 && length >= BLOCK_1G_SIZE){
+    l1_ttbl[l1_index] = (l1_ttbl[l1_index] & ~S2AP_RW) | attr;
+    return BLOCK_1G_SIZE;
+  }
+  l2_ttbl = next_ttbl(l1_ttbl, l1_index, BLOCK_2M_SIZE, vmid, IA);
+
+  /* Level2 */
+  if(!(l2_ttbl[l2_index]&TTBL_VALID_MASK))
+    return BLOCK_2M_SIZE - (IA&(BLOCK_2M_SIZE-1));
+  if(TTBL_IS_BLOCK(l2_ttbl[l2_index])
+      && (IA&(BLOCK_2M_SIZE-1)) == 0 && length >= BLOCK_2M_SIZE){
+    l2_ttbl[l2_index] = (l2_ttbl[l2_index] & ~S2AP_RW) | attr;
+    return BLOCK_2M_SIZE;
+  }
+  l3_ttbl = next_ttbl(l2_ttbl, l2_index, PAGE_SIZE, vmid, IA);
+
+  /* Level3 */
+  if(l3_ttbl[l3_index]&TTBL_VALID_MASK)
+    l3_ttbl[l3_index] = (l3_ttbl[l3_index] & ~S2AP_RW) | attr;
+
+  return PAGE_SIZE;
+}
+
+/*
+ * Unmap a block or a page from IA within length
+ * and return the size of the unmapped range.
+ * A block which is partly unmapped is split,
+ * and a table which becomes empty is released.
+ */
+static uint64_t unmap_ttbl(ttbl_t *l1_ttbl, uint64_t vmid, phys_addr_t IA, uint64_t length){
+  int l1_index = (IA>>30)&0x1ff;
+  int l2_index = (IA>>21)&0x1ff;
+  ttbl_t *l2_ttbl;
+  ttbl_t *l3_ttbl;
+  uint64_t size;
+
+  /* Level1 */
+  if(!(l1_ttbl[l1_index]&TTBL_VALID_MASK)
+      || ((IA&(BLOCK_1G_SIZE-1)) == 0 && length >= BLOCK_1G_SIZE)){
+    clear_desc(l1_ttbl, l1_index, 1);
+    return BLOCK_1G_SIZE - (IA&(BLOCK_1G_SIZE-1));
+  }
+  l2_ttbl = next_ttbl(l1_ttbl, l1_index, BLOCK_2M_SIZE, vmid, IA);
+
+  /* Level2 */
+  if(!(l2_ttbl[l2_index]&TTBL_VALID_MASK)
+      || ((IA&(BLOCK_2M_SIZE-1)) == 0 && length >= BLOCK_2M_SIZE)){
+    clear_desc(l2_ttbl, l2_index, 2);
+    size = BLOCK_2M_SIZE - (IA&(BLOCK_2M_SIZE-1));
+  }else{
+    /* Level3 */
+    l3_ttbl = next_ttbl(l2_ttbl, l2_index, PAGE_SIZE, vmid, IA);
+    clear_desc(l3_ttbl, (IA>>12)&0x1ff, 3);
+    size = PAGE_SIZE;
+
+    if(TTBL_REFCNT(l3_ttbl) == 0)
+      clear_desc(l2_ttbl, l2_index, 2);
+  }
+
+  if(TTBL_REFCNT(l2_ttbl) == 0)
+    clear_desc(l1_ttbl, l1_index, 1);
+
+  return size;
+}
+
+/*
+ * Map [IA_start, IA_start + length) to [OA_start, OA_start + length)
+ * as read/write and executable normal memory.
+ */
+uint64_t map_page_table(uint64_t ttbr, uint64_t vmid, phys_addr_t IA_start,
                       phys_addr_t OA_start, uint64_t length){
+  return map_page_table_attr(ttbr, vmid, IA_start, OA_start, length, S2_ATTR_RAM);
+}
+
+/*
+ * Map [IA_start, IA_start + length) of the vm whose VMID is vmid
+ * to [OA_start, OA_start + length) with the stage 2 attributes attr.
+ * 1GB and 2MB blocks are used
+ * wherever both of IA and OA are aligned and the rest of length is large enough,
+ * pages are used at the edges.
+ * A valid descriptor is invalidated and its TLB entries are flushed
+ * before it is replaced, so a mapping of a running vm can be changed.
+ */
+uint64_t map_page_table_attr(uint64_t ttbr, uint64_t vmid, phys_addr_t IA_start,
+                      phys_addr_t OA_start, uint64_t length, uint64_t attr){
   
   ttbl_t *l1_ttbl = (ttbl_t *)ttbr;
   phys_addr_t IA_t;
   phys_addr_t OA_t;
+  uint64_t size;
 
-  IA_start  &= 0xFFFFFFFFF000;
-  OA_start  &= 0xFFFFFFFFF000;
-  if(length%0x1000 != 0){
-    length &= 0xFFFFFFFFF000;
-    length += 0x1000;
+  IA_start  &= TTBL_ADDR_MASK;
+  OA_start  &= TTBL_ADDR_MASK;
+  if(length%PAGE_SIZE != 0){
+    length &= TTBL_ADDR_MASK;
+    length += PAGE_SIZE;
   }
 
-  log_debug("map_page_table\nIA_start : %#8x\nOA_start : %#8x\nLength   : %#8x\n", IA_start, OA_start, length);
+  log_debug("map_page_table\nAttr     : %#x\nIA_start : %#8x\nOA_start : %#8x\nLength   : %#8x\n", attr, IA_start, OA_start, length);
   
   if(!ttbr){
     hyp_panic("vttbr is zero!");
   }
 
   for(IA_t = IA_start, OA_t = OA_start;
-        IA_t < (IA_start + length); IA_t += 0x1000, OA_t += 0x1000){
+        IA_t < (IA_start + length); IA_t += size, OA_t += size){
     
-    map_ttbl(l1_ttbl, IA_t, OA_t);
+    if((((IA_t|OA_t)&(BLOCK_1G_SIZE-1)) == 0)
+        && (IA_start + length - IA_t >= BLOCK_1G_SIZE))
+      size = BLOCK_1G_SIZE;
+    else if((((IA_t|OA_t)&(BLOCK_2M_SIZE-1)) == 0)
+        && (IA_start + length - IA_t >= BLOCK_2M_SIZE))
+      size = BLOCK_2M_SIZE;
+    else
+      size = PAGE_SIZE;
+
+    spin_lock(&ttbl_lock);
+    map_ttbl(l1_ttbl, vmid, IA_t, OA_t, size, attr);
+    spin_unlock(&ttbl_lock);
   }
 
   return ttbr;
 }
 
+/*
+ * Unmap [IA_start, IA_start + length) of the vm whose VMID is vmid.
+ * The stage 2 TLB entries of the vm are invalidated
+ * before the released tables can be reused.
+ */
+void unmap_page_table(uint64_t ttbr, uint64_t vmid,
+                      phys_addr_t IA_start, uint64_t length){
+  ttbl_t *l1_ttbl = (ttbl_t *)ttbr;
+  phys_addr_t IA_t;
+  phys_addr_t IA_end;
+
+  IA_start  &= TTBL_ADDR_MASK;
+  if(length%PAGE_SIZE != 0){
+    length &= TTBL_ADDR_MASK;
+    length += PAGE_SIZE;
+  }
+  IA_end = IA_start + length;
+
+  log_debug("unmap_page_table\nIA_start : %#8x\nLength   : %#8x\n", IA_start, length);
+
+  if(!ttbr){
+    hyp_panic("vttbr is zero!");
+  }
+
+  spin_lock(&ttbl_lock);
+  for(IA_t = IA_start; IA_t < IA_end; )
+    IA_t += unmap_ttbl(l1_ttbl, vmid, IA_t, IA_end - IA_t);
+
+  tlb_flush_vmid(vmid);
+  spin_unlock(&ttbl_lock);
+}
+
 static ttbl_t *alloc_ttbl(void){
-  static volatile __attribute__((aligned(4096))) ttbl_t page_tables[MAX_PAGE_TABLE_NUM][512];
-  static int bottom_index = 0;
-  
-  if(bottom_index >= (MAX_PAGE_TABLE_NUM-1))
-    hyp_panic("There is no free page_table\n");
-  
-  memset(&page_tables[bottom_index], 0, sizeof(page_tables[0]));
-  return &page_tables[bottom_index++];
+  /* slab_cache_alloc() zeroes the table */
+  ttbl_t *ttbl = slab_cache_alloc(&ttbl_cache);
+
+  TTBL_REFCNT(ttbl) = 0;
+  return ttbl;
+}
+
+static void free_ttbl(ttbl_t *ttbl){
+  slab_cache_free(&ttbl_cache, ttbl);
 }
 
 uint64_t alloc_vttbr(void){
-  return (uint64_t)alloc_ttbl();
+  ttbl_t *ttbl;
+
+  spin_lock(&ttbl_lock);
+  ttbl = alloc_ttbl();
+  spin_unlock(&ttbl_lock);
+
+  return (uint64_t)ttbl;
+}
+
+/*
+ * Release all the page tables of the vm whose VMID is vmid.
+ * No vcpu of the vm may run after this.
+ */
+void free_vttbr(uint64_t ttbr, uint64_t vmid){
+  if(!ttbr){
+    hyp_panic("vttbr is zero!");
+  }
+
+  spin_lock(&ttbl_lock);
+  free_ttbl_tree((ttbl_t *)ttbr, 1);
+  tlb_flush_vmid(vmid);
+  spin_unlock(&ttbl_lock);
+}
+
+/*
+ * Change the access permission of the mapped part of
+ * [IA_start, IA_start + length) of the vm whose VMID is vmid to attr (S2AP_*).
+ * The memory types and XN are kept.
+ */
+void set_page_table_attr(uint64_t ttbr, uint64_t vmid,
+                      phys_addr_t IA_start, uint64_t length, uint64_t attr){
+  ttbl_t *l1_ttbl = (ttbl_t *)ttbr;
+  phys_addr_t IA_t;
+  phys_addr_t IA_end;
+
+  IA_start  &= TTBL_ADDR_MASK;
+  if(length%PAGE_SIZE != 0){
+    length &= TTBL_ADDR_MASK;
+    length += PAGE_SIZE;
+  }
+  IA_end = IA_start + length;
+
+  if(!ttbr){
+    hyp_panic("vttbr is zero!");
+  }
+
+  spin_lock(&ttbl_lock);
+  for(IA_t = IA_start; IA_t < IA_end; )
+    IA_t += attr_ttbl(l1_ttbl, vmid, IA_t, IA_end - IA_t, attr);
+
+  tlb_flush_vmid(vmid);
+  spin_unlock(&ttbl_lock);
+}
+
+/*
+ * Return the physical address which IA is mapped to,
+ * or 0 if IA is not mapped.
+ */
+phys_addr_t lookup_page_table(uint64_t ttbr, phys_addr_t IA){
+  ttbl_t *ttbl = (ttbl_t *)ttbr;
+  ttbl_t desc;
+  phys_addr_t pa = 0;
+  int level;
+
+  spin_lock(&ttbl_lock);
+  for(level = 1; level <= 3; level++){
+    desc = ttbl[(IA >> (39 - level*9)) & 0x1ff];
+
+    if(!(desc&TTBL_VALID_MASK))
+      break;
+
+    if(level == 3 || TTBL_IS_BLOCK(desc)){
+      pa = (desc&TTBL_ADDR_MASK) + (IA & ((1ULL << (39 - level*9)) - 1));
+      break;
+    }
+    ttbl = TTBL_NEXT(desc);
+  }
+  spin_unlock(&ttbl_lock);
+
+  return pa;
+}
+
+/*
+ * Whether any page of the 2MB block which has IA is mapped.
+ * A level 3 table is released when its last page is unmapped,
+ * so the level 2 descriptor tells it without a walk of each page.
+ */
+int page_table_2m_is_used(uint64_t ttbr, phys_addr_t IA){
+  ttbl_t *ttbl = (ttbl_t *)ttbr;
+  ttbl_t desc;
+  int used = 0;
+
+  spin_lock(&ttbl_lock);
+  desc = ttbl[(IA >> 30) & 0x1ff];
+  if(TTBL_IS_TABLE(desc)){
+    desc = TTBL_NEXT(desc)[(IA >> 21) & 0x1ff];
+    if(TTBL_IS_BLOCK(desc))
+      used = 1;
+    else if(TTBL_IS_TABLE(desc))
+      used = TTBL_REFCNT(TTBL_NEXT(desc)) != 0;
+  }else if(TTBL_IS_BLOCK(desc)){
+    used = 1;
+  }
+  spin_unlock(&ttbl_lock);
+
+  return used;
 }
 
 /**
@@ -165,17 +738,21 @@ void dump_ttbl(uint64_t ttbr){
   ttbl_t *l3_ttbl;
 
   log_debug("Dump page_table:\n");
-  for(int i=0; i<512; i++){
-    if(l1_ttbl[i]&TTBL_VALID_MASK){
-      l2_ttbl = l1_ttbl[i]&0xFFFFFFFFF000;
-      for(int j=0; j<512; j++){
-        if(l2_ttbl[j]&TTBL_VALID_MASK){
-          l3_ttbl = l2_ttbl[j]&0xFFFFFFFFF000;
-    for(int k=0; k<512; k++){
-      if(l3_ttbl[k]&TTBL_VALID_MASK){
-        log_debug("IPA : %#8x to PA : %#8x\n", (i<<30)+(j<<21)+(k<<12), l3_ttbl[k]&0xFFFFFFFFF000);
-      }
-    }
+  for(uint64_t i=0; i<512; i++){
+    if(TTBL_IS_BLOCK(l1_ttbl[i])){
+      log_debug("IPA : %#8x to PA : %#8x (1GB block)\n", i<<30, l1_ttbl[i]&TTBL_ADDR_MASK);
+    }else if(TTBL_IS_TABLE(l1_ttbl[i])){
+      l2_ttbl = TTBL_NEXT(l1_ttbl[i]);
+      for(uint64_t j=0; j<512; j++){
+        if(TTBL_IS_BLOCK(l2_ttbl[j])){
+          log_debug("IPA : %#8x to PA : %#8x (2MB block)\n", (i<<30)+(j<<21), l2_ttbl[j]&TTBL_ADDR_MASK);
+        }else if(TTBL_IS_TABLE(l2_ttbl[j])){
+          l3_ttbl = TTBL_NEXT(l2_ttbl[j]);
+          for(uint64_t k=0; k<512; k++){
+            if(l3_ttbl[k]&TTBL_VALID_MASK){
+              log_debug("IPA : %#8x to PA : %#8x\n", (i<<30)+(j<<21)+(k<<12), l3_ttbl[k]&TTBL_ADDR_MASK);
+            }
+          }
         }
       }
     }
@@ -209,8 +786,13 @@ phys_addr_t el1va2ipa(phys_addr_t va){
 
 phys_addr_t el1va2pa(phys_addr_t va){
   uint64_t par_el1;
+  phys_addr_t pa;
 
   va2pa_at(VA2PA_STAGE12, VA2PA_EL1, VA2PA_RD, va);
   READ_SYSREG(par_el1, PAR_EL1);
-  return par_el1&0xFFFFF000 | (va & 0x00000FFF);
+  pa = par_el1&0xFFFFF000 | (va & 0x00000FFF);
+
+  /* The caller reads the guest's instruction non-cacheable */
+  dcache_clean_inval_range(pa, sizeof(uint32_t));
+  return pa;
 }
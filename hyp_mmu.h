@@ -3,11 +3,61 @@
 
 #include "typedef.h"
 
+#define PAGE_SIZE     0x1000
+#define BLOCK_2M_SIZE 0x200000
+#define BLOCK_1G_SIZE 0x40000000
+
+/* 
+ * Stage 2 attributes for map_page_table_attr()
+ * attr is a memory type, a data access permission (S2AP) and optionally S2_XN.
+ *
+ * Guest RAM is Normal write-back.
+ * The EL2 stage 1 MMU is off and the hypervisor accesses memory non-cacheable,
+ * so it uses dcache_clean_inval_range() : malloc() does it on new memory
+ * before zeroing it, and readers of pages the guest wrote do it first.
+ * The hyp_msg page is Normal non-cacheable because the hypervisor
+ * and the running guest both write it.
+ */
+#define S2_MEMATTR_NORMAL_NC  (0b0101 << 2)                 // Normal, inner/outer non-cacheable
+#define S2_MEMATTR_NORMAL_WB  ((0b1111 << 2) | (0b11 << 8)) // Normal, inner/outer write-back, inner shareable
+#define S2_MEMATTR_DEVICE     (0b0001 << 2)                 // Device-nGnRE
+#define S2_MEMATTR_MASK       ((0b1111 << 2) | (0b11 << 8))
+
+#define S2AP_NONE (0b00 << 6)
+#define S2AP_RO   (0b01 << 6)
+#define S2AP_WO   (0b10 << 6)
+#define S2AP_RW   (0b11 << 6)
+
+#define S2_XN     (1ULL << 54)  // Execute never
+
+#define S2_ATTR_RAM     (S2_MEMATTR_NORMAL_WB | S2AP_RW)
+#define S2_ATTR_RAM_RO  (S2_MEMATTR_NORMAL_WB | S2AP_RO)
+#define S2_ATTR_RAM_XN  (S2_MEMATTR_NORMAL_WB | S2AP_RW | S2_XN)
+#define S2_ATTR_MMIO    (S2_MEMATTR_DEVICE | S2AP_RW | S2_XN)
+
 void mmu_init(void);
-void set_vttbr(uint64_t vttbr);
+#define VMID_BITS         8
+#define VMID_NUM          (1 << VMID_BITS)
+#define VMID_MASK         (VMID_NUM - 1)
+#define VTTBR_VMID_SHIFT  48
+#define VTTBR_VMID_MASK   (0xFFULL << VTTBR_VMID_SHIFT)
+
+void set_vttbr(uint64_t vttbr, uint64_t vmid);
+uint64_t vmid_update(uint64_t *vmid);
+void tlb_flush_ipa(uint64_t vmid, phys_addr_t ipa);
+void tlb_flush_vmid(uint64_t vmid);
 uint64_t alloc_vttbr(void);
-uint64_t map_page_table(uint64_t ttbr,  phys_addr_t IA_start,
+void free_vttbr(uint64_t ttbr, uint64_t vmid);
+uint64_t map_page_table(uint64_t ttbr, uint64_t vmid, phys_addr_t IA_start,
                       phys_addr_t OA_start, uint64_t length);
+uint64_t map_page_table_attr(uint64_t ttbr, uint64_t vmid, phys_addr_t IA_start,
+                      phys_addr_t OA_start, uint64_t length, uint64_t attr);
+void unmap_page_table(uint64_t ttbr, uint64_t vmid,
+                      phys_addr_t IA_start, uint64_t length);
+void set_page_table_attr(uint64_t ttbr, uint64_t vmid,
+                      phys_addr_t IA_start, uint64_t length, uint64_t attr);
+phys_addr_t lookup_page_table(uint64_t ttbr, phys_addr_t IA);
+int page_table_2m_is_used(uint64_t ttbr, phys_addr_t IA);
 void dump_ttbl(uint64_t ttbr);
 
 phys_addr_t el1va2ipa(phys_addr_t va);
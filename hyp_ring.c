@@ -0,0 +1,115 @@
+/*
+ * hyp_ring.c
+ * Batched hypervisor call ring in the hyp_msg page
+ *
+ * See hyp_ring.h for the ring format.
+ */
+
+#include "typedef.h"
+#include "lib.h"
+#include "log.h"
+#include "pmu.h"
+#include "spinlock.h"
+#include "vcpu.h"
+#include "vm.h"
+#include "hyp_call.h"
+#include "hyp_ring.h"
+
+_Static_assert(HYP_RING_OFFSET + sizeof(hyp_ring_t) <= HYP_VM_MSG_SIZE,
+    "hyp_ring_t must fit in the hyp_msg page");
+
+/* Execute one submission entry and return its result */
+static int64_t hyp_ring_do_op(vcpu_t *vcpu, hyp_ring_sqe_t *sqe){
+  char buf[HYP_RING_DATA_SIZE + 1];
+  uint32_t len;
+
+  switch(sqe->op){
+    case HYP_CALL_PUTS:
+      len = sqe->len;
+      if(len > HYP_RING_DATA_SIZE)
+        return HYP_RING_EINVAL;
+      memcpy(buf, sqe->data, len);
+      buf[len] = '\0';
+      log_info("[from vm %s] %s", vcpu->vm->name, buf);
+      return len;
+
+    case HYP_CALL_CYCLE_COUNT_READ:
+      /* Unlike the single call, the counter keeps running */
+      return cycle_counter_read();
+
+    case HYP_CALL_NULL:
+      return HYP_RING_OK;
+
+    default:
+      /*
+       * HYP_CALL_FORCE_SHUTDOWN and calls which switch the vcpu
+       * must be issued by their own HVC.
+       */
+      return HYP_RING_ENOSYS;
+  }
+}
+
+/*
+ * Called by HVC #HYP_CALL_RING_SUBMIT.
+ * Return the number of executed entries, or -1 if the ring header is illegal.
+ */
+int64_t hyp_ring_submit(vcpu_t *vcpu){
+  vm_t *vm = vcpu->vm;
+  volatile hyp_ring_t *ring;
+  hyp_ring_sqe_t sqe;
+  volatile hyp_ring_cqe_t *cqe;
+  uint32_t entry_num, sq_head, sq_tail, cq_head, cq_tail;
+  int64_t done = 0;
+
+  if(vcpu->hyp_msg == NULL){
+    log_warn("vm %s has no hyp_msg page\n", vm->name);
+    return -1;
+  }
+
+  ring = (volatile hyp_ring_t *)(vcpu->hyp_msg + HYP_RING_OFFSET);
+
+  /* Everything in the ring is written by the guest, so check it before use. */
+  entry_num = ring->entry_num;
+  if(ring->magic != HYP_RING_MAGIC || ring->version != HYP_RING_VERSION
+      || entry_num == 0 || entry_num > HYP_RING_MAX_ENTRY_NUM
+      || (entry_num & (entry_num - 1)) != 0){
+    log_warn("Illegal hyp_ring header in vm %s; magic : %#x, version : %d, entry_num : %d\n",
+        vm->name, ring->magic, ring->version, entry_num);
+    return -1;
+  }
+
+  /* vcpus of a vm share the ring */
+  spin_lock(&vm->hyp_ring_lock);
+
+  /*
+   * Another vcpu of the vm can rewrite the ring while we run,
+   * so the indices are read once and at most entry_num entries are executed.
+   */
+  sq_head = ring->sq_head;
+  sq_tail = ring->sq_tail;
+  cq_head = ring->cq_head;
+  cq_tail = ring->cq_tail;
+
+  while(sq_head != sq_tail && done < entry_num){
+    /* The completion queue is full */
+    if(cq_tail - cq_head >= entry_num)
+      break;
+
+    memcpy(&sqe, (void *)&ring->sq[sq_head & (entry_num - 1)], sizeof(sqe));
+    cqe = &ring->cq[cq_tail & (entry_num - 1)];
+
+    cqe->user_data = sqe.user_data;
+    cqe->result = hyp_ring_do_op(vcpu, &sqe);
+
+    sq_head++;
+    cq_tail++;
+    done++;
+  }
+
+  ring->sq_head = sq_head;
+  ring->cq_tail = cq_tail;
+
+  spin_unlock(&vm->hyp_ring_lock);
+
+  return done;
+}
@@ -0,0 +1,67 @@
+/*
+ * hyp_ring.h
+ * Batched hypervisor call ring in the hyp_msg page
+ */
+
+#ifndef _HYP_RING_H_INCLUDED_
+#define _HYP_RING_H_INCLUDED_
+
+#include "typedef.h"
+#include "hyp_call.h"
+#include "vcpu.h"
+
+/*
+ * The ring is placed in the second half of the hyp_msg page,
+ * the first half is still used as the HYP_CALL_PUTS string buffer.
+ *
+ * A guest fills sq[sq_tail % entry_num] and increments sq_tail,
+ * then calls HVC #HYP_CALL_RING_SUBMIT once.
+ * The hypervisor executes every queued entry in order,
+ * writes a completion to cq[cq_tail % entry_num] for each of them
+ * and returns the number of executed entries in $x0 (or -1 on a bad header).
+ * Entries which do not fit in the completion queue are left queued.
+ *
+ * Guests which do not set magic and version keep using the single call path.
+ */
+#define HYP_RING_OFFSET         (HYP_VM_MSG_SIZE / 2)
+#define HYP_RING_MAGIC          0x474e4952  /* "RING" */
+#define HYP_RING_VERSION        1
+#define HYP_RING_MAX_ENTRY_NUM  16
+#define HYP_RING_DATA_SIZE      40
+
+/* Results in hyp_ring_cqe_t.result */
+#define HYP_RING_OK       0
+#define HYP_RING_EINVAL   -1  /* Illegal argument */
+#define HYP_RING_ENOSYS   -2  /* The operation is not supported in the ring */
+
+/* Submission queue entry */
+typedef struct _hyp_ring_sqe_t {
+  uint32_t op;        /* HYP_CALL_* */
+  uint32_t len;       /* Length of data[] used by the operation */
+  uint64_t user_data; /* Copied to the completion as it is */
+  uint64_t arg;
+  char data[HYP_RING_DATA_SIZE];
+} hyp_ring_sqe_t;
+
+/* Completion queue entry */
+typedef struct _hyp_ring_cqe_t {
+  uint64_t user_data;
+  int64_t result;
+} hyp_ring_cqe_t;
+
+typedef struct _hyp_ring_t {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t entry_num; /* Power of 2, up to HYP_RING_MAX_ENTRY_NUM */
+  uint32_t reserved;
+  uint32_t sq_head;   /* Written by the hypervisor */
+  uint32_t sq_tail;   /* Written by the guest */
+  uint32_t cq_head;   /* Written by the guest */
+  uint32_t cq_tail;   /* Written by the hypervisor */
+  hyp_ring_sqe_t sq[HYP_RING_MAX_ENTRY_NUM];
+  hyp_ring_cqe_t cq[HYP_RING_MAX_ENTRY_NUM];
+} hyp_ring_t;
+
+int64_t hyp_ring_submit(vcpu_t *vcpu);
+
+#endif
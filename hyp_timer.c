@@ -10,6 +10,8 @@
 #include "asm_func.h"
 #include "smp_mbox.h"
 #include "hyp_timer.h"
+#include "spinlock.h"
+#include "slab.h"
 
 /*
  * Generic Timer registers 
@@ -47,7 +49,6 @@
  * - CNTHP_CVAL_EL2 64-bit Counter-timer Hypervisor Physical Timer CompareValue register
  */
 
-#define TIMER_EVENT_NUM 16
 #define TIMER_CLOCKS_PER_TICKS 0x10
 #define TIMER_CLOCKS_PER_MSEC (1000000000 /1000) 
 #define TIMER_TICKS_PER_MSEC (TIMER_CLOCKS_PER_MSEC/TIMER_CLOCKS_PER_TICKS) 
@@ -59,21 +60,63 @@
 #define CNTx_CTL_IMASK    (1<<1)
 #define CNTx_CTL_ISTATUS  (1<<2)
 
+/* Core timers interrupt control register of each core on BCM2836 local peripherals */
+#define CORE_TIMER_INT_CTL(cpu_id) (*(volatile uint32_t *)(0x40000040UL + 4 * (cpu_id)))
+#define CORE_TIMER_INT_CNTHPIRQ   (1<<2)
+
 typedef struct _timer_event_t{
-  int used;
+  struct _timer_event_t *next;
   int64_t msec;
   uint64_t arg;
   void (*func) (pcpu_t *phys_cpu, uint64_t arg);
 }timer_event_t;
-timer_event_t timer_event_table[CPU_NUM][TIMER_EVENT_NUM];
+
+/* Timer events of each physical cpu, allocated from timer_event_cache */
+static timer_event_t *timer_event_list[CPU_NUM];
+/* Expired timer events of each physical cpu, and the one whose function runs now */
+static timer_event_t *timer_event_expired[CPU_NUM];
+static timer_event_t *timer_event_running[CPU_NUM];
+static slab_cache_t timer_event_cache = SLAB_CACHE_INIT("timer_event_t", sizeof(timer_event_t), 0);
 
 static int hyp_tiemr_is_running[CPU_NUM];
 static int hyp_timer_spinlock = 0;
 
+/*
+ * CNTHP_CVAL_EL2 is set to the earlier of the next tick of timer events
+ * and the alarm of the cpu, see hyp_timer_program().
+ * Both are CNTPCT_EL0 values and touched only on their own cpu.
+ */
+static uint64_t hyp_timer_tick_cval[CPU_NUM];
+static struct {
+  uint64_t cval;  // 0 if not set
+  void (*func)(pcpu_t *phys_cpu);
+} hyp_timer_alarm[CPU_NUM];
+
+/* Program the hyp timer of this cpu for the next tick or alarm */
+static void hyp_timer_program(pcpu_t *phys_cpu){
+  int id = phys_cpu->cpu_id;
+  uint64_t cval = 0;
+
+  if(hyp_tiemr_is_running[id])
+    cval = hyp_timer_tick_cval[id];
+  if(hyp_timer_alarm[id].cval != 0 && (cval == 0 || hyp_timer_alarm[id].cval < cval))
+    cval = hyp_timer_alarm[id].cval;
+
+  if(cval == 0){
+    CORE_TIMER_INT_CTL(id) &= ~CORE_TIMER_INT_CNTHPIRQ;
+    WRITE_SYSREG(CNTHP_CTL_EL2, 0);
+    return;
+  }
+
+  WRITE_SYSREG(CNTHP_CVAL_EL2, cval);
+  CORE_TIMER_INT_CTL(id) |= CORE_TIMER_INT_CNTHPIRQ;
+  WRITE_SYSREG(CNTHP_CTL_EL2, CNTx_CTL_ENABLE);
+}
+
 
 void hyp_timer_core_init(pcpu_t *phys_cpu){
   hyp_tiemr_is_running[phys_cpu->cpu_id] = 0;
-  *(uint32_t *)0x40000040 &= ~(1<<2);/* TODO */
+  CORE_TIMER_INT_CTL(phys_cpu->cpu_id) &= ~CORE_TIMER_INT_CNTHPIRQ;
   WRITE_SYSREG(CNTHP_CTL_EL2, 0);
 }
 
@@ -83,10 +126,9 @@ static void _hyp_timer_core_start(pcpu_t *phys_cpu){
       phys_cpu->cpu_id);
 
   hyp_tiemr_is_running[phys_cpu->cpu_id]=1;
-  WRITE_SYSREG(CNTHP_CVAL_EL2, 0);
-  WRITE_SYSREG(CNTHP_TVAL_EL2,   DEFAULT_TIMER_TICKS);
-  *(uint32_t *)0x40000040 = (1<<2);
-  WRITE_SYSREG(CNTHP_CTL_EL2, CNTx_CTL_ENABLE);
+  READ_SYSREG(hyp_timer_tick_cval[phys_cpu->cpu_id], CNTPCT_EL0);
+  hyp_timer_tick_cval[phys_cpu->cpu_id] += DEFAULT_TIMER_TICKS;
+  hyp_timer_program(phys_cpu);
 }
 
 /* Stop hyp timer on current physical cpu  */
@@ -95,8 +137,8 @@ static void _hyp_timer_core_stop(pcpu_t *phys_cpu){
       phys_cpu->cpu_id);
 
   hyp_tiemr_is_running[phys_cpu->cpu_id] = 0;
-  *(uint32_t *)0x40000040 &= ~(1<<2);
-  WRITE_SYSREG(CNTHP_CTL_EL2, 0);
+  /* The alarm keeps the timer running if it is set */
+  hyp_timer_program(phys_cpu);
 }
 
 /* Start hyp timer */
@@ -137,132 +179,212 @@ uint64_t hyp_timer_tick2msec(int64_t tick){
 
 static void timer_event_intr(pcpu_t *phys_cpu);
 void hyp_timer_intr(pcpu_t *phys_cpu){
-  int i=0;
-  uint64_t cval, tval;
-  READ_SYSREG(cval, CNTHP_CVAL_EL2);
-  READ_SYSREG(tval, CNTHP_TVAL_EL2);
-  log_info("before cval : %d, tval : %#8x\n", cval, tval);
-  for(i=0; i<1000;i++){}
-  READ_SYSREG(cval, CNTHP_CVAL_EL2);
-  READ_SYSREG(tval, CNTHP_TVAL_EL2);
-  log_info("after  cval : %d, tval : %d\n", cval, tval);
-
-  WRITE_SYSREG(CNTHP_TVAL_EL2, DEFAULT_TIMER_TICKS);
-  READ_SYSREG(cval, CNTHP_CVAL_EL2);
-  READ_SYSREG(tval, CNTHP_TVAL_EL2);
-  log_info("after1  cval : %d, tval : %d\n", cval, tval);
+  int id = phys_cpu->cpu_id;
+  void (*alarm_func)(pcpu_t *phys_cpu) = 0;
+  int tick = 0;
+  uint64_t now;
 
-  WRITE_SYSREG(CNTHP_CTL_EL2, CNTx_CTL_ENABLE);
+  READ_SYSREG(now, CNTPCT_EL0);
+  log_debug("hyp timer interrupt; cpu id : %d, CNTPCT_EL0 : %#x\n", id, now);
+
+  if(hyp_timer_alarm[id].cval != 0 && now >= hyp_timer_alarm[id].cval){
+    alarm_func = hyp_timer_alarm[id].func;
+    hyp_timer_alarm[id].cval = 0;
+  }
+
+  if(hyp_tiemr_is_running[id] && now >= hyp_timer_tick_cval[id]){
+    hyp_timer_tick_cval[id] += DEFAULT_TIMER_TICKS;
+    if(hyp_timer_tick_cval[id] <= now)
+      hyp_timer_tick_cval[id] = now + DEFAULT_TIMER_TICKS;
+    tick = 1;
+  }
 
-  timer_event_intr(phys_cpu);
+  hyp_timer_program(phys_cpu);
+
+  if(alarm_func != 0)
+    alarm_func(phys_cpu);
+  if(tick)
+    timer_event_intr(phys_cpu);
+}
+
+/*
+ * Call func in the hyp timer interrupt of this cpu when CNTPCT_EL0 reaches cval.
+ * Each cpu has one alarm, which is set and canceled only on the cpu,
+ * independent of the DEFAULT_TIMER_MSEC ticks of timer events.
+ */
+void hyp_timer_alarm_set(pcpu_t *phys_cpu, uint64_t cval,
+    void (*func)(pcpu_t *phys_cpu)){
+  if(phys_cpu != get_current_phys_cpu())
+    hyp_panic("You cannot set the alarm of another cpu : %d\n", phys_cpu->cpu_id);
+
+  hyp_timer_alarm[phys_cpu->cpu_id].func = func;
+  hyp_timer_alarm[phys_cpu->cpu_id].cval = (cval == 0)? 1 : cval;
+  hyp_timer_program(phys_cpu);
+}
+
+void hyp_timer_alarm_cancel(pcpu_t *phys_cpu){
+  if(phys_cpu != get_current_phys_cpu())
+    hyp_panic("You cannot cancel the alarm of another cpu : %d\n", phys_cpu->cpu_id);
+
+  if(hyp_timer_alarm[phys_cpu->cpu_id].cval == 0)
+    return;
+  hyp_timer_alarm[phys_cpu->cpu_id].cval = 0;
+  hyp_timer_program(phys_cpu);
 }
 
 void timer_event_init(void){
-  int i, j;
+  int i;
 
   hyp_timer_spinlock = 0;
 
   for(i=0; i<CPU_NUM; i++){
-    for(j=0; j<TIMER_EVENT_NUM; j++){
-      timer_event_table[i][j].used = 0;
-      timer_event_table[i][j].msec = 0;
-      timer_event_table[i][j].func = NULL;
-    }
+    timer_event_list[i] = NULL;
+    timer_event_expired[i] = NULL;
+    timer_event_running[i] = NULL;
   }
 }
 
 void timer_event_add(pcpu_t *phys_cpu, 
       void (*func)(pcpu_t *phys_cpu, uint64_t arg), int64_t msec, uint64_t arg){
-  int i;
   timer_event_t *tp;
 
+  tp = slab_cache_alloc(&timer_event_cache);
+  tp->msec = msec;
+  tp->arg  = arg;
+  tp->func = func;
+
   spin_lock(&hyp_timer_spinlock);
 
   if(hyp_tiemr_is_running[phys_cpu->cpu_id] ==0)
     hyp_timer_start(phys_cpu);
 
-  /* Find a free timer_event_t block */
-  for(i=0; i<TIMER_EVENT_NUM; i++){
-    if(timer_event_table[phys_cpu->cpu_id][i].used == 0)
-      break;
-  }
-
-  if(i == TIMER_EVENT_NUM)
-    hyp_panic("Not found a free timer_event_t block\n");
-  
-  timer_event_table[phys_cpu->cpu_id][i].used = 1;
-  timer_event_table[phys_cpu->cpu_id][i].msec = msec;
-  timer_event_table[phys_cpu->cpu_id][i].arg  = arg;
-  timer_event_table[phys_cpu->cpu_id][i].func = func;
+  tp->next = timer_event_list[phys_cpu->cpu_id];
+  timer_event_list[phys_cpu->cpu_id] = tp;
 
   spin_unlock(&hyp_timer_spinlock);
 }
 
 void timer_event_remove(pcpu_t *phys_cpu, void (*func) (void)){
-  int i;
-
-  spin_lock(&hyp_timer_spinlock);
+  timer_event_t **tpp;
+  timer_event_t *tp;
 
   if(func == NULL){
     hyp_panic("You cannot remove NULL timer event from  the queue");
     return;
   }
 
+  spin_lock(&hyp_timer_spinlock);
+
   /* Find the timer_event_t block that func is belong to */
-  for(i = 0; i < TIMER_EVENT_NUM; i++){
-      if(timer_event_table[phys_cpu->cpu_id][i].func == func)
-        break;
+  for(tpp = &timer_event_list[phys_cpu->cpu_id]; *tpp != NULL; tpp = &(*tpp)->next){
+    if((void *)(*tpp)->func == (void *)func)
+      break;
   }
 
-  if(i == TIMER_EVENT_NUM){
+  if(*tpp == NULL){
     hyp_panic("You cannot remove timer event whichi is not in the queue from  the queue");
     return;
   }
 
-  timer_event_table[phys_cpu->cpu_id][i].used = 0;
-  timer_event_table[phys_cpu->cpu_id][i].msec = 0;
-  timer_event_table[phys_cpu->cpu_id][i].arg  = 0;
-  timer_event_table[phys_cpu->cpu_id][i].func = NULL;
+  tp = *tpp;
+  *tpp = tp->next;
   
   spin_unlock(&hyp_timer_spinlock);
+
+  slab_cache_free(&timer_event_cache, tp);
+}
+
+/*
+ * Remove the timer events of func with arg from every cpu.
+ * Return 1 if one of them is running on another cpu now,
+ * then the caller must not free arg until a later call returns 0.
+ */
+int timer_event_cancel(void (*func)(pcpu_t *phys_cpu, uint64_t arg), uint64_t arg){
+  timer_event_t **lists[2] = {timer_event_list, timer_event_expired};
+  timer_event_t **tpp;
+  timer_event_t *tp;
+  timer_event_t *canceled = NULL;
+  int running = 0;
+  int i, j;
+
+  spin_lock(&hyp_timer_spinlock);
+
+  for(i=0; i<CPU_NUM; i++){
+    for(j=0; j<2; j++){
+      tpp = &lists[j][i];
+      while(*tpp != NULL){
+        tp = *tpp;
+        if(tp->func == func && tp->arg == arg){
+          *tpp = tp->next;
+          tp->next = canceled;
+          canceled = tp;
+        }else{
+          tpp = &tp->next;
+        }
+      }
+    }
+
+    tp = timer_event_running[i];
+    if(tp != NULL && tp->func == func && tp->arg == arg)
+      running = 1;
+  }
+
+  spin_unlock(&hyp_timer_spinlock);
+
+  while(canceled != NULL){
+    tp = canceled;
+    canceled = tp->next;
+    slab_cache_free(&timer_event_cache, tp);
+  }
+
+  return running;
 }
 
 static void timer_event_intr(pcpu_t *phys_cpu){
-  int i;
-  #define tp timer_event_table[phys_cpu->cpu_id][i]
+  int id = phys_cpu->cpu_id;
+  timer_event_t **tpp;
+  timer_event_t *tp;
   
   spin_lock(&hyp_timer_spinlock);
 
   log_debug("timer_event_intr()\n");
 
-  /* Find active timer_event_t blocks */
-  for(i=0; i<TIMER_EVENT_NUM;i++){
-    if(tp.used){
-      tp.msec -= DEFAULT_TIMER_MSEC;
-      log_info("timer event %d used  : %d, msec : %d\n",
-          i, tp.used, tp.msec);
-      if(tp.msec<=0){
-        log_info("delete timer event[%d][%d]\n",
-            phys_cpu->cpu_id, i);
-        spin_unlock(&hyp_timer_spinlock);
-        tp.func(phys_cpu, tp.arg);
-        spin_lock(&hyp_timer_spinlock);
-
-        tp.used = 0;
-        tp.msec = 0;
-        tp.arg  = 0;
-        tp.func = NULL;
-      }
+  /* Take expired timer_event_t blocks out of the list */
+  tpp = &timer_event_list[id];
+  while(*tpp != NULL){
+    tp = *tpp;
+    tp->msec -= DEFAULT_TIMER_MSEC;
+    log_info("timer event %#x msec : %d\n", tp, tp->msec);
+    if(tp->msec <= 0){
+      log_info("delete timer event %#x of cpu %d\n", tp, phys_cpu->cpu_id);
+      *tpp = tp->next;
+      tp->next = timer_event_expired[id];
+      timer_event_expired[id] = tp;
+    }else{
+      tpp = &tp->next;
     }
   }
-  
-  for(i=0; i<TIMER_EVENT_NUM;i++){
-    if(tp.used)
-      break;
+
+  /*
+   * An event function may add a timer event again.
+   * Expired events stay visible to timer_event_cancel() until they run.
+   */
+  while((tp = timer_event_expired[id]) != NULL){
+    timer_event_expired[id] = tp->next;
+    timer_event_running[id] = tp;
+    spin_unlock(&hyp_timer_spinlock);
+
+    tp->func(phys_cpu, tp->arg);
+
+    spin_lock(&hyp_timer_spinlock);
+    timer_event_running[id] = NULL;
+    spin_unlock(&hyp_timer_spinlock);
+    slab_cache_free(&timer_event_cache, tp);
+    spin_lock(&hyp_timer_spinlock);
   }
 
   /* If there is no timer event, stop hyp_timer. */
-  if(i==TIMER_EVENT_NUM)
+  if(timer_event_list[phys_cpu->cpu_id] == NULL)
     hyp_timer_stop(phys_cpu);
 
   spin_unlock(&hyp_timer_spinlock);
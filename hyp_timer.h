@@ -8,9 +8,13 @@ void hyp_timer_core_init(pcpu_t *phys_cpu);
 uint64_t hyp_timer_get_clocks_num(int64_t msec);
 uint64_t hyp_timer_tick2msec(int64_t tick);
 void hyp_timer_intr(pcpu_t *phys_cpu);
+void hyp_timer_alarm_set(pcpu_t *phys_cpu, uint64_t cval,
+    void (*func)(pcpu_t *phys_cpu));
+void hyp_timer_alarm_cancel(pcpu_t *phys_cpu);
 void timer_event_init(void);
 void timer_event_add(pcpu_t *phys_cpu,
     void (*func)(pcpu_t *phys_cpu, uint64_t arg), int64_t msec, uint64_t arg);
+int  timer_event_cancel(void (*func)(pcpu_t *phys_cpu, uint64_t arg), uint64_t arg);
 void timer_event_remove(pcpu_t *phys_cpu, void (*func) (void));
 
 #endif
@@ -0,0 +1,56 @@
+/*
+ * id_space.c
+ * Bitmap-indexed ID spaces
+ *
+ * An ID is found with a count of trailing ones of a bitmap word,
+ * so an allocation scans id_num / 64 words at most.
+ */
+
+#include "typedef.h"
+#include "lib.h"
+#include "log.h"
+#include "spinlock.h"
+#include "id_space.h"
+
+/*
+ * Return a free ID, or -1 if all the IDs are used.
+ * The search starts at the bitmap word of the last allocation (space->hint)
+ * and wraps around, so the ID is the lowest free one of the first word
+ * with a free bit, not necessarily the lowest free ID of the space.
+ */
+int id_alloc(id_space_t *space){
+  uint32_t word_num = (space->id_num + 63) / 64;
+  uint32_t i, w;
+  int id = -1;
+
+  spin_lock(&space->lock);
+
+  for(i=0; i<word_num; i++){
+    w = (space->hint + i) % word_num;
+    if(~space->bitmap[w] == 0)
+      continue;
+
+    id = w * 64 + __builtin_ctzll(~space->bitmap[w]);
+    if(id >= space->id_num){
+      id = -1;
+      continue;
+    }
+
+    space->bitmap[w] |= 1ULL << (id % 64);
+    space->hint = w;
+    break;
+  }
+
+  spin_unlock(&space->lock);
+
+  return id;
+}
+
+void id_free(id_space_t *space, int id){
+  if(id < 0 || id >= space->id_num)
+    hyp_panic("Illegal ID to free : %d\n", id);
+
+  spin_lock(&space->lock);
+  space->bitmap[id / 64] &= ~(1ULL << (id % 64));
+  spin_unlock(&space->lock);
+}
@@ -0,0 +1,31 @@
+/*
+ * id_space.h
+ * Bitmap-indexed ID spaces
+ */
+
+#ifndef _ID_SPACE_H_INCLUDED_
+#define _ID_SPACE_H_INCLUDED_
+
+#include "typedef.h"
+
+typedef struct _id_space_t {
+  uint32_t id_num;
+  uint32_t hint;      // word of bitmap where the next search starts
+  int lock;
+  uint64_t *bitmap;   // a set bit is a used ID
+} id_space_t;
+
+/* Define a static id_space_t of IDs 0 ~ num - 1 */
+#define ID_SPACE_DEFINE(space, num) \
+  static uint64_t space##_bitmap[((num) + 63) / 64]; \
+  static id_space_t space = { \
+    .id_num = (num), \
+    .hint = 0, \
+    .lock = 0, \
+    .bitmap = space##_bitmap, \
+  }
+
+int id_alloc(id_space_t *space);
+void id_free(id_space_t *space, int id);
+
+#endif
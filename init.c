@@ -13,6 +13,8 @@
 #include "hyp_timer.h"
 #include "pmu.h"
 #include "virq.h"
+#include "vcpu_stat.h"
+#include "mem_bench.h"
 
 static volatile int primary_start_finished = 0;
 
@@ -32,6 +34,10 @@ void hyp_core_init(pcpu_t *phys_cpu){
 
   WRITE_SYSREG(HCR_EL2, hcr_el2);
 
+  /* Trap the first FP/SIMD access so that FP registers are switched lazily */
+  WRITE_SYSREG(CPTR_EL2, CPTR_EL2_RES1 | CPTR_TFP);
+  asm volatile("isb");
+
   mmu_init();
 }
 
@@ -46,7 +52,11 @@ void start_primary(uint32_t *dtb_addr){
   log_info("Boot primary cpu.This cpu id is %d\n", phys_cpu->cpu_id);
   log_info("This CPU clock is %d Hz\n", phys_cpu->freq);
 
+  lib_mem_init();
   mem_init();
+#if CONFIG_MEM_BENCH
+  mem_bench();
+#endif
   // hyp_timer_core_init(phys_cpu);
   timer_event_init();
   schedulers_init();
@@ -60,6 +70,7 @@ void start_primary(uint32_t *dtb_addr){
   dump_ready_vcpu(LOG_INFO);
 
   dump_cpu_usage_start(phys_cpu);
+  vcpu_stat_dump_start(phys_cpu);
 
   /* Wake up slave cpus */
   primary_start_finished = 1;
@@ -9,7 +9,9 @@
 #include "virt_mmio.h"
 #include "pcpu.h"
 #include "vcpu.h"
+#include "vm_mem.h"
 #include "virq.h"
+#include "vcpu_stat.h"
 
 void vm_interrupt_handler(pcpu_t *phys_cpu, uint64_t vec_num, uint32_t esr);
 
@@ -82,9 +84,12 @@ void vm_interrupt_entry(uint64_t vec_num, uint32_t esr){
   /* 
    * We have already saved general purpose registers in the interrupt vector.
    * So we need to save other registers if we switch to another guest OS.
+   * FP/SIMD registers are saved lazily, see vcpu_fpu_switch().
+   * Cold system registers are saved only when another vcpu is switched in.
    */
-  vcpu_freg_save(phys_cpu->current_vcpu);
-  vcpu_save_all_sysregs(phys_cpu->current_vcpu);
+  vcpu_save_hot_sysregs(phys_cpu->current_vcpu);
+  vcpu_stat_exit(phys_cpu->current_vcpu, 
+      (vec_num == 8)? VCPU_STAT_EXIT_EC(esr >> 26) : VCPU_STAT_EXIT_OTHER);
   
   if(phys_cpu->current_vcpu->security.error == 0)
     hyp_security_check(phys_cpu->current_vcpu, esr);
@@ -110,31 +115,25 @@ void vm_interrupt_entry(uint64_t vec_num, uint32_t esr){
 void vm_interrupt_handler(pcpu_t *phys_cpu, uint64_t vec_num, uint32_t esr){ 
   uint8_t ec = esr >> 26;
   uint8_t il = (esr >> 25) & 1;
-  uint16_t iss = esr & 0x1FFF;
+  uint32_t iss = esr & 0x1FFFFFF;
   vcpu_t *cur_vcpu = phys_cpu->current_vcpu;
   phys_addr_t far_el2;
   phys_addr_t hpfar_el2;
   phys_addr_t data_pa;
+  int ret;
   uint64_t hcr_el2;
   
-  
-  phys_addr_t inst_ipa = el1va2ipa(cur_vcpu->sysreg.pc);
-  phys_addr_t inst_pa = el1va2pa(cur_vcpu->sysreg.pc);
-  
   log_debug("vec_num : %#x \n", vec_num);
   log_debug("Interrupt has caused in physical cpu id %d\nEC:%#2x\nCPSR : %#4x, ELR_EL2:%#8x\n",
       phys_cpu->cpu_id, ec, cur_vcpu->sysreg.cpsr, cur_vcpu->sysreg.pc);
 
-  log_debug("IPA of cause instruction : %#8x\n", inst_ipa);
-  log_debug("PA of cause instruction : %#8x\n", inst_pa);
-
   switch(ec){
     case 0x00:
       
       // Unknown reason
       //if(extract(*(uint32_t *)inst_pa, 20, 31)==0xd40){
         log_debug("HVC from EL0\n");
-        hyp_call(phys_cpu->current_vcpu, extract(*(phys_addr_t *)inst_pa, 5, 20));
+        hyp_call(phys_cpu->current_vcpu, extract(*(uint32_t *)el1va2pa(cur_vcpu->sysreg.pc), 5, 20));
         cur_vcpu->sysreg.pc += 4;
         
         WRITE_SYSREG(ELR_EL2, cur_vcpu->sysreg.pc);
@@ -142,7 +141,7 @@ void vm_interrupt_handler(pcpu_t *phys_cpu, uint64_t vec_num, uint32_t esr){
         break;
       //}
       #if 0
-      log_debug("instruction code : %#8x\n",extract(*(uint32_t *)inst_pa, 20, 31));
+      log_debug("instruction code : %#8x\n",extract(*(uint32_t *)el1va2pa(cur_vcpu->sysreg.pc), 20, 31));
       hyp_panic("Unknown Reason exception!\n");
       vcpu_do_vserror(cur_vcpu);
       break;
@@ -154,6 +153,13 @@ void vm_interrupt_handler(pcpu_t *phys_cpu, uint64_t vec_num, uint32_t esr){
       vcpu_sleep(cur_vcpu);
       break;
 
+    case 0x07:
+      // Access to SIMD or floating-point registers, 
+      // excluding (HCR_EL2.TGE==1) traps
+      // Switch FP/SIMD registers and retry the instruction.
+      vcpu_fpu_switch(cur_vcpu);
+      break;
+
     case 0x03:
       // MCR or MRC access to CP15 a that is not reported using EC 0x00
     case 0x04:
@@ -162,9 +168,6 @@ void vm_interrupt_handler(pcpu_t *phys_cpu, uint64_t vec_num, uint32_t esr){
       // MCR or MRC access to CP14
     case 0x06:
       // LDC or STC access to CP14
-    case 0x07:
-      // Access to SIMD or floating-point registers, 
-      // excluding (HCR_EL2.TGE==1) traps
     case 0x08:
       // MCR or MRC access to CP10 that is not reported using EC 0x07 .
       // This applies only to ID Group traps
@@ -180,7 +183,7 @@ void vm_interrupt_handler(pcpu_t *phys_cpu, uint64_t vec_num, uint32_t esr){
 
     case 0x16:
       // HVC instruction execution, when HVC is not disabled from AAech64
-      hyp_call(cur_vcpu, iss);
+      hyp_call(cur_vcpu, iss&0xFFFF);
       break;
 
     case 0x17:
@@ -189,35 +192,21 @@ void vm_interrupt_handler(pcpu_t *phys_cpu, uint64_t vec_num, uint32_t esr){
 
     case 0x20:
       // Instruction Abort from a lower Exception level
-      hyp_panic(" Instruction Abort from a lower Exception level\nISS : %#8x\nFault on the Stage %x translation\n", iss, iss&0x80+1);
-
-      /* iss
-       * bit
-       * |24---~---10|9 |8|7    |6|5----0|
-       * |RES0       |EA|0|SiPTW|0| IFSC |
+      READ_SYSREG(hpfar_el2, HPFAR_EL2);
+      /* The first instruction fetch from on demand memory, retry it */
+      ret = vm_mem_fault(cur_vcpu, (hpfar_el2&0xfffffff8) << 8, iss);
+      if(ret == 0)
+        break;
+      /*
+       * No host memory for it, or e.g. a fetch from an S2_XN region
+       * such as passthrough MMIO, which is the guest's own bug.
+       * Either way the guest takes an instruction abort.
        */
-      switch(iss&0x3C){
-        case 0x0:
-          hyp_panic("Address Size fault at EL%x\n", iss&0b11);
-        case 0x2:
-          hyp_panic("Translation fault at EL%x\n", iss&0b11);
-        case 0x4:
-          hyp_panic("Access Flag fault at EL%x\n", iss&0b11);
-        case 0xC:
-          hyp_panic("Permission fault at EL%x\n", iss&0b11);
-        case 0x10:
-          hyp_panic("Synchronous External abort\n");
-        case 0x18:
-          hyp_panic("Synchronous Parity error on a memory access\n");
-        case 0x14:
-          hyp_panic("Synchronous External abort on a translation table walk at EL%x\n", iss&0b11);      
-        case 0x1C:
-          hyp_panic("Synchronous Parity error on a memory access on a translation table walk at EL%x\n", iss&0b11);
-        case 0x20:
-          hyp_panic("Alignment fault\n");
-        case 0x30:
-          hyp_panic("TLB Conflict fault\n");
-      }
+      if(ret != VM_MEM_ENOMEM)
+        log_warn("vm %s fetched an instruction it may not execute; ipa : %#x, ISS : %#x\n",
+            cur_vcpu->vm->name, (hpfar_el2&0xfffffff8) << 8, iss);
+      READ_SYSREG(far_el2, FAR_EL2);
+      vcpu_do_sync_abort(cur_vcpu, 1, far_el2);
       break;
 
     case 0x22:
@@ -225,6 +214,16 @@ void vm_interrupt_handler(pcpu_t *phys_cpu, uint64_t vec_num, uint32_t esr){
       break;
     case 0x24:
       // Data Abort from a lower Exception level
+      READ_SYSREG(hpfar_el2, HPFAR_EL2);
+      /* The first access to on demand memory, retry the instruction */
+      ret = vm_mem_fault(cur_vcpu, (hpfar_el2&0xfffffff8) << 8, iss);
+      if(ret == 0)
+        break;
+      if(ret == VM_MEM_ENOMEM){
+        READ_SYSREG(far_el2, FAR_EL2);
+        vcpu_do_sync_abort(cur_vcpu, 0, far_el2);
+        break;
+      }
       
       if(iss&(1<<10)){
         log_debug("far_elx is not valid\n");
@@ -233,11 +232,9 @@ void vm_interrupt_handler(pcpu_t *phys_cpu, uint64_t vec_num, uint32_t esr){
         // if far_el2 is valid 
 
         READ_SYSREG(far_el2, FAR_EL2);
-        READ_SYSREG(hpfar_el2, HPFAR_EL2);
         data_pa = ((hpfar_el2&0xfffffff8) << 8) + (far_el2&0xfff);
 
-        if(virt_mmio_reg_access(cur_vcpu, 
-            *(uint32_t *)inst_pa, data_pa, iss&(1<<6)) < 0){
+        if(virt_mmio_reg_access(cur_vcpu, iss, data_pa) < 0){
         //hyp_panic("Data Abort from EL0 or EL1\n");
         data_abort_print(LOG_DEBUG, iss);
         vcpu_do_vserror(cur_vcpu);
@@ -283,9 +280,11 @@ void vm_irq_interrupt_entry(uint64_t vec_num, uint32_t esr){
   /* 
   * We have already saved general purpose registers in the interrupt vector.
   * So we need to save other registers if we switch to another guest OS.
+  * FP/SIMD registers are saved lazily, see vcpu_fpu_switch().
+  * Cold system registers are saved only when another vcpu is switched in.
   */
-  vcpu_freg_save(phys_cpu->current_vcpu);
-  vcpu_save_all_sysregs(phys_cpu->current_vcpu);
+  vcpu_save_hot_sysregs(phys_cpu->current_vcpu);
+  vcpu_stat_exit(phys_cpu->current_vcpu, VCPU_STAT_EXIT_IRQ);
 
   //log_debug("Physical address of cause instruction : %#8x\n", inst_pa);
   if(hyp_timer_irq_is_pending(phys_cpu->cpu_id))
@@ -1,23 +1,35 @@
 #include "typedef.h"
 #include "uart.h"
 #include "spinlock.h"
+#include "asm_func.h"
 #include "lib.h"
 
-void *memset(void *b, int c, long len)
-{
-  char *p;
-  for (p = b; len > 0; len--)
-    *(p++) = c;
-  return b;
-}
+/* memset() and memcpy() are in lib_mem.S */
+
+#define SCTLR_EL2_M   (1 << 0)
+#define SCTLR_EL2_C   (1 << 2)
+#define DCZID_DZP     (1 << 4)
+#define DCZID_BS_MASK 0xF
+
+/* Bytes zeroed by a DC ZVA, 0 if memset() must not use it */
+uint64_t lib_mem_zva_size = 0;
 
-void *memcpy(void *dst, const void *src, long len)
+/*
+ * DC ZVA to Device memory causes an alignment fault,
+ * so it is used only if this cpu runs with the EL2 MMU and data cache on.
+ */
+void lib_mem_init(void)
 {
-  char *d = dst;
-  const char *s = src;
-  for (; len > 0; len--)
-    *(d++) = *(s++);
-  return dst;
+  uint64_t sctlr, dczid;
+
+  READ_SYSREG(sctlr, SCTLR_EL2);
+  READ_SYSREG(dczid, DCZID_EL0);
+
+  if((sctlr & (SCTLR_EL2_M | SCTLR_EL2_C)) == (SCTLR_EL2_M | SCTLR_EL2_C)
+      && !(dczid & DCZID_DZP))
+    lib_mem_zva_size = 4 << (dczid & DCZID_BS_MASK);
+  else
+    lib_mem_zva_size = 0;
 }
 
 int memcmp(const void *b1, const void *b2, long len)
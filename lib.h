@@ -3,6 +3,8 @@
 
 #include "typedef.h"
 
+extern uint64_t lib_mem_zva_size;
+void lib_mem_init(void);
 void *memset(void *b, int c, long len);
 void *memcpy(void *dst, const void *src, long len);
 int memcmp(const void *b1, const void *b2, long len);
@@ -1,43 +1,387 @@
-/* 
+/*
  * malloc.c
  * Memory Allcater
  * Buddy memory allocation
+ *
+ * The free area is managed in blocks of MEM_BLOCK_SIZE << order bytes
+ * (order 0 ~ MEM_MAX_ORDER). A block is always aligned to its size
+ * in the physical address space, so its buddy is at addr ^ size.
+ *
+ * One byte of mem_page_info[] per page describes the head page of
+ * each block; the other pages of a block have 0.
+ * An allocation whose size is not a power of 2 keeps only the blocks it needs,
+ * and the blocks after the first one are marked PAGE_INFO_CONT
+ * so that free() releases all of them.
  */
 
 #include "typedef.h"
 #include "lib.h"
+#include "log.h"
 #include "asm_func.h"
+#include "spinlock.h"
 #include "malloc.h"
 
 extern uint8_t _freearea_start;
 extern uint8_t _freearea_end;
 
-#define MEM_BLOCK_NUM (uint64_t)(((phys_addr_t)&_freearea_end -(phys_addr_t) &_freearea_start) / MEM_BLOCK_SIZE)
 #define MEM_BLOCK_SIZE  4096 // Byte per Block
-#define MEMORY_POOL_SIZE (MEM_BLOCK_SIZE*MEM_BLOCK_NUM)
 
-static volatile uint8_t *mem_pool = &_freearea_start;
-static int free_top_index = 0;
+#define PAGE_INFO_ORDER_MASK  0x1F
+#define PAGE_INFO_FREE    (1 << 5)  // head of a free block
+#define PAGE_INFO_ALLOC   (1 << 6)  // head of an allocated block
+#define PAGE_INFO_CONT    (1 << 7)  // allocated block following another block of the same allocation
 
+#define ORDER_SIZE(order) ((uint64_t)MEM_BLOCK_SIZE << (order))
+
+/* Free blocks are linked through their first bytes */
+typedef struct _mem_free_block_t {
+  struct _mem_free_block_t *next;
+  struct _mem_free_block_t *prev;
+} mem_free_block_t;
+
+/* [mem_start, mem_end) is managed by the buddy allocator */
+static phys_addr_t mem_start;
+static phys_addr_t mem_end;
+static uint8_t *mem_page_info;
+
+static mem_free_block_t *free_list[MEM_ORDER_NUM];
+static uint64_t free_block_num[MEM_ORDER_NUM];
+static uint64_t total_page_num;
+static uint64_t free_page_num;
+static uint64_t used_page_max;
+
+/* malloc is also called by stage 2 fault handlers on any cpu */
+static int malloc_lock = 0;
+
+static inline uint8_t *page_info(phys_addr_t addr){
+  return &mem_page_info[(addr - mem_start) / MEM_BLOCK_SIZE];
+}
+
+static inline int addr_is_managed(phys_addr_t addr){
+  return addr >= mem_start && addr < mem_end;
+}
+
+static void block_push(phys_addr_t addr, int order){
+  mem_free_block_t *block = (mem_free_block_t *)addr;
+
+  *page_info(addr) = PAGE_INFO_FREE | order;
+
+  block->prev = (mem_free_block_t *)0;
+  block->next = free_list[order];
+  if(free_list[order] != (mem_free_block_t *)0)
+    free_list[order]->prev = block;
+  free_list[order] = block;
+
+  free_block_num[order]++;
+}
+
+static void block_remove(phys_addr_t addr, int order){
+  mem_free_block_t *block = (mem_free_block_t *)addr;
+
+  *page_info(addr) = 0;
+
+  if(block->prev != (mem_free_block_t *)0)
+    block->prev->next = block->next;
+  else
+    free_list[order] = block->next;
+  if(block->next != (mem_free_block_t *)0)
+    block->next->prev = block->prev;
+
+  free_block_num[order]--;
+}
+
+/*
+ * Take a free block of order, splitting a larger one if needed.
+ * Return 0 if there is no free block large enough.
+ */
+static phys_addr_t block_pop(int order){
+  phys_addr_t addr;
+  int i;
+
+  for(i = order; i <= MEM_MAX_ORDER; i++){
+    if(free_list[i] != (mem_free_block_t *)0)
+      break;
+  }
+  if(i > MEM_MAX_ORDER)
+    return 0;
+
+  addr = (phys_addr_t)free_list[i];
+  block_remove(addr, i);
+
+  /* Return the upper halves */
+  while(i > order){
+    i--;
+    block_push(addr + ORDER_SIZE(i), i);
+  }
+
+  return addr;
+}
+
+/* Free the block of order at addr and coalesce it with its free buddies */
+static void block_free(phys_addr_t addr, int order){
+  phys_addr_t buddy;
+
+  *page_info(addr) = 0;
+
+  while(order < MEM_MAX_ORDER){
+    buddy = addr ^ ORDER_SIZE(order);
+    if(!addr_is_managed(buddy) || *page_info(buddy) != (PAGE_INFO_FREE | order))
+      break;
+
+    block_remove(buddy, order);
+    if(buddy < addr)
+      addr = buddy;
+    order++;
+  }
+
+  block_push(addr, order);
+}
+
+/*
+ * The allocated block of order at addr is used for page_num pages only.
+ * Keep the blocks which cover them and free the rest.
+ */
+static void block_trim(phys_addr_t addr, int order, uint64_t page_num){
+  uint8_t cont = 0;
+
+  while(page_num < (1ULL << order)){
+    order--;
+    if(page_num > (1ULL << order)){
+      /* The lower half is used entirely */
+      *page_info(addr) = PAGE_INFO_ALLOC | cont | order;
+      addr += ORDER_SIZE(order);
+      page_num -= 1ULL << order;
+      cont = PAGE_INFO_CONT;
+    }else{
+      /* The upper half is not used */
+      block_free(addr + ORDER_SIZE(order), order);
+    }
+  }
+
+  *page_info(addr) = PAGE_INFO_ALLOC | cont | order;
+}
 
 void mem_init(void){
-  free_top_index = 0;
+  phys_addr_t addr;
+  uint64_t info_size;
+  int order;
+
+  mem_start = ((phys_addr_t)&_freearea_start + MEM_BLOCK_SIZE - 1) & ~((phys_addr_t)MEM_BLOCK_SIZE - 1);
+  mem_end = (phys_addr_t)&_freearea_end & ~((phys_addr_t)MEM_BLOCK_SIZE - 1);
+
+  /* mem_page_info[] is placed at the head of the free area */
+  mem_page_info = (uint8_t *)mem_start;
+  info_size = (mem_end - mem_start) / MEM_BLOCK_SIZE;
+  memset(mem_page_info, 0, info_size);
+  addr = (mem_start + info_size + MEM_BLOCK_SIZE - 1) & ~((phys_addr_t)MEM_BLOCK_SIZE - 1);
+
+  for(order = 0; order <= MEM_MAX_ORDER; order++){
+    free_list[order] = (mem_free_block_t *)0;
+    free_block_num[order] = 0;
+  }
+
+  total_page_num = (mem_end - addr) / MEM_BLOCK_SIZE;
+  free_page_num = total_page_num;
+  used_page_max = 0;
+
+  /* Split the area into the largest aligned blocks */
+  while(addr < mem_end){
+    for(order = MEM_MAX_ORDER; order > 0; order--){
+      if((addr & (ORDER_SIZE(order) - 1)) == 0 && addr + ORDER_SIZE(order) <= mem_end)
+        break;
+    }
+    block_push(addr, order);
+    addr += ORDER_SIZE(order);
+  }
+
   log_info("&_freearea_start : %#x, &_freearea_end : %#x\n", &_freearea_start, &_freearea_end);
-  log_info("MEM_BLOCK_SIZE : %d, MEM_BLOCK_NUM : %d, MEMORY_POOL_SIZE : %d \n", MEM_BLOCK_SIZE, MEM_BLOCK_NUM, MEMORY_POOL_SIZE);
+  log_info("MEM_BLOCK_SIZE : %d, MEM_MAX_ORDER : %d, free pages : %d\n",
+      MEM_BLOCK_SIZE, MEM_MAX_ORDER, total_page_num);
 }
 
 void *malloc(uint64_t size){
-  int head_index;
-  
-  if(size %MEM_BLOCK_SIZE != 0){
-    size = size - (size % MEM_BLOCK_SIZE) + MEM_BLOCK_SIZE;
-  }
-  
-  if((free_top_index + size / MEM_BLOCK_SIZE) > (MEM_BLOCK_NUM-1))
-    hyp_panic("There is no free page_table. size : %#x\n", size);
-  
-  head_index = free_top_index;
-  free_top_index += size / MEM_BLOCK_SIZE;
-  memset(&mem_pool[head_index*MEM_BLOCK_SIZE], 0, size);
-  return &mem_pool[head_index*MEM_BLOCK_SIZE];
+  return malloc_aligned(size, MEM_BLOCK_SIZE);
+}
+
+/*
+ * Allocate size bytes whose physical address is aligned to align.
+ * align must be a power of 2 and a multiple of MEM_BLOCK_SIZE.
+ * The memory is zeroed.
+ */
+void *malloc_aligned(uint64_t size, uint64_t align){
+  void *addr = malloc_aligned_try(size, align);
+
+  if(addr == 0){
+    mem_stat_dump(LOG_ERROR);
+    hyp_panic("There is no free memory. size : %#x, align : %#x\n", size, align);
+  }
+
+  return addr;
+}
+
+/* Like malloc(), but return 0 if there is no free memory */
+void *malloc_try(uint64_t size){
+  return malloc_aligned_try(size, MEM_BLOCK_SIZE);
+}
+
+/*
+ * Like malloc_aligned(), but return 0 if there is no free block
+ * for the allocation, e.g. for memory a guest asks for.
+ */
+void *malloc_aligned_try(uint64_t size, uint64_t align){
+  phys_addr_t addr;
+  uint64_t page_num;
+  int order;
+
+  if(align < MEM_BLOCK_SIZE || (align & (align - 1)) != 0)
+    hyp_panic("Illegal alignment : %#x\n", align);
+
+  page_num = (size + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
+  if(page_num == 0)
+    page_num = 1;
+
+  for(order = 0; order <= MEM_MAX_ORDER; order++){
+    if((1ULL << order) >= page_num && ORDER_SIZE(order) >= align)
+      break;
+  }
+  if(order > MEM_MAX_ORDER)
+    hyp_panic("Too large allocation. size : %#x, align : %#x\n", size, align);
+
+  spin_lock(&malloc_lock);
+
+  addr = block_pop(order);
+  if(addr == 0){
+    spin_unlock(&malloc_lock);
+    return 0;
+  }
+
+  block_trim(addr, order, page_num);
+
+  free_page_num -= page_num;
+  if(total_page_num - free_page_num > used_page_max)
+    used_page_max = total_page_num - free_page_num;
+
+  spin_unlock(&malloc_lock);
+
+  /*
+   * The memory may have been mapped write-back to a guest before,
+   * and the hypervisor writes it non-cacheable.
+   * Write back and drop its cache lines before the memset(),
+   * so no dirty line overwrites what the hypervisor puts in it later.
+   */
+  dcache_clean_inval_range(addr, page_num * MEM_BLOCK_SIZE);
+  memset((void *)addr, 0, page_num * MEM_BLOCK_SIZE);
+  return (void *)addr;
+}
+
+/*
+ * Free the whole allocation returned by malloc() or malloc_aligned().
+ * An allocation partly returned by free_page() must be freed by free_page().
+ */
+void free(void *addr){
+  phys_addr_t block = (phys_addr_t)addr;
+  uint8_t info;
+  int order;
+
+  if(!addr_is_managed(block) || (block % MEM_BLOCK_SIZE) != 0)
+    hyp_panic("Illegal address to free : %#x\n", addr);
+
+  spin_lock(&malloc_lock);
+
+  info = *page_info(block);
+  if((info & PAGE_INFO_ALLOC) == 0 || (info & PAGE_INFO_CONT) != 0)
+    hyp_panic("Illegal address to free : %#x, page info : %#x\n", addr, info);
+
+  do{
+    order = info & PAGE_INFO_ORDER_MASK;
+    block_free(block, order);
+    free_page_num += 1ULL << order;
+
+    block += ORDER_SIZE(order);
+    info = addr_is_managed(block)? *page_info(block) : 0;
+  }while((info & PAGE_INFO_ALLOC) != 0 && (info & PAGE_INFO_CONT) != 0);
+
+  spin_unlock(&malloc_lock);
+}
+
+/*
+ * Free one page of any allocation.
+ * The block which has the page is split and
+ * the other pages stay allocated as separate blocks.
+ */
+void free_page(void *addr){
+  phys_addr_t page = (phys_addr_t)addr;
+  phys_addr_t block;
+  uint8_t info;
+  int order;
+
+  if(!addr_is_managed(page) || (page % MEM_BLOCK_SIZE) != 0)
+    hyp_panic("Illegal address to free : %#x\n", addr);
+
+  spin_lock(&malloc_lock);
+
+  /* Find the head of the allocated block which has the page */
+  for(order = 0; order <= MEM_MAX_ORDER; order++){
+    block = page & ~(ORDER_SIZE(order) - 1);
+    if(!addr_is_managed(block))
+      continue;
+    info = *page_info(block);
+    if((info & PAGE_INFO_ALLOC) != 0 && (info & PAGE_INFO_ORDER_MASK) == order)
+      break;
+  }
+  if(order > MEM_MAX_ORDER)
+    hyp_panic("Illegal address to free : %#x\n", addr);
+
+  while(order > 0){
+    order--;
+    if(page & ORDER_SIZE(order)){
+      *page_info(block) = PAGE_INFO_ALLOC | order;
+      block += ORDER_SIZE(order);
+    }else{
+      *page_info(block + ORDER_SIZE(order)) = PAGE_INFO_ALLOC | order;
+    }
+  }
+
+  block_free(page, 0);
+  free_page_num++;
+
+  spin_unlock(&malloc_lock);
+}
+
+void mem_stat_get(mem_stat_t *stat){
+  uint64_t largest = 0;
+  int order;
+
+  spin_lock(&malloc_lock);
+
+  stat->total_page_num = total_page_num;
+  stat->free_page_num = free_page_num;
+  stat->used_page_max = used_page_max;
+  for(order = 0; order <= MEM_MAX_ORDER; order++){
+    stat->free_block_num[order] = free_block_num[order];
+    if(free_block_num[order] != 0)
+      largest = 1ULL << order;
+  }
+
+  spin_unlock(&malloc_lock);
+
+  stat->largest_free_page_num = largest;
+  stat->fragmentation = (free_page_num == 0)? 0 : 100 - largest * 100 / stat->free_page_num;
+}
+
+void mem_stat_dump(log_level_t level){
+  mem_stat_t stat;
+  int order;
+
+  mem_stat_get(&stat);
+
+  log_printf(level, "Memory : total %d pages, free %d pages, used max %d pages\n",
+      stat.total_page_num, stat.free_page_num, stat.used_page_max);
+  log_printf(level, "  largest free block : %d pages, fragmentation : %d%%\n",
+      stat.largest_free_page_num, stat.fragmentation);
+  for(order = 0; order <= MEM_MAX_ORDER; order++){
+    if(stat.free_block_num[order] != 0)
+      log_printf(level, "  order %2d (%#8x Byte) : %d free blocks\n",
+          order, ORDER_SIZE(order), stat.free_block_num[order]);
+  }
 }
@@ -1,7 +1,30 @@
 #ifndef _MALLOC_H_INCLUDED_
 #define _MALLOC_H_INCLUDED_
 
+#include "typedef.h"
+#include "log.h"
+
+/* Blocks of 4KB ~ 1GB */
+#define MEM_MAX_ORDER 18
+#define MEM_ORDER_NUM (MEM_MAX_ORDER + 1)
+
+typedef struct _mem_stat_t {
+  uint64_t total_page_num;
+  uint64_t free_page_num;
+  uint64_t used_page_max;   // high-water mark of allocated pages
+  uint64_t largest_free_page_num;
+  uint64_t fragmentation;   // % of free pages out of the largest free block
+  uint64_t free_block_num[MEM_ORDER_NUM];
+} mem_stat_t;
+
 void mem_init(void);
 void *malloc(uint64_t size);
+void *malloc_aligned(uint64_t size, uint64_t align);
+void *malloc_try(uint64_t size);
+void *malloc_aligned_try(uint64_t size, uint64_t align);
+void free(void *addr);
+void free_page(void *addr);
+void mem_stat_get(mem_stat_t *stat);
+void mem_stat_dump(log_level_t level);
 
 #endif
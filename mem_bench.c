@@ -0,0 +1,84 @@
+/*
+ * mem_bench.c
+ * Boot time benchmark of memset() and memcpy()
+ *
+ * Set CONFIG_MEM_BENCH in hyp_config.h to run it after mem_init().
+ * Each line reports the bandwidth of one operation over MEM_BENCH_SIZE bytes,
+ * the byte loop is the former implementation for comparison.
+ */
+
+#include "typedef.h"
+#include "lib.h"
+#include "log.h"
+#include "asm_func.h"
+#include "malloc.h"
+#include "mem_bench.h"
+
+#if CONFIG_MEM_BENCH
+
+#define MEM_BENCH_SIZE  (8 * 1024 * 1024)
+
+static uint64_t mem_bench_freq;
+
+static inline uint64_t mem_bench_ticks(void){
+  uint64_t t;
+
+  asm volatile("isb");
+  READ_SYSREG(t, CNTPCT_EL0);
+  return t;
+}
+
+static void mem_bench_report(char *name, uint64_t len, uint64_t ticks){
+  uint64_t mbps;
+
+  if(ticks == 0)
+    ticks = 1;
+  mbps = len * mem_bench_freq / ticks / 1000000;
+
+  log_info("mem_bench %s : %d bytes, %d ticks, %d.%03d GB/s\n",
+      name, len, ticks, mbps / 1000, mbps % 1000);
+}
+
+static void byte_memcpy(char *d, const char *s, long len){
+  for (; len > 0; len--)
+    *(d++) = *(s++);
+}
+
+void mem_bench(void){
+  char *src, *dst;
+  uint64_t t;
+
+  READ_SYSREG(mem_bench_freq, CNTFRQ_EL0);
+  log_info("mem_bench : DC ZVA size : %d\n", lib_mem_zva_size);
+
+  src = malloc(MEM_BENCH_SIZE + 4096);
+  dst = malloc(MEM_BENCH_SIZE + 4096);
+
+  t = mem_bench_ticks();
+  memset(dst, 0, MEM_BENCH_SIZE);
+  mem_bench_report("memset_zero", MEM_BENCH_SIZE, mem_bench_ticks() - t);
+
+  t = mem_bench_ticks();
+  memset(src, 0x5a, MEM_BENCH_SIZE);
+  mem_bench_report("memset", MEM_BENCH_SIZE, mem_bench_ticks() - t);
+
+  t = mem_bench_ticks();
+  memcpy(dst, src, MEM_BENCH_SIZE);
+  mem_bench_report("memcpy_aligned", MEM_BENCH_SIZE, mem_bench_ticks() - t);
+
+  t = mem_bench_ticks();
+  memcpy(dst, src + 3, MEM_BENCH_SIZE);
+  mem_bench_report("memcpy_unaligned", MEM_BENCH_SIZE, mem_bench_ticks() - t);
+
+  if(memcmp(dst, src + 3, MEM_BENCH_SIZE) != 0)
+    log_error("mem_bench : memcpy_unaligned copied wrong data\n");
+
+  t = mem_bench_ticks();
+  byte_memcpy(dst, src, MEM_BENCH_SIZE);
+  mem_bench_report("byte_loop", MEM_BENCH_SIZE, mem_bench_ticks() - t);
+
+  free(src);
+  free(dst);
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef _MEM_BENCH_H_INCLUDED_
+#define _MEM_BENCH_H_INCLUDED_
+
+#include "hyp_config.h"
+
+#if CONFIG_MEM_BENCH
+void mem_bench(void);
+#endif
+
+#endif
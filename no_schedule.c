@@ -31,6 +31,7 @@ scheduler_t no_scheduler = {
   no_scheduler_remove,
   no_schedule,
   no_schedule_dump_ready_vcpu,
+  NULL,
 };
 
 /*
@@ -9,6 +9,10 @@
 /* defined in phys_cpu_setting.c */
 extern pcpu_t phys_cpus[CPU_NUM];
 
+/* defined in memory.ld */
+extern char _stack_end[];
+extern char _stack_size[];
+
 /* TODO */
 pcpu_t *current_phys_cpu_core_init(void){
   uint32_t cpu_id;
@@ -19,24 +23,27 @@ pcpu_t *current_phys_cpu_core_init(void){
     hyp_panic("illegal cpu id : %#x\n", cpu_id);
 
   phys_cpu = &phys_cpus[cpu_id];
+  phys_cpu->self = phys_cpu;
+  /* The same stack as startup_entry : _stack_end - _stack_size * cpuid */
+  phys_cpu->stack_top = (phys_addr_t)_stack_end
+                          - (phys_addr_t)_stack_size * cpu_id;
   phys_cpu->cpu_id = cpu_id;
   phys_cpu->current_vcpu = NULL;
   phys_cpu->last_vcpu = NULL;
-
+  phys_cpu->fpu_owner = NULL;
+  phys_cpu->sysreg_owner = NULL;
+  phys_cpu->lock_depth = 0;
 
   READ_SYSREG(phys_cpu->freq, CNTFRQ_EL0);
 
+  /* From now on, get_current_phys_cpu() and the vectors use TPIDR_EL2 */
+  WRITE_SYSREG(TPIDR_EL2, phys_cpu);
+  asm volatile("isb");
+
   return phys_cpu;
 }
 
 
-pcpu_t *get_current_phys_cpu(void){
-  uint32_t cpu_id;
-  READ_CPUID(cpu_id);
-  
-  return &phys_cpus[cpu_id];
-}
-
 pcpu_t *get_phys_cpu_by_cpu_id(uint8_t cpu_id){
   return &phys_cpus[cpu_id];
 }
@@ -13,20 +13,36 @@ typedef struct _pcpu_t pcpu_t;
 #include "vcpu.h"
 #include "schedule.h"
 
+/*
+ * TPIDR_EL2 holds &phys_cpus[cpu_id] of each cpu,
+ * so the exception vectors and get_current_phys_cpu() reach it by one mrs.
+ * The fields used by the vectors are kept in the first cache line.
+ */
 typedef struct _pcpu_t{
+  struct _pcpu_t *self;
+  phys_addr_t stack_top;  // sp_el2 of the hypervisor on exception entry
+  vcpu_t *current_vcpu;
   uint32_t cpu_id;
   vcpu_t *last_vcpu;
-  vcpu_t *current_vcpu;
   uint64_t freq;
-  uint64_t intr_state;
+  uint64_t intr_state;  // DAIF saved by the outermost spin_lock()
+  uint32_t lock_depth;  // number of spin locks held by this cpu
   int schedule_is_needed;
   scheduler_t *scheduler;
-} pcpu_t;
+  vcpu_t *fpu_owner;  // vcpu whose FP/SIMD registers are live on this cpu
+  vcpu_t *sysreg_owner; // vcpu whose cold system registers are live on this cpu
+} __attribute__((aligned(CACHE_LINE_SIZE))) pcpu_t;
 
 extern pcpu_t phys_cpus[CPU_NUM];
 
 pcpu_t *current_phys_cpu_core_init(void);
-pcpu_t *get_current_phys_cpu(void);
+
+static inline pcpu_t *get_current_phys_cpu(void){
+  pcpu_t *phys_cpu;
+  asm volatile("mrs %0, tpidr_el2" : "=r" (phys_cpu));
+  return phys_cpu;
+}
+
 pcpu_t *get_phys_cpu_by_cpu_id(uint8_t cpu_id);
 
 #endif
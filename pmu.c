@@ -125,6 +125,15 @@ uint64_t cycle_counter_read(void){
   return r;
 }
 
+/* Count cycles in EL2, too (PMCCFILTR_EL0.NSH) */
+void cycle_counter_count_el2(void){
+  uint32_t r;
+
+  READ_SYSREG(r, pmccfiltr_el0);
+  r |= (1<<27);
+  WRITE_SYSREG(pmccfiltr_el0, r);
+}
+
 void cycle_counter_reset(void){
   uint32_t r;
 
@@ -6,6 +6,7 @@
 
 void cycle_count_start(void);
 uint64_t cycle_counter_read(void);
+void cycle_counter_count_el2(void);
 uint64_t cycle_count_stop(void);
 void dump_cpu_usage_start(pcpu_t *phys_cpu);
 void dump_cpu_usage_stop(void);
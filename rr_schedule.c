@@ -10,16 +10,19 @@
 #include "asm_func.h"
 #include "vm.h"
 #include "vcpu.h"
+#include "runqueue.h"
 #include "hyp_timer.h"
+#include "spinlock.h"
+#include "smp_mbox.h"
 #include "schedule.h"
 
 static scheduler_init_fn_t    rr_scheduler_init;
 static scheduler_add_fn_t     rr_scheduler_add;
 static scheduler_remove_fn_t  rr_scheduler_remove;
-static schedule_fn_t          rr_schedule_dummy;
+static schedule_fn_t          rr_schedule;
 static scheduler_dump_ready_vcpu_fn_t  rr_dump_ready_vcpu;
 
-static void periodical_schedule(void);
+static void periodical_schedule(pcpu_t *phys_cpu, uint64_t arg);
 
 scheduler_t rr_scheduler = {
   {NULL, NULL, NULL, NULL},
@@ -29,21 +32,17 @@ scheduler_t rr_scheduler = {
   rr_scheduler_init,
   rr_scheduler_add,
   rr_scheduler_remove,
-  rr_schedule_dummy,
+  rr_schedule,
   rr_dump_ready_vcpu,
+  NULL,
 };
 
-static struct {
-  vcpu_t *head;
-  vcpu_t *tail;
-} ready_vcpu;
+/* All vcpus are queued at priority 0 */
+static runqueue_t rr_runqueue;
 
 #define SCHEDULE_CYCLE_TIME_MSEC  100
 
 
-/* 
- * rr_scheduler does not use phys_cpu->schedule_is_needed
- */
 /*
  * rr_scheduler_init() is called in scheduler_init()
  * after rr_scheduler.phys_cpu and rr_scheduler.pcpu?num are set.
@@ -51,8 +50,7 @@ static struct {
 static void rr_scheduler_init(void){
   int i;
 
-  ready_vcpu.head = NULL;
-  ready_vcpu.tail = NULL;
+  runqueue_init(&rr_runqueue);
 
   for(i=0; i<rr_scheduler.pcpu_num; i++){
     timer_event_add(rr_scheduler.phys_cpu[i],
@@ -79,71 +77,72 @@ static void rr_scheduler_register_phys_cpu(pcpu_t *phys_cpu){
 
 /* Add vcpu to the tail of ready que */
 static void rr_scheduler_add(vcpu_t *vcpu){
-  vcpu_t *t_vcpu;
+  int i;
 
-  if(ready_vcpu.head ==NULL)
-    ready_vcpu.head = vcpu;
-  else
-    ready_vcpu.tail->next = vcpu;
-  
-  ready_vcpu.tail = vcpu;
+  runqueue_add(&rr_runqueue, &vcpu->rq_node, 0);
+
+  /* Idle cpus run it without waiting for the next period */
+  for(i=0; i<rr_scheduler.pcpu_num; i++){
+    if(rr_scheduler.phys_cpu[i]->current_vcpu != NULL)
+      continue;
+    rr_scheduler.phys_cpu[i]->schedule_is_needed = 1;
+    if(rr_scheduler.phys_cpu[i] != get_current_phys_cpu())
+      smp_send_mailbox(rr_scheduler.phys_cpu[i]->cpu_id, MAIL_TYPE_SCHEDULE);
+  }
 }
 
 static void rr_scheduler_remove(vcpu_t *vcpu){
-  vcpu_t *t_vcpu;
-
-  /* Remove from ready que */
-  if(t_vcpu == ready_vcpu.head){
-    ready_vcpu.head = t_vcpu->next;
-
-  }else if(t_vcpu == ready_vcpu.tail){
-    ready_vcpu.head = t_vcpu->next;
-
-  }else{
-    for(t_vcpu = ready_vcpu.head; ; t_vcpu->next){
-      // This vcpu has already removed from  ready vcpu
-      if(t_vcpu == ready_vcpu.tail)
-        return;
-      if(t_vcpu->next == vcpu)
-        break;
-    }
-    //prev_vcpu->next = vcpu->next
-    t_vcpu->next = t_vcpu->next->next;
-  }
+  /* This vcpu has already removed from ready vcpu */
+  if(!rq_node_is_queued(&vcpu->rq_node))
+    return;
 
-  vcpu->next = NULL;
+  runqueue_remove(&rr_runqueue, &vcpu->rq_node);
 }
 
-static void rr_schedule_dummy(pcpu_t *phys_cpu){
-  return;
+static void rr_schedule(pcpu_t *phys_cpu){
+  rq_node_t *node;
+
+  phys_cpu->schedule_is_needed = 0;
+
+  /* The running vcpu is preempted only by periodical_schedule() */
+  if(phys_cpu->current_vcpu != NULL)
+    return;
+
+  node = runqueue_pop(&rr_runqueue);
+  if(node != NULL)
+    phys_cpu->current_vcpu = RQ_NODE_ENTRY(node, vcpu_t, rq_node); /* Set as current vcpu */
 }
 
 static void rr_dump_ready_vcpu(log_level_t level){
-  int i;
+  rq_node_t *node;
   vcpu_t *t_vcpu;
 
   log_printf(level, "Start dump vcpu in round robin scheduler ready que\n");
 
-  t_vcpu = ready_vcpu.head;
-  while(t_vcpu != NULL){
+  for(node = rr_runqueue.head[0].next; node != &rr_runqueue.head[0]; node = node->next){
+    t_vcpu = RQ_NODE_ENTRY(node, vcpu_t, rq_node);
     log_printf(level, "ready vm:%s vcpu_id:%d\n", t_vcpu->vm->name, t_vcpu->vcpu_id);
-    t_vcpu = t_vcpu->next;
   }
 
   log_printf(level, "=================   End   =================\n");
 }
 
-static void periodical_schedule(void){
-  pcpu_t *phys_cpu = get_current_phys_cpu();
-
-  timer_event_add(phys_cpu->cpu_id, periodical_schedule, SCHEDULE_CYCLE_TIME_MSEC, 0);
-  
-  /* Add last_vcpu to the tail of ready queue */
-  vcpu_sleep(phys_cpu->last_vcpu);
-  vcpu_ready(phys_cpu->last_vcpu);
-  
-  phys_cpu->current_vcpu = ready_vcpu.head; /* Set as current vcpu */
-  
-  /* Remove this vcpu from readyque */
-  rr_scheduler_remove(phys_cpu->current_vcpu);
+/*
+ * Timer event of each cpu.
+ * Put the running vcpu back to the tail of ready que
+ * and let do_schedule() call rr_schedule() on the way back to the guest.
+ * The lock serializes it with vcpu_sleep() and wakeups on other cpus.
+ */
+static void periodical_schedule(pcpu_t *phys_cpu, uint64_t arg){
+  vcpu_t *vcpu = phys_cpu->current_vcpu;
+
+  timer_event_add(phys_cpu, periodical_schedule, SCHEDULE_CYCLE_TIME_MSEC, 0);
+
+  /* Add the running vcpu to the tail of ready queue if another vcpu waits */
+  spin_lock(&rr_scheduler.lock);
+  if(vcpu != NULL && vcpu->state == VCPU_STATE_RUN && rr_runqueue.num != 0)
+    vcpu_preempt(vcpu);
+  spin_unlock(&rr_scheduler.lock);
+
+  phys_cpu->schedule_is_needed = 1;
 }
@@ -0,0 +1,110 @@
+/*
+ * runqueue.h
+ * Runqueue of ready vcpus shared by the schedulers
+ *
+ * Each priority level has a circular doubly linked list of rq_node_t
+ * embedded in vcpu_t, so a vcpu is added or removed in O(1)
+ * without walking the list.
+ * Bit (31 - prio) of bitmap is set while the list of prio is not empty,
+ * so the highest priority (the smallest number) is found by one CLZ.
+ *
+ * The callers hold the lock of the scheduler which owns the runqueue.
+ * This header depends only on typedef.h,
+ * so tools/runqueue_bench.c builds it on the host.
+ */
+
+#ifndef _RUNQUEUE_H_INCLUDED_
+#define _RUNQUEUE_H_INCLUDED_
+
+#include "typedef.h"
+
+#define RUNQUEUE_PRIO_NUM 32
+
+typedef struct _rq_node_t {
+  struct _rq_node_t *next;
+  struct _rq_node_t *prev;
+  int prio;   // -1 while the node is not in a runqueue
+} rq_node_t;
+
+typedef struct _runqueue_t {
+  uint32_t bitmap;  // bit (31 - prio) : head[prio] is not empty
+  uint32_t num;     // nodes in the runqueue
+  rq_node_t head[RUNQUEUE_PRIO_NUM];
+} runqueue_t;
+
+/* The structure of type which has node as its member */
+#define RQ_NODE_ENTRY(node, type, member) \
+  ((type *)((uint8_t *)(node) - offsetof(type, member)))
+
+#define RQ_PRIO_BIT(prio) (0x80000000U >> (prio))
+
+static inline void rq_node_init(rq_node_t *node){
+  node->next = node;
+  node->prev = node;
+  node->prio = -1;
+}
+
+static inline int rq_node_is_queued(rq_node_t *node){
+  return node->prio >= 0;
+}
+
+static inline void runqueue_init(runqueue_t *rq){
+  int i;
+
+  for(i=0; i<RUNQUEUE_PRIO_NUM; i++)
+    rq_node_init(&rq->head[i]);
+  rq->bitmap = 0;
+  rq->num = 0;
+}
+
+/*
+ * Add node before pos in the list of prio.
+ * pos is a node in the list or &rq->head[prio] for the tail.
+ * Schedulers which keep a list sorted (e.g. by deadline) walk it to find pos.
+ */
+static inline void runqueue_add_before(runqueue_t *rq, rq_node_t *node, int prio, rq_node_t *pos){
+  node->prio = prio;
+  node->next = pos;
+  node->prev = pos->prev;
+  pos->prev->next = node;
+  pos->prev = node;
+
+  rq->bitmap |= RQ_PRIO_BIT(prio);
+  rq->num++;
+}
+
+/* Add node to the tail of the list of prio */
+static inline void runqueue_add(runqueue_t *rq, rq_node_t *node, int prio){
+  runqueue_add_before(rq, node, prio, &rq->head[prio]);
+}
+
+/* node must be in rq, see rq_node_is_queued() */
+static inline void runqueue_remove(runqueue_t *rq, rq_node_t *node){
+  rq_node_t *head = &rq->head[node->prio];
+
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  if(head->next == head)
+    rq->bitmap &= ~RQ_PRIO_BIT(node->prio);
+
+  rq_node_init(node);
+  rq->num--;
+}
+
+/* Return the first node of the highest priority, or NULL if rq is empty */
+static inline rq_node_t *runqueue_peek(runqueue_t *rq){
+  if(rq->bitmap == 0)
+    return NULL;
+  return rq->head[__builtin_clz(rq->bitmap)].next;
+}
+
+/* Remove and return the first node of the highest priority, or NULL */
+static inline rq_node_t *runqueue_pop(runqueue_t *rq){
+  rq_node_t *node = runqueue_peek(rq);
+
+  if(node != NULL)
+    runqueue_remove(rq, node);
+  return node;
+}
+
+#endif
@@ -1,6 +1,20 @@
 /*
  * scheduler.c :
  *  manage schedulers
+ *
+ * Locking :
+ *  Each scheduler_t has its own runqueue and scheduler_t.lock protects
+ *  the runqueue, ready_vcpu_num and the state of the vcpus of its vms.
+ *  - do_schedule() takes the lock of the scheduler of the physical cpu
+ *    only when phys_cpu->schedule_is_needed is set.
+ *  - A wakeup (vcpu_ready()) from any cpu takes the lock of
+ *    the woken vcpu's scheduler, which may differ from the one of this cpu,
+ *    and does nothing unless the vcpu is still sleeping under the lock.
+ *  - A cpu holds at most one runqueue lock. An operation which needs
+ *    two runqueues (e.g. migration) must take them in ascending address order.
+ *  - The runqueue lock is taken before the locks of malloc, slab caches
+ *    and hyp_timer, and is never taken while holding one of them.
+ *    Timer event functions run without hyp_timer_spinlock, see hyp_timer.c.
  */
 
 #include "typedef.h"
@@ -9,22 +23,21 @@
 #include "asm_func.h"
 #include "vm.h"
 #include "vcpu.h"
+#include "spinlock.h"
 #include "schedule.h"
 
-static int scheduler_locked = 0;;
-
 scheduler_t *schedulers [] = {
   &fcfs_scheduler,
   &rr_scheduler,
   &no_scheduler,
+  &credit_scheduler,
+  &edf_scheduler,
 };
 
 void schedulers_init(void){
   int i;
   pcpu_t *t_phys_cpu;
 
-  scheduler_locked = 0;
-
   /* Set scheduler's pointers to phys_cpu*/
   for(i=0; i<CPU_NUM; i++){
     t_phys_cpu = get_phys_cpu_by_cpu_id(i);
@@ -37,22 +50,35 @@ void schedulers_init(void){
 
 
   for(i = 0; i < sizeof(schedulers)/sizeof(schedulers[0]); i++){
+    schedulers[i]->lock = 0;
     if(schedulers[i]->scheduler_init != NULL)
       schedulers[i]->scheduler_init();
   }
 }
 
-/* TODO : Separate scheduler_locked into each scheduler */
+/*
+ * Most exits do not need scheduling, so they return without the lock.
+ * A flag set by another cpu just after the check is seen on the next exit,
+ * as the cpu which sets the flag of another cpu always sends it
+ * MAIL_TYPE_SCHEDULE (see scheduler_add() of each scheduler).
+ */
 void do_schedule(pcpu_t *phys_cpu){
-  spin_lock(&scheduler_locked);
+  scheduler_t *scheduler = phys_cpu->scheduler;
+
+  if(!*(volatile int *)&phys_cpu->schedule_is_needed)
+    return;
+
+  spin_lock(&scheduler->lock);
 
   if(phys_cpu->schedule_is_needed){
-    phys_cpu->scheduler->schedule(phys_cpu);
-    if(phys_cpu->current_vcpu != NULL)
+    scheduler->schedule(phys_cpu);
+    /* schedule() may keep the running vcpu */
+    if(phys_cpu->current_vcpu != NULL
+        && phys_cpu->current_vcpu->state != VCPU_STATE_RUN)
       vcpu_active(phys_cpu->current_vcpu, phys_cpu);
   }
 
-  spin_unlock(&scheduler_locked);
+  spin_unlock(&scheduler->lock);
 }
 
 void dump_ready_vcpu(log_level_t level){
@@ -13,6 +13,8 @@ typedef void (scheduler_add_fn_t)(vcpu_t *vcpu);
 typedef void (scheduler_remove_fn_t)(vcpu_t *vcpu);
 typedef void (schedule_fn_t)(pcpu_t *phys_cpu);
 typedef void (scheduler_dump_ready_vcpu_fn_t)(log_level_t level);
+struct _vm_sched_param_t;
+typedef int (scheduler_admit_fn_t)(struct _vm_sched_param_t *param, int vcpu_num);
 
 typedef struct _scheduler_t{
   pcpu_t *phys_cpu[CPU_NUM];
@@ -24,11 +26,16 @@ typedef struct _scheduler_t{
   scheduler_remove_fn_t *scheduler_remove;
   schedule_fn_t         *schedule;
   scheduler_dump_ready_vcpu_fn_t  *dump_ready_vcpu;
+  scheduler_admit_fn_t  *admit;   // returns non 0 to reject a new vm, may be NULL
+  int ready_vcpu_num; // number of READY vcpus, read by the fast exit path
+  int lock;   // runqueue lock, see schedule.c for the lock order
 } scheduler_t;
 
 extern scheduler_t fcfs_scheduler;
 extern scheduler_t rr_scheduler;
 extern scheduler_t no_scheduler;
+extern scheduler_t credit_scheduler;
+extern scheduler_t edf_scheduler;
 
 void schedulers_init(void);
 void do_schedule(pcpu_t *phys_cpu);
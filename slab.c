@@ -0,0 +1,172 @@
+/*
+ * slab.c
+ * Object caches for hypervisor objects
+ *
+ * A slab is a block of slab_size bytes from malloc_aligned(), aligned to its size.
+ * Its head has the owner cache and the private data of each object,
+ * and the objects follow it.
+ *
+ * Each cpu keeps up to SLAB_MAGAZINE_SIZE free objects in its magazine,
+ * so most of allocations and frees take no lock.
+ * Half of a magazine is refilled from or flushed to the depot of the cache
+ * under cache->lock at once.
+ * Slabs are not returned to malloc.
+ */
+
+#include "typedef.h"
+#include "lib.h"
+#include "log.h"
+#include "asm_func.h"
+#include "malloc.h"
+#include "hyp_mmu.h"
+#include "pcpu.h"
+#include "spinlock.h"
+#include "slab.h"
+
+#define ROUND_UP(x, align)  (((x) + (align) - 1) & ~((uint64_t)(align) - 1))
+
+typedef struct _slab_t {
+  slab_cache_t *cache;
+  uint8_t priv[];
+} slab_t;
+
+#define SLAB_OF(cache, obj) ((slab_t *)((phys_addr_t)(obj) & ~((cache)->slab_size - 1)))
+
+/* Decide the slab size and the number of objects per slab */
+static void slab_cache_layout(slab_cache_t *cache){
+  uint64_t align = (cache->obj_size >= PAGE_SIZE)? PAGE_SIZE : CACHE_LINE_SIZE;
+  uint64_t slab_size = PAGE_SIZE;
+  uint64_t num, offset;
+
+  cache->obj_size = ROUND_UP(cache->obj_size, align);
+
+  while(1){
+    num = (slab_size - sizeof(slab_t)) / (cache->obj_size + cache->priv_size);
+    for(; num > 0; num--){
+      offset = ROUND_UP(sizeof(slab_t) + cache->priv_size * num, align);
+      if(offset + cache->obj_size * num <= slab_size)
+        break;
+    }
+    if(num >= SLAB_MIN_OBJ_NUM)
+      break;
+    slab_size <<= 1;
+  }
+
+  cache->slab_size = slab_size;
+  cache->obj_num = num;
+  cache->obj_offset = offset;
+}
+
+/* Add a new slab to the depot. Called with cache->lock */
+static void slab_cache_grow(slab_cache_t *cache){
+  slab_t *slab;
+  uint8_t *obj;
+  uint32_t i;
+
+  if(cache->slab_size == 0)
+    slab_cache_layout(cache);
+
+  /* malloc_aligned() zeroes the private data */
+  slab = malloc_aligned(cache->slab_size, cache->slab_size);
+  slab->cache = cache;
+
+  obj = (uint8_t *)slab + cache->obj_offset;
+  for(i=0; i<cache->obj_num; i++, obj += cache->obj_size){
+    *(void **)obj = cache->depot;
+    cache->depot = obj;
+  }
+  cache->depot_num += cache->obj_num;
+  cache->slab_num++;
+
+  log_debug("slab cache %s grew; slab : %#x, objects : %d\n",
+      cache->name, slab, cache->obj_num);
+}
+
+static void slab_magazine_refill(slab_cache_t *cache, slab_magazine_t *mag){
+  spin_lock(&cache->lock);
+
+  if(cache->depot_num < SLAB_MAGAZINE_SIZE / 2)
+    slab_cache_grow(cache);
+
+  while(mag->num < SLAB_MAGAZINE_SIZE / 2 && cache->depot_num > 0){
+    mag->objs[mag->num++] = cache->depot;
+    cache->depot = *(void **)cache->depot;
+    cache->depot_num--;
+  }
+
+  spin_unlock(&cache->lock);
+}
+
+static void slab_magazine_flush(slab_cache_t *cache, slab_magazine_t *mag){
+  void *obj;
+
+  spin_lock(&cache->lock);
+
+  while(mag->num > SLAB_MAGAZINE_SIZE / 2){
+    obj = mag->objs[--mag->num];
+    *(void **)obj = cache->depot;
+    cache->depot = obj;
+    cache->depot_num++;
+  }
+
+  spin_unlock(&cache->lock);
+}
+
+/* Allocate a zeroed object of cache */
+void *slab_cache_alloc(slab_cache_t *cache){
+  slab_magazine_t *mag;
+  uint64_t daif;
+  void *obj;
+
+  /* The magazine is only touched by this cpu */
+  READ_SYSREG(daif, DAIF);
+  INTR_DISABLE;
+
+  mag = &cache->mag[get_current_phys_cpu()->cpu_id];
+  if(mag->num == 0)
+    slab_magazine_refill(cache, mag);
+  obj = mag->objs[--mag->num];
+
+  WRITE_SYSREG(DAIF, daif);
+
+  memset(obj, 0, cache->obj_size);
+  return obj;
+}
+
+void slab_cache_free(slab_cache_t *cache, void *obj){
+  slab_magazine_t *mag;
+  uint64_t daif;
+
+  if(cache->slab_size == 0 || SLAB_OF(cache, obj)->cache != cache)
+    hyp_panic("Illegal object to free to slab cache %s : %#x\n", cache->name, obj);
+
+  READ_SYSREG(daif, DAIF);
+  INTR_DISABLE;
+
+  mag = &cache->mag[get_current_phys_cpu()->cpu_id];
+  if(mag->num == SLAB_MAGAZINE_SIZE)
+    slab_magazine_flush(cache, mag);
+  mag->objs[mag->num++] = obj;
+
+  WRITE_SYSREG(DAIF, daif);
+}
+
+/* Return the cache->priv_size bytes of private data of obj */
+void *slab_obj_priv(slab_cache_t *cache, void *obj){
+  slab_t *slab = SLAB_OF(cache, obj);
+  uint64_t index = ((phys_addr_t)obj - (phys_addr_t)slab - cache->obj_offset) / cache->obj_size;
+
+  return &slab->priv[index * cache->priv_size];
+}
+
+void slab_cache_dump(slab_cache_t *cache, log_level_t level){
+  uint64_t cached = 0;
+  int i;
+
+  for(i=0; i<CPU_NUM; i++)
+    cached += cache->mag[i].num;
+
+  log_printf(level, "slab cache %s : object size %d, slabs %d (%d objects), used %d, free %d + %d cached\n",
+      cache->name, cache->obj_size, cache->slab_num, cache->slab_num * cache->obj_num,
+      cache->slab_num * cache->obj_num - cache->depot_num - cached, cache->depot_num, cached);
+}
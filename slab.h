@@ -0,0 +1,54 @@
+/*
+ * slab.h
+ * Object caches for hypervisor objects
+ */
+
+#ifndef _SLAB_H_INCLUDED_
+#define _SLAB_H_INCLUDED_
+
+#include "typedef.h"
+#include "log.h"
+#include "pcpu.h"
+
+/* Objects cached by each cpu */
+#define SLAB_MAGAZINE_SIZE  16
+/* A slab has at least this number of objects */
+#define SLAB_MIN_OBJ_NUM    8
+
+typedef struct _slab_magazine_t {
+  uint32_t num;
+  void *objs[SLAB_MAGAZINE_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE))) slab_magazine_t;
+
+typedef struct _slab_cache_t {
+  const char *name;
+  uint64_t obj_size;
+  uint64_t priv_size;   // bytes of private data per object, see slab_obj_priv()
+  /* Layout of the slabs, set by the first slab_cache_grow() */
+  uint64_t slab_size;
+  uint32_t obj_num;     // objects per slab
+  uint32_t obj_offset;  // offset of the first object in a slab
+  /* Objects not cached by any cpu, linked through their first word */
+  int lock;
+  void *depot;
+  uint64_t depot_num;
+  uint64_t slab_num;
+  slab_magazine_t mag[CPU_NUM];
+} slab_cache_t;
+
+/* Static initializer of slab_cache_t */
+#define SLAB_CACHE_INIT(cache_name, size, priv) { \
+  .name = (cache_name), \
+  .obj_size = (size), \
+  .priv_size = (priv), \
+  .slab_size = 0, \
+  .lock = 0, \
+  .depot = (void *)0, \
+}
+
+void *slab_cache_alloc(slab_cache_t *cache);
+void slab_cache_free(slab_cache_t *cache, void *obj);
+void *slab_obj_priv(slab_cache_t *cache, void *obj);
+void slab_cache_dump(slab_cache_t *cache, log_level_t level);
+
+#endif
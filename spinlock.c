@@ -4,12 +4,20 @@
 #include "pcpu.h"
 #include "spinlock.h"
 
+/*
+ * Spin locks may be nested.
+ * The interrupt mask is saved by the outermost lock
+ * and restored when the last lock is released.
+ */
 void spin_lock(int *locked){
   pcpu_t *cpu = get_current_phys_cpu();
+  uint64_t daif;
 
   /* Save interrupt enable */
-  READ_SYSREG(cpu->intr_state, DAIF);
+  READ_SYSREG(daif, DAIF);
   INTR_DISABLE;
+  if(cpu->lock_depth++ == 0)
+    cpu->intr_state = daif;
 
   asm volatile(
     "mov x1, %0\n"
@@ -33,5 +41,6 @@ void spin_unlock(int *locked){
 
     : : "r" ((phys_addr_t)locked)
   );
-  WRITE_SYSREG(DAIF, cpu->intr_state);
+  if(--cpu->lock_depth == 0)
+    WRITE_SYSREG(DAIF, cpu->intr_state);
 }
@@ -0,0 +1,226 @@
+/*
+ * runqueue_bench.c
+ * Host side microbenchmark of runqueue.h
+ *
+ * Build and run on the host with "make runqueue-bench && ./runqueue-bench".
+ * For 10 ~ 100 vcpus with random priorities, it measures
+ *  - enqueue : add every vcpu to the tail of its priority,
+ *  - pick    : take the vcpu of the highest priority until the queue is empty,
+ *              as fcfs_schedule() does,
+ *  - dequeue : remove every vcpu in random order, as vcpu_sleep() does,
+ * with runqueue.h and with the former singly linked lists
+ * which fcfs_schedule.c scanned and walked.
+ * It runs with the 16 priorities of fcfs_scheduler and
+ * with 1 priority as rr_scheduler.
+ * The cost of clock_gettime() is measured and subtracted.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#undef NULL
+#include "runqueue.h"
+
+#define BENCH_MAX_PRIO    16  /* priorities of fcfs_scheduler */
+#define BENCH_MAX_VCPU    100
+#define BENCH_OPS         2000000
+
+typedef struct _bench_vcpu_t {
+  int prio;
+  rq_node_t rq_node;
+  struct _bench_vcpu_t *next;   // for the former lists
+} bench_vcpu_t;
+
+static bench_vcpu_t vcpus[BENCH_MAX_VCPU];
+static int remove_order[BENCH_MAX_VCPU];
+static volatile uint64_t sink;
+static int prio_num;
+static uint64_t clock_ns;   // cost of a pair of now_nsec()
+
+/* The former runqueue of fcfs_schedule.c */
+static struct {
+  bench_vcpu_t *head;
+  bench_vcpu_t *tail;
+} list_rq[BENCH_MAX_PRIO];
+
+static void list_add(bench_vcpu_t *vcpu){
+  if(list_rq[vcpu->prio].head == NULL)
+    list_rq[vcpu->prio].head = vcpu;
+  else
+    list_rq[vcpu->prio].tail->next = vcpu;
+  list_rq[vcpu->prio].tail = vcpu;
+  vcpu->next = NULL;
+}
+
+static bench_vcpu_t *list_pop(void){
+  bench_vcpu_t *vcpu;
+  int i;
+
+  for(i=0; i<BENCH_MAX_PRIO; i++){
+    if(list_rq[i].head != NULL)
+      break;
+  }
+  if(i == BENCH_MAX_PRIO)
+    return NULL;
+
+  vcpu = list_rq[i].head;
+  list_rq[i].head = vcpu->next;
+  vcpu->next = NULL;
+  return vcpu;
+}
+
+static void list_remove(bench_vcpu_t *vcpu){
+  bench_vcpu_t *t_vcpu;
+
+  if(vcpu == list_rq[vcpu->prio].head){
+    list_rq[vcpu->prio].head = vcpu->next;
+    if(vcpu == list_rq[vcpu->prio].tail)
+      list_rq[vcpu->prio].tail = NULL;
+  }else{
+    for(t_vcpu = list_rq[vcpu->prio].head; t_vcpu->next != vcpu; t_vcpu = t_vcpu->next)
+      ;
+    t_vcpu->next = vcpu->next;
+    if(vcpu == list_rq[vcpu->prio].tail)
+      list_rq[vcpu->prio].tail = t_vcpu;
+  }
+  vcpu->next = NULL;
+}
+
+static uint64_t rand_state = 88172645463325252ULL;
+
+static uint32_t bench_rand(void){
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 7;
+  rand_state ^= rand_state << 17;
+  return (uint32_t)rand_state;
+}
+
+static uint64_t now_nsec(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_setup(int vcpu_num){
+  int i, j, t;
+
+  for(i=0; i<vcpu_num; i++){
+    vcpus[i].prio = bench_rand() % prio_num;
+    rq_node_init(&vcpus[i].rq_node);
+    remove_order[i] = i;
+  }
+  /* Fisher-Yates shuffle */
+  for(i=vcpu_num-1; i>0; i--){
+    j = bench_rand() % (i + 1);
+    t = remove_order[i];
+    remove_order[i] = remove_order[j];
+    remove_order[j] = t;
+  }
+}
+
+static void bench_runqueue(int vcpu_num, int rounds, uint64_t ns[3]){
+  runqueue_t rq;
+  uint64_t t;
+  int r, i;
+
+  runqueue_init(&rq);
+  for(r=0; r<rounds; r++){
+    t = now_nsec();
+    for(i=0; i<vcpu_num; i++)
+      runqueue_add(&rq, &vcpus[i].rq_node, vcpus[i].prio);
+    ns[0] += now_nsec() - t;
+
+    t = now_nsec();
+    for(i=0; i<vcpu_num; i++)
+      sink += RQ_NODE_ENTRY(runqueue_pop(&rq), bench_vcpu_t, rq_node)->prio;
+    ns[1] += now_nsec() - t;
+
+    for(i=0; i<vcpu_num; i++)
+      runqueue_add(&rq, &vcpus[i].rq_node, vcpus[i].prio);
+    t = now_nsec();
+    for(i=0; i<vcpu_num; i++)
+      runqueue_remove(&rq, &vcpus[remove_order[i]].rq_node);
+    ns[2] += now_nsec() - t;
+  }
+}
+
+static void bench_list(int vcpu_num, int rounds, uint64_t ns[3]){
+  uint64_t t;
+  int r, i;
+
+  for(i=0; i<BENCH_MAX_PRIO; i++){
+    list_rq[i].head = NULL;
+    list_rq[i].tail = NULL;
+  }
+  for(r=0; r<rounds; r++){
+    t = now_nsec();
+    for(i=0; i<vcpu_num; i++)
+      list_add(&vcpus[i]);
+    ns[0] += now_nsec() - t;
+
+    t = now_nsec();
+    for(i=0; i<vcpu_num; i++)
+      sink += list_pop()->prio;
+    ns[1] += now_nsec() - t;
+
+    for(i=0; i<vcpu_num; i++)
+      list_add(&vcpus[i]);
+    t = now_nsec();
+    for(i=0; i<vcpu_num; i++)
+      list_remove(&vcpus[remove_order[i]]);
+    ns[2] += now_nsec() - t;
+  }
+}
+
+static void bench_calibrate(void){
+  uint64_t t, sum = 0;
+  int i;
+
+  for(i=0; i<BENCH_OPS / 10; i++){
+    t = now_nsec();
+    sum += now_nsec() - t;
+  }
+  clock_ns = sum / (BENCH_OPS / 10);
+}
+
+static void bench_report(char *name, int vcpu_num, int rounds, uint64_t ns[3]){
+  uint64_t ops = (uint64_t)vcpu_num * rounds;
+  int i;
+
+  for(i=0; i<3; i++)
+    ns[i] = (ns[i] > clock_ns * rounds)? ns[i] - clock_ns * rounds : 0;
+
+  printf("%2d prio %4d vcpus %-9s : enqueue %3llu.%02llu ns, pick %3llu.%02llu ns, dequeue %3llu.%02llu ns\n",
+      prio_num, vcpu_num, name,
+      ns[0] / ops, ns[0] * 100 / ops % 100,
+      ns[1] / ops, ns[1] * 100 / ops % 100,
+      ns[2] / ops, ns[2] * 100 / ops % 100);
+}
+
+int main(void){
+  static const int vcpu_nums[] = {10, 25, 50, 100};
+  static const int prio_nums[] = {BENCH_MAX_PRIO, 1};
+  uint64_t ns[3];
+  int i, j, rounds;
+
+  bench_calibrate();
+  printf("runqueue_bench : ns per operation, clock_gettime() %llu ns\n", clock_ns);
+
+  for(j=0; j<sizeof(prio_nums)/sizeof(prio_nums[0]); j++){
+    prio_num = prio_nums[j];
+    for(i=0; i<sizeof(vcpu_nums)/sizeof(vcpu_nums[0]); i++){
+      rounds = BENCH_OPS / vcpu_nums[i];
+      bench_setup(vcpu_nums[i]);
+
+      ns[0] = ns[1] = ns[2] = 0;
+      bench_list(vcpu_nums[i], rounds, ns);
+      bench_report("list", vcpu_nums[i], rounds, ns);
+
+      ns[0] = ns[1] = ns[2] = 0;
+      bench_runqueue(vcpu_nums[i], rounds, ns);
+      bench_report("runqueue", vcpu_nums[i], rounds, ns);
+    }
+  }
+
+  return 0;
+}
@@ -21,4 +21,8 @@ typedef long double float128_t;
 
 typedef uint64_t  phys_addr_t;
 
+#define offsetof(type, member) __builtin_offsetof(type, member)
+
+#define CACHE_LINE_SIZE 64
+
 #endif
@@ -5,11 +5,17 @@
 #include "asm_func.h"
 #include "hyp_mmu.h"
 #include "pcpu.h"
+#include "spinlock.h"
+#include "schedule.h"
 #include "vm.h"
 #include "vcpu.h"
 #include "vtimer.h"
 #include "virt_mmio.h"
 #include "hyp_security.h"
+#include "vcpu_stat.h"
+#include "slab.h"
+#include "id_space.h"
+#include "smp_mbox.h"
 
 const char *vcpu_state_msg[]={
   "Initialized",
@@ -18,15 +24,64 @@ const char *vcpu_state_msg[]={
   "Sleeping"
 };
 
-static vcpu_t vcpus[VCPU_NUM];
-static uint32_t num_vcpu = 0;
+static slab_cache_t vcpu_cache = SLAB_CACHE_INIT("vcpu_t", sizeof(vcpu_t), 0);
+ID_SPACE_DEFINE(vcpu_ids, VCPU_MAX_NUM);
+static vcpu_t *vcpu_table[VCPU_MAX_NUM];
 
 static vcpu_t *vcpu_alloc(void){
-  if(num_vcpu >= VCPU_NUM)
-      hyp_panic("There is no vcpu_t block!");
+  vcpu_t *vcpu;
+  int id;
 
-  memset(&vcpus[num_vcpu], 0, sizeof(vcpu_t));
-  return &vcpus[num_vcpu++];
+  id = id_alloc(&vcpu_ids);
+  if(id < 0)
+      hyp_panic("There is no vcpu ID!");
+
+  /* slab_cache_alloc() zeroes the vcpu_t */
+  vcpu = slab_cache_alloc(&vcpu_cache);
+  vcpu->id = id;
+  vcpu_table[id] = vcpu;
+
+  return vcpu;
+}
+
+/* Whether a physical cpu still refers to vcpu */
+int vcpu_is_referenced(vcpu_t *vcpu){
+  pcpu_t *phys_cpu;
+  int i;
+
+  for(i=0; i<CPU_NUM; i++){
+    phys_cpu = &phys_cpus[i];
+    if(*(vcpu_t * volatile *)&phys_cpu->current_vcpu == vcpu
+        || *(vcpu_t * volatile *)&phys_cpu->last_vcpu == vcpu
+        || phys_cpu->fpu_owner == vcpu || phys_cpu->sysreg_owner == vcpu)
+      return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Free vcpu, its exit statistics and its ID.
+ * vcpu must be off, vcpu_is_referenced() must be false
+ * and vtimer_release() must have returned 0.
+ */
+void vcpu_free(vcpu_t *vcpu){
+  if(vcpu->state != VCPU_STATE_INIT || vcpu_is_referenced(vcpu))
+    hyp_panic("You cannot free a vcpu in use. vm:%s, vcpu id:%d\n",
+        vcpu->vm->name, vcpu->vcpu_id);
+
+  vcpu_stat_release(vcpu);
+  vcpu_table[vcpu->id] = 0;
+  id_free(&vcpu_ids, vcpu->id);
+  slab_cache_free(&vcpu_cache, vcpu);
+}
+
+/* Return the vcpu of the ID, or NULL */
+vcpu_t *vcpu_get_by_id(int id){
+  if(id < 0 || id >= VCPU_MAX_NUM || vcpu_table[id] == 0)
+    return NULL;
+
+  return vcpu_table[id];
 }
 
 vcpu_t *vcpu_create(vm_t *vm, uint32_t vcpu_id, phys_addr_t vttbr, char *hyp_msg, phys_addr_t entry_addr){
@@ -34,7 +89,7 @@ vcpu_t *vcpu_create(vm_t *vm, uint32_t vcpu_id, phys_addr_t vttbr, char *hyp_msg
   
   vcpu->vm = vm;
   vcpu->vcpu_id = vcpu_id;
-  vcpu->next = NULL;  
+  rq_node_init(&vcpu->rq_node);
   vcpu->state = VCPU_STATE_INIT;
   vcpu->vttbr = vttbr;
   vcpu->hyp_msg = hyp_msg;
@@ -43,22 +98,23 @@ vcpu_t *vcpu_create(vm_t *vm, uint32_t vcpu_id, phys_addr_t vttbr, char *hyp_msg
   vcpu->reg.x[0] = 0x800000;
   vcpu->sysreg.pc   = entry_addr;
   vcpu->sysreg.cpsr = CPSR_M_EL1h;
-  vcpu->sysreg.sp_el0 = 0;
-  vcpu->sysreg.sp_el1 = 0;
-  vcpu->sysreg.vbar_el1 = 0;
-  vcpu->sysreg.esr_el1  = 0;
-  vcpu->sysreg.elr_el1  = 0;
-  vcpu->sysreg.far_el1  = 0;
-  vcpu->sysreg.spsr_el1 = 0;
-  vcpu->sysreg.sctlr_el1= 0x00C50838;
-  vcpu->sysreg.tcr_el1  = 0;
-  vcpu->sysreg.ttbr0_el1  = 0;
-  vcpu->sysreg.ttbr1_el1  = 0;
-  vcpu->sysreg.midr_el1 = 0x410FD032;
-  //vcpu->sysreg.mpidr_el1, vmpidr_el2);
-  READ_SYSREG(vcpu->sysreg.mpidr_el1, vmpidr_el2);
+  vcpu->cold_sysreg.sp_el0 = 0;
+  vcpu->cold_sysreg.sp_el1 = 0;
+  vcpu->cold_sysreg.vbar_el1 = 0;
+  vcpu->cold_sysreg.esr_el1  = 0;
+  vcpu->cold_sysreg.elr_el1  = 0;
+  vcpu->cold_sysreg.far_el1  = 0;
+  vcpu->cold_sysreg.spsr_el1 = 0;
+  vcpu->cold_sysreg.sctlr_el1= 0x00C50838;
+  vcpu->cold_sysreg.tcr_el1  = 0;
+  vcpu->cold_sysreg.ttbr0_el1  = 0;
+  vcpu->cold_sysreg.ttbr1_el1  = 0;
+  vcpu->cold_sysreg.midr_el1 = 0x410FD032;
+  //vcpu->cold_sysreg.mpidr_el1, vmpidr_el2);
+  READ_SYSREG(vcpu->cold_sysreg.mpidr_el1, vmpidr_el2);
 
   hyp_security_vcpu_init(vcpu);
+  vcpu_stat_init(vcpu);
 
   log_info("&vcpu : %#8x, &vcpu.reg : %#8x\n", vcpu, &vcpu->reg);
   return vcpu;
@@ -67,6 +123,7 @@ vcpu_t *vcpu_create(vm_t *vm, uint32_t vcpu_id, phys_addr_t vttbr, char *hyp_msg
 void vcpu_reset(vcpu_t *vcpu){
   memset(&vcpu->reg, 0, sizeof(vcpu_reg_t));
   memset(&vcpu->sysreg, 0, sizeof(vcpu_sysreg_t));
+  memset(&vcpu->cold_sysreg, 0, sizeof(vcpu_cold_sysreg_t));
   
   vcpu_save_all_sysregs(vcpu);
   
@@ -74,21 +131,69 @@ void vcpu_reset(vcpu_t *vcpu){
   vcpu->sysreg.cpsr = CPSR_M_EL1h;
 }
 
-void vcpu_ready(vcpu_t *vcpu){
+/* Called with the runqueue lock of vcpu->vm->scheduler */
+static void vcpu_ready_locked(vcpu_t *vcpu){
+  scheduler_t *scheduler = vcpu->vm->scheduler;
 
   if(vcpu->state == VCPU_STATE_READY)
     hyp_panic("You cannot make ready a VCPU which is already ready."
         " vm:%s, vcpu id:%d\n",
         vcpu->vm->name, vcpu->vcpu_id);
 
-  if(vcpu->state == VCPU_STATE_RUN)
+  if(vcpu->state == VCPU_STATE_RUN){
+    vcpu_fpu_release(vcpu);
+    vcpu_sysreg_release(vcpu);
     vcpu->phys_cpu->current_vcpu = NULL;
+  }
 
+  vcpu->sched.woken = (vcpu->state == VCPU_STATE_SLEEP);
   vcpu->state = VCPU_STATE_READY;
   
-  vcpu->vm->scheduler->scheduler_add(vcpu);
+  scheduler->scheduler_add(vcpu);
+  scheduler->ready_vcpu_num++;
+}
+
+/*
+ * Wake up a sleeping vcpu.
+ * May be called on any cpu, takes the runqueue lock of vcpu's scheduler.
+ * The callers test the state without the lock, so another cpu may
+ * have woken the vcpu already; then this does nothing.
+ */
+void vcpu_ready(vcpu_t *vcpu){
+  scheduler_t *scheduler = vcpu->vm->scheduler;
+
+  spin_lock(&scheduler->lock);
+  if(vcpu->state == VCPU_STATE_SLEEP)
+    vcpu_ready_locked(vcpu);
+  spin_unlock(&scheduler->lock);
+}
+
+/* Make a new vcpu ready for the first time */
+void vcpu_boot(vcpu_t *vcpu){
+  scheduler_t *scheduler = vcpu->vm->scheduler;
+
+  if(vcpu->state != VCPU_STATE_INIT)
+    hyp_panic("You cannot boot a VCPU which has already booted. vm:%s, vcpu id:%d\n",
+        vcpu->vm->name, vcpu->vcpu_id);
+
+  spin_lock(&scheduler->lock);
+  vcpu_ready_locked(vcpu);
+  spin_unlock(&scheduler->lock);
+}
+
+/*
+ * Put the running vcpu of this cpu back to the runqueue.
+ * Called with the runqueue lock, e.g. by scheduler_t.schedule().
+ */
+void vcpu_preempt(vcpu_t *vcpu){
+  if(vcpu->state != VCPU_STATE_RUN)
+    hyp_panic("You cannot preempt a VCPU which is not running. vm:%s, vcpu id:%d\n",
+        vcpu->vm->name, vcpu->vcpu_id);
+
+  vcpu_ready_locked(vcpu);
 }
 
+/* Called by do_schedule() with the runqueue lock of phys_cpu->scheduler */
 void vcpu_active(vcpu_t *vcpu, pcpu_t *phys_cpu){
 
   if(phys_cpu->current_vcpu != NULL
@@ -106,6 +211,8 @@ void vcpu_active(vcpu_t *vcpu, pcpu_t *phys_cpu){
   vcpu->phys_cpu = phys_cpu;
   phys_cpu->current_vcpu = vcpu;
 
+  if(vcpu->state == VCPU_STATE_READY)
+    vcpu->vm->scheduler->ready_vcpu_num--;
   vcpu->state = VCPU_STATE_RUN;
   
   log_info("Active vm:%s vcpu_id:%d\n", vcpu->vm->name, vcpu->vcpu_id);
@@ -114,14 +221,27 @@ void vcpu_active(vcpu_t *vcpu, pcpu_t *phys_cpu){
 void vcpu_off(vcpu_t *vcpu){
     if(vcpu->phys_cpu->current_vcpu == vcpu){
         vcpu->phys_cpu->current_vcpu = NULL;
+        /* The scheduler drops its reference to vcpu */
+        vcpu->phys_cpu->schedule_is_needed = 1;
+        if(vcpu->phys_cpu != get_current_phys_cpu())
+          smp_send_mailbox(vcpu->phys_cpu->cpu_id, MAIL_TYPE_SCHEDULE);
     }
+    /* The FP/SIMD registers of this vcpu are discarded */
+    if(vcpu->phys_cpu->fpu_owner == vcpu)
+      vcpu->phys_cpu->fpu_owner = NULL;
+    if(vcpu->phys_cpu->sysreg_owner == vcpu)
+      vcpu->phys_cpu->sysreg_owner = NULL;
+
+    spin_lock(&vcpu->vm->scheduler->lock);
     if(vcpu->state == VCPU_STATE_READY){
       /* Remove vcpu from ready queue */
       vcpu->vm->scheduler->scheduler_remove(vcpu);
+      vcpu->vm->scheduler->ready_vcpu_num--;
       
     }
     
     vcpu->state = VCPU_STATE_INIT;
+    spin_unlock(&vcpu->vm->scheduler->lock);
 }
 
 void vcpu_sleep(vcpu_t *vcpu){
@@ -129,6 +249,7 @@ void vcpu_sleep(vcpu_t *vcpu){
   if(vcpu->state != VCPU_STATE_RUN){
     hyp_panic("This VCPU is not running.So you cannot sleep the VCPU; vm:%s vcpu_id:%d\n",
           vcpu->vm->name, vcpu->vcpu_id);
+  }
   if(vcpu->state == VCPU_STATE_READY){
     hyp_panic("You cannot sleep a VCPU which is already sleeping; vm:%s vcpu_id:%d\n",
         vcpu->vm->name, vcpu->vcpu_id);
@@ -136,15 +257,24 @@ void vcpu_sleep(vcpu_t *vcpu){
   }
   
   log_info("Sleep vm:%s vcpu_id:%d\n", vcpu->vm->name, vcpu->vcpu_id);
+
+  /* Serialize with vcpu_ready() on another cpu */
+  spin_lock(&vcpu->vm->scheduler->lock);
   if(vcpu->state == VCPU_STATE_RUN){
+    vcpu_fpu_release(vcpu);
   emulate_vtimer(vcpu);
+    vcpu_sysreg_release(vcpu);
     vcpu->phys_cpu->schedule_is_needed = 1;
-  }else if(vcpu->state == VCPU_STATE_READY)
-  vcpu->vm->scheduler->scheduler_remove(vcpu);
+  }else if(vcpu->state == VCPU_STATE_READY){
+    vcpu->vm->scheduler->scheduler_remove(vcpu);
+    vcpu->vm->scheduler->ready_vcpu_num--;
+  }
     
   if(vcpu->phys_cpu->current_vcpu == vcpu)
     vcpu->phys_cpu->current_vcpu = NULL;
   vcpu->state = VCPU_STATE_SLEEP;
+
+  spin_unlock(&vcpu->vm->scheduler->lock);
 }
 
 /*
@@ -218,6 +348,58 @@ void vcpu_do_virq(vcpu_t *vcpu){
    */
 }
 
+/* ESR_ELx fields of an abort injected by vcpu_do_sync_abort() */
+#define ESR_EC_SHIFT  26
+#define ESR_IL        (1 << 25)   // 32bit instruction
+#define ISS_FSC_SYNC_EXT_ABORT  0x10
+
+/*
+ * Inject a synchronous external abort of the access to the guest virtual
+ * address far into vcpu, which exited on this cpu by the access.
+ * The guest takes it at VBAR_EL1 as if the memory system had failed,
+ * e.g. when there is no host memory for on demand memory.
+ * is_inst selects an instruction abort, otherwise a data abort.
+ */
+void vcpu_do_sync_abort(vcpu_t *vcpu, int is_inst, uint64_t far){
+  uint64_t vbar_el1;
+  uint64_t offset;
+  uint64_t ec;
+
+  if(!vcpu_cold_sysreg_is_live(vcpu))
+    hyp_panic("You cannot inject an abort into a vcpu which does not run on this cpu."
+        " vm:%s, vcpu id:%d\n",
+        vcpu->vm->name, vcpu->vcpu_id);
+
+  /* Vector offset : current EL with SP_EL0, current EL with SP_ELx or lower EL */
+  switch(vcpu->sysreg.cpsr & CPSR_M_MASK){
+    case CPSR_M_EL1t:
+      offset = 0x000;
+      ec = is_inst? EC_INST_ABORT_CUR_EL : EC_DATA_ABORT_CUR_EL;
+      break;
+    case CPSR_M_EL1h:
+      offset = 0x200;
+      ec = is_inst? EC_INST_ABORT_CUR_EL : EC_DATA_ABORT_CUR_EL;
+      break;
+    default:
+      offset = 0x400;
+      ec = is_inst? EC_INST_ABORT_LOWER_EL : EC_DATA_ABORT_LOWER_EL;
+      break;
+  }
+
+  READ_SYSREG(vbar_el1, VBAR_EL1);
+  WRITE_SYSREG(ESR_EL1, (ec << ESR_EC_SHIFT) | ESR_IL | ISS_FSC_SYNC_EXT_ABORT);
+  WRITE_SYSREG(FAR_EL1, far);
+  WRITE_SYSREG(ELR_EL1, vcpu->sysreg.pc);
+  WRITE_SYSREG(SPSR_EL1, vcpu->sysreg.cpsr);
+
+  vcpu->sysreg.pc = vbar_el1 + offset;
+  vcpu->sysreg.cpsr = CPSR_M_EL1h | CPSR_A | CPSR_I | CPSR_F;
+  vcpu_restore_hot_sysregs(vcpu);
+
+  log_info("Inject %s abort into vm:%s vcpu_id:%d far:%#x\n",
+      is_inst? "an instruction" : "a data", vcpu->vm->name, vcpu->vcpu_id, far);
+}
+
 /* Set virtual fiq flag. */
 void vcpu_do_vfiq(vcpu_t *vcpu){
   vcpu->vic.vfiq_pending |= 1;
@@ -256,108 +438,263 @@ void set_vintr(vcpu_t *vcpu){
   WRITE_SYSREG(HCR_EL2, hcr_el2);
 }
 
-void vcpu_save_all_sysregs(vcpu_t *vcpu){
+/* 
+ * Lazy FP/SIMD register switching
+ *
+ * FP/SIMD registers are not saved on VM exit.
+ * phys_cpu->fpu_owner holds the vcpu whose q0~q31 are live on that cpu.
+ * Other vcpus run with CPTR_EL2.TFP set,
+ * so their first FP/SIMD access is trapped (EC 0x07) and switched in vcpu_fpu_switch().
+ * The hypervisor itself is built with -mgeneral-regs-only.
+ */
+static inline void fpu_trap_enable(void){
+  WRITE_SYSREG(CPTR_EL2, CPTR_EL2_RES1 | CPTR_TFP);
+  asm volatile("isb");
+}
+
+static inline void fpu_trap_disable(void){
+  WRITE_SYSREG(CPTR_EL2, CPTR_EL2_RES1);
+  asm volatile("isb");
+}
+
+/* Called by the trap of the first FP/SIMD access after vcpu switch */
+void vcpu_fpu_switch(vcpu_t *vcpu){
+  pcpu_t *phys_cpu = vcpu->phys_cpu;
 
+  fpu_trap_disable();
+
+  if(phys_cpu->fpu_owner == vcpu)
+    return;
+
+  if(phys_cpu->fpu_owner != NULL)
+    vcpu_freg_save(phys_cpu->fpu_owner);
+  vcpu_freg_restore(vcpu);
+
+  phys_cpu->fpu_owner = vcpu;
+}
+
+/*
+ * Write back FP/SIMD registers of a vcpu which leaves its physical cpu.
+ * If the scheduler can resume the vcpu on another physical cpu,
+ * its registers must be in vcpu->freg before it is put on the ready queue.
+ */
+void vcpu_fpu_release(vcpu_t *vcpu){
+  pcpu_t *phys_cpu = vcpu->phys_cpu;
+
+  if(phys_cpu == NULL || phys_cpu->fpu_owner != vcpu)
+    return;
+
+  if(vcpu->vm->scheduler->pcpu_num <= 1)
+    return;
+
+  /* q0~q31 of the vcpu can be saved only on the cpu which holds them */
+  if(phys_cpu != get_current_phys_cpu())
+    hyp_panic("You cannot release FP/SIMD registers of a vcpu on another cpu."
+        " vm:%s, vcpu id:%d\n",
+        vcpu->vm->name, vcpu->vcpu_id);
+
+  fpu_trap_disable();
+  vcpu_freg_save(vcpu);
+  phys_cpu->fpu_owner = NULL;
+  fpu_trap_enable();
+}
+
+/*
+ * Hot/cold system register switching
+ *
+ * Only ELR_EL2 and SPSR_EL2 (hot) are saved on every VM exit.
+ * EL1 and generic timer registers (cold) stay in the cpu 
+ * until another vcpu is switched in on the physical cpu.
+ * phys_cpu->sysreg_owner holds the vcpu whose cold registers are live.
+ */
+
+/* Whether cold system registers of the vcpu are live on this physical cpu */
+int vcpu_cold_sysreg_is_live(vcpu_t *vcpu){
+  return vcpu->phys_cpu != NULL
+      && vcpu->phys_cpu->sysreg_owner == vcpu
+      && vcpu->phys_cpu == get_current_phys_cpu();
+}
+
+/*
+ * Write back cold system registers of a vcpu which leaves its physical cpu.
+ * Like vcpu_fpu_release(), this is needed only if the vcpu may be resumed on another physical cpu.
+ */
+void vcpu_sysreg_release(vcpu_t *vcpu){
+  pcpu_t *phys_cpu = vcpu->phys_cpu;
+
+  if(phys_cpu == NULL || phys_cpu->sysreg_owner != vcpu)
+    return;
+
+  if(vcpu->vm->scheduler->pcpu_num <= 1)
+    return;
+
+  if(phys_cpu != get_current_phys_cpu())
+    hyp_panic("You cannot release system registers of a vcpu on another cpu."
+        " vm:%s, vcpu id:%d\n",
+        vcpu->vm->name, vcpu->vcpu_id);
+
+  vcpu_save_cold_sysregs(vcpu);
+  phys_cpu->sysreg_owner = NULL;
+}
+
+/*
+ * Write back the lazily switched registers of a vcpu on this physical cpu
+ * to vcpu_t, but keep them live on the cpu.
+ * Used to take a snapshot of the vcpu, see vm_checkpoint.c.
+ */
+void vcpu_context_sync(vcpu_t *vcpu){
+  pcpu_t *phys_cpu = vcpu->phys_cpu;
+  uint64_t cptr_el2;
+
+  if(phys_cpu == NULL || phys_cpu != get_current_phys_cpu())
+    return;
+
+  if(phys_cpu->sysreg_owner == vcpu)
+    vcpu_save_cold_sysregs(vcpu);
+
+  if(phys_cpu->fpu_owner == vcpu){
+    READ_SYSREG(cptr_el2, CPTR_EL2);
+    fpu_trap_disable();
+    vcpu_freg_save(vcpu);
+    WRITE_SYSREG(CPTR_EL2, cptr_el2);
+    asm volatile("isb");
+  }
+}
+
+void vcpu_save_hot_sysregs(vcpu_t *vcpu){
   READ_SYSREG(vcpu->sysreg.pc, elr_el2);
   READ_SYSREG(vcpu->sysreg.cpsr, spsr_el2);
-  READ_SYSREG(vcpu->sysreg.sp_el0, sp_el0);
-  READ_SYSREG(vcpu->sysreg.sp_el1, sp_el1);
-  READ_SYSREG(vcpu->sysreg.vbar_el1, vbar_el1);
-  READ_SYSREG(vcpu->sysreg.esr_el1, esr_el1);
-  READ_SYSREG(vcpu->sysreg.elr_el1, elr_el1);
-  READ_SYSREG(vcpu->sysreg.far_el1, far_el1);
-  READ_SYSREG(vcpu->sysreg.par_el1, par_el1);
-  READ_SYSREG(vcpu->sysreg.spsr_el1, spsr_el1);
-  READ_SYSREG(vcpu->sysreg.sctlr_el1, sctlr_el1);
-  READ_SYSREG(vcpu->sysreg.tcr_el1, tcr_el1);
-  READ_SYSREG(vcpu->sysreg.ttbr0_el1, ttbr0_el1);
-  READ_SYSREG(vcpu->sysreg.ttbr1_el1, ttbr1_el1);
-  READ_SYSREG(vcpu->sysreg.mair_el1, mair_el1);
-  READ_SYSREG(vcpu->sysreg.midr_el1, vpidr_el2);
-  READ_SYSREG(vcpu->sysreg.mpidr_el1, vmpidr_el2);
-  READ_SYSREG(vcpu->sysreg.cpacr_el1, cpacr_el1);
-
-  READ_SYSREG(vcpu->sysreg.contextidr_el1, contextidr_el1);
-  READ_SYSREG(vcpu->sysreg.tpidr_el0, tpidr_el0);
-  READ_SYSREG(vcpu->sysreg.tpidr_el1, tpidr_el1);
-  READ_SYSREG(vcpu->sysreg.tpidrro_el0, tpidrro_el0);
+}
+
+void vcpu_restore_hot_sysregs(vcpu_t *vcpu){
+  WRITE_SYSREG(elr_el2, vcpu->sysreg.pc);
+  WRITE_SYSREG(spsr_el2, vcpu->sysreg.cpsr);
+}
+
+void vcpu_save_cold_sysregs(vcpu_t *vcpu){
+
+  READ_SYSREG(vcpu->cold_sysreg.sp_el0, sp_el0);
+  READ_SYSREG(vcpu->cold_sysreg.sp_el1, sp_el1);
+  READ_SYSREG(vcpu->cold_sysreg.vbar_el1, vbar_el1);
+  READ_SYSREG(vcpu->cold_sysreg.esr_el1, esr_el1);
+  READ_SYSREG(vcpu->cold_sysreg.elr_el1, elr_el1);
+  READ_SYSREG(vcpu->cold_sysreg.far_el1, far_el1);
+  READ_SYSREG(vcpu->cold_sysreg.par_el1, par_el1);
+  READ_SYSREG(vcpu->cold_sysreg.spsr_el1, spsr_el1);
+  READ_SYSREG(vcpu->cold_sysreg.sctlr_el1, sctlr_el1);
+  READ_SYSREG(vcpu->cold_sysreg.tcr_el1, tcr_el1);
+  READ_SYSREG(vcpu->cold_sysreg.ttbr0_el1, ttbr0_el1);
+  READ_SYSREG(vcpu->cold_sysreg.ttbr1_el1, ttbr1_el1);
+  READ_SYSREG(vcpu->cold_sysreg.mair_el1, mair_el1);
+  READ_SYSREG(vcpu->cold_sysreg.midr_el1, vpidr_el2);
+  READ_SYSREG(vcpu->cold_sysreg.mpidr_el1, vmpidr_el2);
+  READ_SYSREG(vcpu->cold_sysreg.cpacr_el1, cpacr_el1);
+
+  READ_SYSREG(vcpu->cold_sysreg.contextidr_el1, contextidr_el1);
+  READ_SYSREG(vcpu->cold_sysreg.tpidr_el0, tpidr_el0);
+  READ_SYSREG(vcpu->cold_sysreg.tpidr_el1, tpidr_el1);
+  READ_SYSREG(vcpu->cold_sysreg.tpidrro_el0, tpidrro_el0);
 
 
   /* Generic Timer */
   asm volatile("isb");
-  READ_SYSREG(vcpu->sysreg.cntv_ctl_el0, CNTV_CTL_EL0);
-  READ_SYSREG(vcpu->sysreg.cntv_cval_el0, CNTV_CVAL_EL0);
-  READ_SYSREG(vcpu->sysreg.cntvoff_el2, CNTVOFF_EL2);
+  READ_SYSREG(vcpu->cold_sysreg.cntv_ctl_el0, CNTV_CTL_EL0);
+  READ_SYSREG(vcpu->cold_sysreg.cntv_cval_el0, CNTV_CVAL_EL0);
+  READ_SYSREG(vcpu->cold_sysreg.cntvoff_el2, CNTVOFF_EL2);
 
-  READ_SYSREG(vcpu->sysreg.cntkctl_el1, CNTKCTL_EL1);
-  READ_SYSREG(vcpu->sysreg.cntp_ctl_el0, CNTP_CTL_EL0);
-  READ_SYSREG(vcpu->sysreg.cntp_cval_el0, CNTP_CVAL_EL0);
+  READ_SYSREG(vcpu->cold_sysreg.cntkctl_el1, CNTKCTL_EL1);
+  READ_SYSREG(vcpu->cold_sysreg.cntp_ctl_el0, CNTP_CTL_EL0);
+  READ_SYSREG(vcpu->cold_sysreg.cntp_cval_el0, CNTP_CVAL_EL0);
 }
 
-void vcpu_restore_all_sysregs(vcpu_t *vcpu){
-
-  WRITE_SYSREG(elr_el2, vcpu->sysreg.pc);
-  WRITE_SYSREG(spsr_el2, vcpu->sysreg.cpsr);
-  WRITE_SYSREG(sp_el0, vcpu->sysreg.sp_el0);
-  WRITE_SYSREG(sp_el1, vcpu->sysreg.sp_el1);
-  WRITE_SYSREG(vbar_el1, vcpu->sysreg.vbar_el1);
-  WRITE_SYSREG(esr_el1, vcpu->sysreg.esr_el1);
-  WRITE_SYSREG(elr_el1, vcpu->sysreg.elr_el1);
-  WRITE_SYSREG(far_el1, vcpu->sysreg.far_el1);
-  WRITE_SYSREG(par_el1, vcpu->sysreg.par_el1);
-  WRITE_SYSREG(spsr_el1, vcpu->sysreg.spsr_el1);
-  WRITE_SYSREG(sctlr_el1, vcpu->sysreg.sctlr_el1);
-  WRITE_SYSREG(tcr_el1, vcpu->sysreg.tcr_el1);
-  WRITE_SYSREG(ttbr0_el1, vcpu->sysreg.ttbr0_el1);
-  WRITE_SYSREG(ttbr1_el1, vcpu->sysreg.ttbr1_el1);
-  WRITE_SYSREG(mair_el1, vcpu->sysreg.mair_el1);
-  WRITE_SYSREG(vpidr_el2, vcpu->sysreg.midr_el1);
-  WRITE_SYSREG(vmpidr_el2, vcpu->sysreg.mpidr_el1);
-  WRITE_SYSREG(cpacr_el1, vcpu->sysreg.cpacr_el1);
-
-  WRITE_SYSREG(contextidr_el1, vcpu->sysreg.contextidr_el1);  
-  WRITE_SYSREG(tpidr_el0, vcpu->sysreg.tpidr_el0);
-  WRITE_SYSREG(tpidr_el1, vcpu->sysreg.tpidr_el1);
-  WRITE_SYSREG(tpidrro_el0, vcpu->sysreg.tpidrro_el0);
+void vcpu_restore_cold_sysregs(vcpu_t *vcpu){
+
+  WRITE_SYSREG(sp_el0, vcpu->cold_sysreg.sp_el0);
+  WRITE_SYSREG(sp_el1, vcpu->cold_sysreg.sp_el1);
+  WRITE_SYSREG(vbar_el1, vcpu->cold_sysreg.vbar_el1);
+  WRITE_SYSREG(esr_el1, vcpu->cold_sysreg.esr_el1);
+  WRITE_SYSREG(elr_el1, vcpu->cold_sysreg.elr_el1);
+  WRITE_SYSREG(far_el1, vcpu->cold_sysreg.far_el1);
+  WRITE_SYSREG(par_el1, vcpu->cold_sysreg.par_el1);
+  WRITE_SYSREG(spsr_el1, vcpu->cold_sysreg.spsr_el1);
+  WRITE_SYSREG(sctlr_el1, vcpu->cold_sysreg.sctlr_el1);
+  WRITE_SYSREG(tcr_el1, vcpu->cold_sysreg.tcr_el1);
+  WRITE_SYSREG(ttbr0_el1, vcpu->cold_sysreg.ttbr0_el1);
+  WRITE_SYSREG(ttbr1_el1, vcpu->cold_sysreg.ttbr1_el1);
+  WRITE_SYSREG(mair_el1, vcpu->cold_sysreg.mair_el1);
+  WRITE_SYSREG(vpidr_el2, vcpu->cold_sysreg.midr_el1);
+  WRITE_SYSREG(vmpidr_el2, vcpu->cold_sysreg.mpidr_el1);
+  WRITE_SYSREG(cpacr_el1, vcpu->cold_sysreg.cpacr_el1);
+
+  WRITE_SYSREG(contextidr_el1, vcpu->cold_sysreg.contextidr_el1);  
+  WRITE_SYSREG(tpidr_el0, vcpu->cold_sysreg.tpidr_el0);
+  WRITE_SYSREG(tpidr_el1, vcpu->cold_sysreg.tpidr_el1);
+  WRITE_SYSREG(tpidrro_el0, vcpu->cold_sysreg.tpidrro_el0);
 
   /* Generic Timer */
-  WRITE_SYSREG(CNTV_CTL_EL0, vcpu->sysreg.cntv_ctl_el0);
-  WRITE_SYSREG(CNTV_CVAL_EL0, vcpu->sysreg.cntv_cval_el0);
-  WRITE_SYSREG(CNTVOFF_EL2, vcpu->sysreg.cntvoff_el2);
+  WRITE_SYSREG(CNTV_CTL_EL0, vcpu->cold_sysreg.cntv_ctl_el0);
+  WRITE_SYSREG(CNTV_CVAL_EL0, vcpu->cold_sysreg.cntv_cval_el0);
+  WRITE_SYSREG(CNTVOFF_EL2, vcpu->cold_sysreg.cntvoff_el2);
 
-  WRITE_SYSREG(CNTKCTL_EL1, vcpu->sysreg.cntkctl_el1);
-  WRITE_SYSREG(CNTP_CTL_EL0, vcpu->sysreg.cntp_ctl_el0);
-  WRITE_SYSREG(CNTP_CVAL_EL0, vcpu->sysreg.cntp_cval_el0);
+  WRITE_SYSREG(CNTKCTL_EL1, vcpu->cold_sysreg.cntkctl_el1);
+  WRITE_SYSREG(CNTP_CTL_EL0, vcpu->cold_sysreg.cntp_ctl_el0);
+  WRITE_SYSREG(CNTP_CVAL_EL0, vcpu->cold_sysreg.cntp_cval_el0);
   
   asm volatile("isb");
 }
 
+void vcpu_save_all_sysregs(vcpu_t *vcpu){
+  vcpu_save_hot_sysregs(vcpu);
+  vcpu_save_cold_sysregs(vcpu);
+}
+
+void vcpu_restore_all_sysregs(vcpu_t *vcpu){
+  vcpu_restore_hot_sysregs(vcpu);
+  vcpu_restore_cold_sysregs(vcpu);
+}
+
 void vcpu_context_save(vcpu_t *vcpu, vcpu_reg_t *vcpu_reg){
-  vcpu_freg_save(vcpu);
   vcpu_save_all_sysregs(vcpu);
   vtimer_context_save(vcpu);
   memcpy(&vcpu->reg, vcpu_reg, sizeof(vcpu_reg_t));
 }
 
 void vcpu_context_switch(vcpu_t *vcpu){
+  pcpu_t *phys_cpu;
+
  if(vcpu == NULL)
     hyp_panic("You cannnot context switch to NULL vcpu.\n");
 
+  phys_cpu = vcpu->phys_cpu;
+
   /*
    * If current vcpu != last vcpu,
-   * we need to switch registers for fpu, system registers and virt mmio registers,  too. 
+   * we need to switch system registers and virt mmio registers,  too. 
+   * FP/SIMD registers are switched lazily by the trap.
+   * Cold system registers are switched only if another vcpu owns them.
    */
     
-  if(vcpu->phys_cpu->last_vcpu != vcpu){
+  if(phys_cpu->last_vcpu != vcpu){
     log_info("Dynamic vcpu context switch\n");
-    set_vttbr(vcpu->vttbr);
-    vcpu_freg_restore(vcpu);
+    set_vttbr(vcpu->vttbr, vmid_update(&vcpu->vm->vmid));
+    if(phys_cpu->fpu_owner == vcpu)
+      fpu_trap_disable();
+    else
+      fpu_trap_enable();
     vtimer_context_restore(vcpu);
     virt_mmio_reg_context_save(vcpu);
-    vcpu_restore_all_sysregs(vcpu);
+    vcpu_restore_hot_sysregs(vcpu);
+  }
+
+  if(phys_cpu->sysreg_owner != vcpu){
+    if(phys_cpu->sysreg_owner != NULL)
+      vcpu_save_cold_sysregs(phys_cpu->sysreg_owner);
+    vcpu_restore_cold_sysregs(vcpu);
+    phys_cpu->sysreg_owner = vcpu;
   }
 
   set_vintr(vcpu);
+  vcpu_stat_dispatch(phys_cpu);
   dispatch(vcpu);
 }
 
@@ -374,20 +711,20 @@ void vcpu_context_dump(vcpu_t *vcpu, log_level_t level){
     log_printf(level, "$X%d : %#8x", i, vcpu->reg.x[i]);
   /*
   for(i=0; i<32; i++)
-    log_printf(level, "vcpu->reg.q[%d] : %#8x", i, vcpu->reg.q[0]);
+    log_printf(level, "vcpu->freg.q[%d] : %#8x", i, vcpu->freg.q[0]);
   */
 
   log_printf(level, "PC   : %#8x", i, vcpu->sysreg.pc);
   log_printf(level, "CPSR : %#8x", i, vcpu->sysreg.cpsr);
-  log_printf(level, "SP_EL0   : %#8x", i, vcpu->sysreg.sp_el0);
-  log_printf(level, "SP_EL1   : %#8x", i, vcpu->sysreg.sp_el1);
-  log_printf(level, "VBAR_EL1 : %#8x", i, vcpu->sysreg.vbar_el1);
-  log_printf(level, "SPSR_EL1 : %#8x", i, vcpu->sysreg.spsr_el1);
-  log_printf(level, "ELR_EL1  : %#8x", i, vcpu->sysreg.elr_el1);
-  log_printf(level, "ESR_EL1 : %#8x", i, vcpu->sysreg.esr_el1);
-  log_printf(level, "FAR_EL1  : %#8x", i, vcpu->sysreg.far_el1);
-  log_printf(level, "PAR_EL1  : %#8x", i, vcpu->sysreg.par_el1);
-  log_printf(level, "SCTLR_EL1  : %#8x", i, vcpu->sysreg.sctlr_el1);
+  log_printf(level, "SP_EL0   : %#8x", i, VCPU_COLD_SYSREG_READ(vcpu, sp_el0, sp_el0));
+  log_printf(level, "SP_EL1   : %#8x", i, VCPU_COLD_SYSREG_READ(vcpu, sp_el1, sp_el1));
+  log_printf(level, "VBAR_EL1 : %#8x", i, VCPU_COLD_SYSREG_READ(vcpu, vbar_el1, vbar_el1));
+  log_printf(level, "SPSR_EL1 : %#8x", i, VCPU_COLD_SYSREG_READ(vcpu, spsr_el1, spsr_el1));
+  log_printf(level, "ELR_EL1  : %#8x", i, VCPU_COLD_SYSREG_READ(vcpu, elr_el1, elr_el1));
+  log_printf(level, "ESR_EL1 : %#8x", i, VCPU_COLD_SYSREG_READ(vcpu, esr_el1, esr_el1));
+  log_printf(level, "FAR_EL1  : %#8x", i, VCPU_COLD_SYSREG_READ(vcpu, far_el1, far_el1));
+  log_printf(level, "PAR_EL1  : %#8x", i, VCPU_COLD_SYSREG_READ(vcpu, par_el1, par_el1));
+  log_printf(level, "SCTLR_EL1  : %#8x", i, VCPU_COLD_SYSREG_READ(vcpu, sctlr_el1, sctlr_el1));
 
   log_printf(level, "=================   End   =================\n");
 }
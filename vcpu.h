@@ -7,8 +7,9 @@ typedef struct _vcpu_t vcpu_t;
 #include "pcpu.h"
 #include "vm.h"
 #include "hyp_security.h"
+#include "runqueue.h"
 
-#define VCPU_NUM 10
+#define VCPU_MAX_NUM 256  /* Number of vcpu IDs, see vcpu_alloc() */
 
 typedef enum {
     VCPU_STATE_INIT = 0,
@@ -19,18 +20,35 @@ typedef enum {
 
 typedef struct _vcpu_reg_t {
   uint64_t x[32];/* $x0 ~ $x30 */
-  float128_t q[32];
 } vcpu_reg_t;
 
+/* FP/SIMD registers, switched lazily (see vcpu_fpu_switch()) */
+typedef struct _vcpu_freg_t {
+  float128_t q[32];
+} vcpu_freg_t;
+
 /*
  * TODO:
  *    - Add floating point control registers 
  *        to vcpu context  
  */
 
+/*
+ * Hot system registers
+ * These are saved on every VM exit, because exception handlers read them.
+ */
 typedef struct _vcpu_sysreg_t {
   uint64_t pc;    // elr_el2
   uint64_t cpsr;  // spsr_el2
+} vcpu_sysreg_t;
+
+/*
+ * Cold system registers
+ * EL1 and generic timer registers are saved only 
+ * when another vcpu is switched in on the physical cpu.
+ * Use VCPU_COLD_SYSREG_READ() to read them in exception handlers.
+ */
+typedef struct _vcpu_cold_sysreg_t {
   uint64_t sp_el0;
   uint64_t sp_el1;
   uint64_t vbar_el1;
@@ -62,17 +80,28 @@ typedef struct _vcpu_sysreg_t {
   uint32_t cntp_ctl_el0;
 	uint64_t cntp_cval_el0;
 	
-} vcpu_sysreg_t;
+} vcpu_cold_sysreg_t;
+
+/*
+ * vcpu_t is split into cache line aligned hot and cold regions.
+ * The hot region holds what the VM exit path touches on every exit.
+ * Its offsets are exported to assembly by asm_offsets.c,
+ * so fields can be reordered freely.
+ */
+/* Per-vcpu data of the schedulers */
+typedef struct _vcpu_sched_t {
+  int woken;        // the last vcpu_ready() woke it from VCPU_STATE_SLEEP
+  int prio;         // CREDIT_PRIO_* in credit_scheduler
+  int64_t credit;   // counter ticks left to run, the credit or the CBS budget
+  /* CBS server of edf_scheduler in counter ticks, see edf_schedule.c */
+  uint64_t budget;
+  uint64_t period;
+  uint64_t deadline;  // CNTPCT_EL0
+} vcpu_sched_t;
 
 typedef struct _vcpu_t{
-  vm_t *vm;
-  struct _vcpu_t *next;// next ready vcpu   
-  uint32_t vcpu_id; // virtial cpu core id
-  pcpu_t *phys_cpu;  // physical cpu
-  vcpu_state_t state;
-  uint64_t vttbr;
-  char *hyp_msg;
-  vcpu_reg_t reg;
+  /* Hot region */
+  vcpu_reg_t reg;       // saved by the exception vector
   vcpu_sysreg_t sysreg;
   hyp_security_t security;
   struct{
@@ -83,17 +112,47 @@ typedef struct _vcpu_t{
     uint32_t core_mbox_intr_enable;
     uint32_t core_mbox[4];
   }vic;
-} vcpu_t;
+  pcpu_t *phys_cpu;  // physical cpu
+  vm_t *vm;
+  vcpu_state_t state;
+  uint64_t exit_cycle;  // PMCCNTR_EL0 at the vector entry
+  struct _vcpu_stat_t *stat;
+
+  /* Cold region */
+  vcpu_freg_t freg __attribute__((aligned(CACHE_LINE_SIZE)));
+  vcpu_cold_sysreg_t cold_sysreg;
+  rq_node_t rq_node;  // node in the runqueue of vm->scheduler
+  vcpu_sched_t sched;
+  uint32_t vcpu_id; // virtial cpu core id
+  int id;           // ID in the hypervisor, see vcpu_get_by_id()
+  uint64_t vttbr;
+  char *hyp_msg;
+} __attribute__((aligned(CACHE_LINE_SIZE))) vcpu_t;
 
 vcpu_t *vcpu_create(vm_t *vm, uint32_t vcpu_id,
                 phys_addr_t vttbr, char *hyp_msg, phys_addr_t entry_addr);
+vcpu_t *vcpu_get_by_id(int id);
+int  vcpu_is_referenced(vcpu_t *vcpu);
+void vcpu_free(vcpu_t *vcpu);
 void vcpu_ready(vcpu_t *vcpu);
+void vcpu_boot(vcpu_t *vcpu);
 void vcpu_active(vcpu_t *vcpu, pcpu_t *phys_cpu);
+void vcpu_preempt(vcpu_t *vcpu);
 void vcpu_sleep(vcpu_t *vcpu);
 void vcpu_off(vcpu_t *vcpu);
 void vcpu_do_vserror(vcpu_t *vcpu);
+void vcpu_do_sync_abort(vcpu_t *vcpu, int is_inst, uint64_t far);
 void vcpu_do_virq(vcpu_t *vcpu);
 void vcpu_do_vfiq(vcpu_t *vcpu);
+void vcpu_fpu_switch(vcpu_t *vcpu);
+void vcpu_fpu_release(vcpu_t *vcpu);
+int  vcpu_cold_sysreg_is_live(vcpu_t *vcpu);
+void vcpu_sysreg_release(vcpu_t *vcpu);
+void vcpu_context_sync(vcpu_t *vcpu);
+void vcpu_save_hot_sysregs(vcpu_t *vcpu);
+void vcpu_restore_hot_sysregs(vcpu_t *vcpu);
+void vcpu_save_cold_sysregs(vcpu_t *vcpu);
+void vcpu_restore_cold_sysregs(vcpu_t *vcpu);
 void vcpu_save_all_sysregs(vcpu_t *vcpu);
 void vcpu_restore_all_sysregs(vcpu_t *vcpu);
 void vcpu_context_save(vcpu_t *vcpu, vcpu_reg_t *vcpu_reg);
@@ -102,6 +161,20 @@ vcpu_t *set_cur_vcpu(uint64_t cpu_id, vcpu_t *vcpu);
 vcpu_t *get_cur_vcpu(uint64_t cpu_id);
 
 #include "coproc_def.h"
+
+/* 
+ * Read a cold system register of the vcpu.
+ * e.g. VCPU_COLD_SYSREG_READ(vcpu, cntv_ctl_el0, CNTV_CTL_EL0)
+ */
+#define VCPU_COLD_SYSREG_READ(vcpu, field, sys_reg) ({ \
+  uint64_t __val; \
+  if(vcpu_cold_sysreg_is_live(vcpu)) \
+    READ_SYSREG(__val, sys_reg); \
+  else \
+    __val = (vcpu)->cold_sysreg.field; \
+  __val; \
+})
+
 static inline int vcpu_currentel_get(vcpu_t *vcpu){
   return (vcpu->sysreg.cpsr&CPSR_M_EL1t)? 1:0;
 }
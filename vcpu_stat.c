@@ -0,0 +1,166 @@
+/*
+ * vcpu_stat.c
+ * Per-vcpu VM exit statistics
+ *
+ * Each VM exit is counted by its reason (ESR_EL2.EC, IRQ or other)
+ * and hypervisor call number, together with a log2 histogram of
+ * PMU cycles spent in EL2 from the vector entry to dispatch.
+ * The cycle counter value at the vector entry is stored in vcpu->exit_cycle.
+ * Exits handled in the fast exit path are accounted in fast_exit_resume
+ * by their EC only.
+ */
+
+#include "typedef.h"
+#include "lib.h"
+#include "log.h"
+#include "asm_func.h"
+#include "pmu.h"
+#include "hyp_timer.h"
+#include "vcpu.h"
+#include "vm.h"
+#include "vcpu_stat.h"
+#include "slab.h"
+
+#if CONFIG_EXIT_STAT
+
+_Static_assert(sizeof(vcpu_stat_counter_t) == VCPU_STAT_COUNTER_SIZE,
+    "VCPU_STAT_COUNTER_SIZE does not match vcpu_stat_counter_t");
+_Static_assert(offsetof(vcpu_stat_counter_t, cycles) == VCPU_STAT_OFF_CYCLES,
+    "VCPU_STAT_OFF_CYCLES does not match vcpu_stat_counter_t");
+_Static_assert(offsetof(vcpu_stat_counter_t, hist) == VCPU_STAT_OFF_HIST,
+    "VCPU_STAT_OFF_HIST does not match vcpu_stat_counter_t");
+
+static slab_cache_t vcpu_stat_cache = SLAB_CACHE_INIT("vcpu_stat_t", sizeof(vcpu_stat_t), 0);
+
+void vcpu_stat_init(vcpu_t *vcpu){
+  vcpu->stat = slab_cache_alloc(&vcpu_stat_cache);
+
+  vcpu_stat_reset(vcpu);
+}
+
+void vcpu_stat_release(vcpu_t *vcpu){
+  slab_cache_free(&vcpu_stat_cache, vcpu->stat);
+  vcpu->stat = 0;
+}
+
+void vcpu_stat_reset(vcpu_t *vcpu){
+  memset(vcpu->stat, 0, sizeof(vcpu_stat_t));
+  vcpu->stat->pending_exit = -1;
+  vcpu->stat->pending_hvc = -1;
+}
+
+/* Called on VM exit which goes to C code */
+void vcpu_stat_exit(vcpu_t *vcpu, int exit){
+  vcpu->stat->pending_exit = exit;
+  vcpu->stat->pending_hvc = -1;
+}
+
+void vcpu_stat_hvc(vcpu_t *vcpu, uint64_t type){
+  if(type >= VCPU_STAT_HVC_NUM)
+    type = VCPU_STAT_HVC_NUM - 1;
+
+  vcpu->stat->pending_hvc = type;
+}
+
+static void vcpu_stat_counter_add(vcpu_stat_counter_t *counter, uint64_t cycles){
+  int n;
+
+  n = (cycles == 0)? 0 : 63 - __builtin_clzll(cycles);
+  if(n >= VCPU_STAT_HIST_NUM)
+    n = VCPU_STAT_HIST_NUM - 1;
+
+  counter->count++;
+  counter->cycles += cycles;
+  counter->hist[n]++;
+}
+
+/* Called just before dispatch, accounts the exit of phys_cpu->last_vcpu */
+void vcpu_stat_dispatch(pcpu_t *phys_cpu){
+  vcpu_t *vcpu = phys_cpu->last_vcpu;
+  vcpu_stat_t *stat;
+  uint64_t now;
+
+  if(vcpu == NULL)
+    return;
+
+  stat = vcpu->stat;
+  if(stat->pending_exit < 0)
+    return;
+
+  READ_SYSREG(now, pmccntr_el0);
+
+  /* Skip if the cycle counter was reset or stopped during this exit */
+  if(now > vcpu->exit_cycle){
+    vcpu_stat_counter_add(&stat->exit[stat->pending_exit], now - vcpu->exit_cycle);
+    if(stat->pending_hvc >= 0)
+      vcpu_stat_counter_add(&stat->hvc[stat->pending_hvc], now - vcpu->exit_cycle);
+  }
+
+  stat->pending_exit = -1;
+  stat->pending_hvc = -1;
+}
+
+static void vcpu_stat_counter_dump(vcpu_stat_counter_t *counter, log_level_t level){
+  int i;
+
+  log_printf(level, "    count : %d, cycles : %d, avg : %d\n",
+      counter->count, counter->cycles, counter->cycles/counter->count);
+
+  for(i=0; i<VCPU_STAT_HIST_NUM; i++){
+    if(counter->hist[i])
+      log_printf(level, "      2^%d cycles : %d\n", i, counter->hist[i]);
+  }
+}
+
+void vcpu_stat_dump(vcpu_t *vcpu, log_level_t level){
+  int i;
+  vcpu_stat_t *stat = vcpu->stat;
+
+  log_printf(level, "===== VM exit stat vm:%s vcpu_id:%d =====\n",
+      vcpu->vm->name, vcpu->vcpu_id);
+
+  for(i=0; i<VCPU_STAT_EXIT_NUM; i++){
+    if(stat->exit[i].count == 0)
+      continue;
+
+    if(i == VCPU_STAT_EXIT_IRQ)
+      log_printf(level, "  IRQ\n");
+    else if(i == VCPU_STAT_EXIT_OTHER)
+      log_printf(level, "  FIQ/SError\n");
+    else
+      log_printf(level, "  EC %#2x\n", i);
+    vcpu_stat_counter_dump(&stat->exit[i], level);
+  }
+
+  for(i=0; i<VCPU_STAT_HVC_NUM; i++){
+    if(stat->hvc[i].count == 0)
+      continue;
+
+    log_printf(level, "  HVC #%d\n", i);
+    vcpu_stat_counter_dump(&stat->hvc[i], level);
+  }
+}
+
+static void vcpu_stat_dump_timer_event(pcpu_t *phys_cpu, uint64_t arg){
+  vcpu_t *vcpu;
+  int i;
+
+  for(i=0; i<VCPU_MAX_NUM; i++){
+    vcpu = vcpu_get_by_id(i);
+    if(vcpu != NULL)
+      vcpu_stat_dump(vcpu, LOG_INFO);
+  }
+
+  timer_event_add(phys_cpu, vcpu_stat_dump_timer_event, VCPU_STAT_DUMP_MSEC, 0);
+}
+
+/* Dump all vcpus' stat every VCPU_STAT_DUMP_MSEC */
+void vcpu_stat_dump_start(pcpu_t *phys_cpu){
+  /* The cycle counter must count in EL2, too */
+  cycle_counter_count_el2();
+  cycle_count_start();
+
+  timer_event_add(phys_cpu, vcpu_stat_dump_timer_event, VCPU_STAT_DUMP_MSEC, 0);
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * vcpu_stat.h
+ * Per-vcpu VM exit statistics
+ */
+
+#ifndef _VCPU_STAT_H_INCLUDED_
+#define _VCPU_STAT_H_INCLUDED_
+
+#include "hyp_config.h"
+
+/* Index of vcpu_stat_t.exit[] */
+#define VCPU_STAT_EXIT_EC(ec) (ec)  /* Synchronous exception, ESR_EL2.EC */
+#define VCPU_STAT_EXIT_IRQ    64
+#define VCPU_STAT_EXIT_OTHER  65    /* FIQ and SError */
+#define VCPU_STAT_EXIT_NUM    66
+
+#define VCPU_STAT_HVC_NUM     16    /* HVC #imm >= 15 is counted in the last one */
+#define VCPU_STAT_HIST_NUM    32
+
+/* vcpu_stat_counter_t layout for assembly */
+#define VCPU_STAT_COUNTER_SIZE  144
+#define VCPU_STAT_OFF_COUNT     0
+#define VCPU_STAT_OFF_CYCLES    8
+#define VCPU_STAT_OFF_HIST      16
+
+#define VCPU_STAT_DUMP_MSEC   10000
+
+#ifndef __ASSEMBLER__
+
+typedef struct _vcpu_stat_t vcpu_stat_t;
+
+#include "typedef.h"
+#include "log.h"
+#include "pcpu.h"
+#include "vcpu.h"
+
+/* 
+ * PMU cycles spent in EL2 from the vector entry to dispatch.
+ * hist[n] counts exits which took 2^n ~ 2^(n+1)-1 cycles.
+ */
+typedef struct _vcpu_stat_counter_t{
+  uint64_t count;
+  uint64_t cycles;
+  uint32_t hist[VCPU_STAT_HIST_NUM];
+} vcpu_stat_counter_t;
+
+typedef struct _vcpu_stat_t{
+  vcpu_stat_counter_t exit[VCPU_STAT_EXIT_NUM];
+  vcpu_stat_counter_t hvc[VCPU_STAT_HVC_NUM];
+  int pending_exit; // exit which is not dispatched yet, -1 : none
+  int pending_hvc;
+} vcpu_stat_t;
+
+#if CONFIG_EXIT_STAT
+
+void vcpu_stat_init(vcpu_t *vcpu);
+void vcpu_stat_release(vcpu_t *vcpu);
+void vcpu_stat_exit(vcpu_t *vcpu, int exit);
+void vcpu_stat_hvc(vcpu_t *vcpu, uint64_t type);
+void vcpu_stat_dispatch(pcpu_t *phys_cpu);
+void vcpu_stat_reset(vcpu_t *vcpu);
+void vcpu_stat_dump(vcpu_t *vcpu, log_level_t level);
+void vcpu_stat_dump_start(pcpu_t *phys_cpu);
+
+#else
+
+static inline void vcpu_stat_init(vcpu_t *vcpu){}
+static inline void vcpu_stat_release(vcpu_t *vcpu){}
+static inline void vcpu_stat_exit(vcpu_t *vcpu, int exit){}
+static inline void vcpu_stat_hvc(vcpu_t *vcpu, uint64_t type){}
+static inline void vcpu_stat_dispatch(pcpu_t *phys_cpu){}
+static inline void vcpu_stat_reset(vcpu_t *vcpu){}
+static inline void vcpu_stat_dump(vcpu_t *vcpu, log_level_t level){}
+static inline void vcpu_stat_dump_start(pcpu_t *phys_cpu){}
+
+#endif
+
+#endif /* __ASSEMBLER__ */
+
+#endif
@@ -282,6 +282,16 @@ virt_full_mmio_reg_access_t bcm2836_ic_reg_access = {
   bcm2836_ic_reg_restore,
 };
 
+/* 
+ * Registers which only return a value shadowed in vm_t.
+ * Loads from them are emulated in the fast exit path without C code.
+ */
+virt_mmio_fast_read_t virt_mmio_fast_reads[] = {
+  {ARM_CORE_GPU_IRQ_ROUTING, offsetof(vm_t, vic.gpu_irq_route)},
+  {ARM_IC_FIQ_CONTROL,       offsetof(vm_t, vic.fiq_index)},
+};
+uint64_t virt_mmio_fast_read_num = sizeof(virt_mmio_fast_reads)/sizeof(virt_mmio_fast_reads[0]);
+
 static int bcm2836_ic_reg_read(vcpu_t *vcpu, 
               phys_addr_t addr, void *dst, uint8_t size){
 
@@ -372,6 +382,8 @@ static int bcm2836_ic_reg_read(vcpu_t *vcpu,
       log_debug("Illegal access to unavailable address\n");
         vm_force_shutdown(vcpu->vm);
   }
+
+  return 0;
 }
 
 static int bcm2836_ic_reg_write(vcpu_t *vcpu,
@@ -472,6 +484,8 @@ static int bcm2836_ic_reg_write(vcpu_t *vcpu,
       log_debug("Illegal access to unavailable address\n");
       return -1;
   }
+
+  return 0;
 }
 
 static void bcm2836_ic_reg_save(vcpu_t *vcpu){
@@ -550,7 +564,7 @@ void virt_intr_handler(vcpu_t *cur_vcpu){
   if(vcpu_core_irq_is_pending(cur_vcpu)){
     log_debug("core_irq cpu id : %d\n", irq_vcpu_id);
     log_debug("cntv_cval_el0 : %#8x, cntv_tval_el0 : %#8x\n",
-        cur_vcpu->sysreg.cntv_cval_el0, cntv_tval_el0);
+        VCPU_COLD_SYSREG_READ(cur_vcpu, cntv_cval_el0, CNTV_CVAL_EL0), cntv_tval_el0);
     vcpu_do_virq(cur_vcpu->vm->vcpu[irq_vcpu_id]);
     return;
   }
@@ -57,25 +57,27 @@ void excl_mmio_assign(vm_t *vm, uint64_t excl_mmio_assigned){
       if(exclusive_devices[i].vm != NULL)
         hyp_panic("This mmio device is already assigned to another vm!\n");
 
-      map_page_table(vm->vttbr, exclusive_devices[i].mem_start, exclusive_devices[i].mem_start,
-          exclusive_devices[i].mem_length);
+      exclusive_devices[i].vm = vm;
+      map_page_table_attr(vm->vttbr, vm->vmid, exclusive_devices[i].mem_start, exclusive_devices[i].mem_start,
+          exclusive_devices[i].mem_length, S2_ATTR_MMIO);
       log_debug("assigned exclusively managed MMIO id %d, addr : %#8x\n", i, exclusive_devices[i].mem_start);
     }
   }
 }
 
-/* TODO */
-#if 0
-void exclusive_mmio_release(vm_t *vm){
+/* Unmap the exclusively managed MMIO devices of vm and make them assignable again */
+void excl_mmio_release(vm_t *vm){
   int i;
   
   for(i=1; i<sizeof(exclusive_devices)/sizeof(exclusive_devices[0]); i++){
-    
+    if(exclusive_devices[i].vm != vm)
+      continue;
+
     exclusive_devices[i].vm = NULL;
-    map_page_free(vm->vttbr, exclusive_devices[i].mem_start, exclusive_devices[i].mem_start);
+    unmap_page_table(vm->vttbr, vm->vmid, exclusive_devices[i].mem_start,
+        exclusive_devices[i].mem_length);
   }
 }
-#endif
 
 #if 0
 
@@ -164,17 +166,116 @@ void virt_mmio_reg_reset(void){
   }
 }
 
-int virt_mmio_reg_access(vcpu_t *vcpu,
-       uint64_t opcode, phys_addr_t reg_addr, int rw){
+/*
+ * Data abort iss
+ * |24 |23-22|21 |20-16|15|14-10|9 |8 |7 |6  |5-0 |
+ * |ISV| SAS |SSE| SRT |SF| RES0|EA|CM|S1|WnR|DFSC|
+ */
+#define DABT_ISS_ISV        (1 << 24)
+#define DABT_ISS_SAS(iss)   (((iss) >> 22) & 0b11)
+#define DABT_ISS_SSE        (1 << 21)
+#define DABT_ISS_SRT(iss)   (((iss) >> 16) & 0b11111)
+#define DABT_ISS_SF         (1 << 15)
+#define DABT_ISS_WNR        (1 << 6)
+
+/*
+ * Build the syndrome of a load or store instruction
+ * for a data abort which did not report it (ISV == 0).
+ * This fetches the instruction from the guest memory, so it is slow.
+ * 
+ * LDR : ss 111 0 xx 01 x
+ * STR : ss 111 0 xx 00 x
+ * 
+ * Pre and post index forms are supported and
+ * their base register update is returned in *wb_rn and *wb_imm.
+ */
+static int mmio_decode_inst(vcpu_t *vcpu, uint32_t *iss, int *wb_rn, int64_t *wb_imm){
+  uint32_t opcode = *(uint32_t *)el1va2pa(vcpu->sysreg.pc);
+  uint32_t size = (opcode>>30)&0b11;
+  uint32_t opc = (opcode>>22)&0b11;
+  uint32_t Rn = (opcode>>5)&0b11111;
+
+  log_debug("instruction code : %#x\n", opcode);
+
+  switch((opcode>>24)&0xff){
+    case 0b00111000: /* LDR/STR (immediate, imm9) or (register) */
+    case 0b01111000:
+    case 0b10111000:
+    case 0b11111000:
+      /* Pre index (0b11) or post index (0b01) */
+      if(((opcode>>21)&1) == 0 && ((opcode>>10)&1) == 1){
+        if(Rn == 31){
+          log_error("Not Supported instruction\n");
+          return -1;
+        }
+        *wb_rn = Rn;
+        *wb_imm = ((int64_t)((uint64_t)opcode << 43)) >> 55; /* imm9 */
+      }
+      break;
+    case 0b00111001: /* LDR/STR (immediate, unsigned offset) */
+    case 0b01111001:
+    case 0b10111001:
+    case 0b11111001:
+      break;
+    default:
+      log_error("Not Supported instruction\n");
+      return -1;
+  }
+
+  *iss = (*iss & ~(DABT_ISS_SSE | (0b11 << 22) | (0b11111 << 16) | DABT_ISS_SF))
+      | DABT_ISS_ISV | (size << 22) | ((opcode & 0b11111) << 16);
+
+  switch(opc){
+    case 0b00: /* STR */
+    case 0b01: /* LDR */
+      if(size == 0b11)
+        *iss |= DABT_ISS_SF;
+      break;
+    case 0b10: /* LDRS to 64bit */
+      if(size == 0b11){
+        log_error("Not Supported instruction\n");
+        return -1;
+      }
+      *iss |= DABT_ISS_SSE | DABT_ISS_SF;
+      break;
+    case 0b11: /* LDRS to 32bit */
+      if(size >= 0b10){
+        log_error("Not Supported instruction\n");
+        return -1;
+      }
+      *iss |= DABT_ISS_SSE;
+      break;
+  }
+
+  return 0;
+}
+
+/*
+ * Emulate a load or store to a virtualized mmio register.
+ * The access is decoded from the syndrome (iss of ESR_EL2),
+ * the instruction is fetched only when the syndrome is not valid.
+ */
+int virt_mmio_reg_access(vcpu_t *vcpu, uint32_t iss, phys_addr_t reg_addr){
   int i;
   virt_mmio_reg_read_fn_t   *reg_read_fn;
   virt_mmio_reg_write_fn_t  *reg_write_fn;
+  uint8_t size;
+  uint32_t Rt;
+  uint64_t value = 0;
+  int wb_rn = -1;
+  int64_t wb_imm = 0;
+  int ret;
 
-  log_debug("instruction code : %#x\n", opcode);
-  log_debug("access addr : %#x\n", reg_addr);
-  /* TODO : access size */
-  log_debug("access size : %d\n", ((opcode>>30)&0b11)*16);
+  if(!(iss & DABT_ISS_ISV)){
+    if(mmio_decode_inst(vcpu, &iss, &wb_rn, &wb_imm) < 0)
+      return -1;
+  }
+
+  size = 8 << DABT_ISS_SAS(iss);
+  Rt = DABT_ISS_SRT(iss);
 
+  log_debug("access addr : %#x\n", reg_addr);
+  log_debug("access size : %d\n", size);
 
   for(i=0; i< sizeof(virt_full_devices)/sizeof(virt_full_devices[0]); i++){
     if((reg_addr>=virt_full_devices[i]->mem_start)&&(reg_addr<=virt_full_devices[i]->mem_end)){
@@ -199,37 +300,31 @@ int virt_mmio_reg_access(vcpu_t *vcpu,
     }
   }
 
-  /* 
-   * emulata a load or store instruction
-   * 
-   * LDR : ss 111 0 xx 01 x
-   * STR : ss 111 0 xx 00 x
-   * 
-   */
-  uint64_t Rt = opcode&0b11111;
-
-  if(rw){
-    /*store ope*/
-    if(((opcode>>22)&0xff)==0b11100000){
-    } else if(((opcode>>22)&0xff)==0b11100100){
-    }else{
-      log_error("Not Supported instruction\n");
-      return -1;
-    }
+  if(iss & DABT_ISS_WNR){
+    /* store ope, Rt == 31 is xzr */
+    if(Rt != 31)
+      value = vcpu->reg.x[Rt];
     
-    return reg_write_fn(vcpu, reg_addr, vcpu->reg.x[Rt], ((opcode>>30)&0b11)*16);
+    ret = reg_write_fn(vcpu, reg_addr, value, size);
 
   } else {
-    /*load ope*/
-    if(((opcode>>22)&0xff)==0b11100001){
-    } else if(((opcode>>22)&0xff)==0b11100101){
-    }else{
-      log_error("Not Supported instruction\n");
-      return -1;
-    }
+    /* load ope */
+    ret = reg_read_fn(vcpu, reg_addr, &value, size);
 
-    return reg_read_fn(vcpu, reg_addr, &vcpu->reg.x[Rt],((opcode>>30)&0b11)*16);
+    if(ret >= 0 && Rt != 31){
+      if((iss & DABT_ISS_SSE) && size < 64)
+        value = (uint64_t)(((int64_t)(value << (64 - size))) >> (64 - size));
+      if(!(iss & DABT_ISS_SF))
+        value &= 0xFFFFFFFF;
+      vcpu->reg.x[Rt] = value;
+    }
   }
+
+  /* Write back the base register of a pre or post index instruction */
+  if(ret >= 0 && wb_rn >= 0)
+    vcpu->reg.x[wb_rn] += wb_imm;
+
+  return ret;
 }
 
 void virt_mmio_reg_context_save(vcpu_t *vcpu){
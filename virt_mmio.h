@@ -63,6 +63,7 @@ typedef enum {
 #define VIRT_MMIO_USB   (1<<MMIO_USB)
 
 void excl_mmio_assign(vm_t *vm, uint64_t excl_mmio_assigned);
+void excl_mmio_release(vm_t *vm);
 
 typedef void (virt_mmio_reg_reset_fn_t)(void);
 typedef int (virt_mmio_reg_read_fn_t)
@@ -98,9 +99,21 @@ typedef struct _virt_excl_mmio_reg_access_t{
   virt_mmio_reg_release_fn_t  *reg_release_fn;
 } virt_excl_mmio_reg_access_t;
 
+/*
+ * Shadowed register read served by the fast exit path (fast_exit_dabt).
+ * A 32bit load from addr returns *(uint32_t *)((char *)vcpu->vm + vm_offset).
+ */
+typedef struct _virt_mmio_fast_read_t{
+  phys_addr_t addr;
+  uint64_t vm_offset;
+} virt_mmio_fast_read_t;
+
+extern virt_mmio_fast_read_t virt_mmio_fast_reads[];
+extern uint64_t virt_mmio_fast_read_num;
+
 void virt_mmio_reg_reset(void);
 
-int virt_mmio_reg_access(vcpu_t *vcpu, uint64_t opcode, phys_addr_t reg_addr, int rw);
+int virt_mmio_reg_access(vcpu_t *vcpu, uint32_t iss, phys_addr_t reg_addr);
 
 void virt_mmio_reg_context_save(vcpu_t *vcpu);
 void virt_mmio_reg_context_restore(vcpu_t *vcpu);
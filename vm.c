@@ -8,15 +8,36 @@
 #include "vm.h"
 #include "hyp_call.h"
 #include "virt_mmio.h"
+#include "vm_mem.h"
+#include "vm_checkpoint.h"
 #include "schedule.h"
+#include "slab.h"
+#include "id_space.h"
+#include "virq.h"
+#include "hyp_timer.h"
+#include "vtimer.h"
+#include "pcpu.h"
+#include "spinlock.h"
 
-#define VM_MAX_NUM 10
+/* Interval to retry vm_free() while a cpu refers to a vcpu of the vm */
+#define VM_FREE_RETRY_MSEC  100
 
-vm_t vms[VM_MAX_NUM];
-#include "virq.h"
-void vm_create(char *name, uint8_t vcpu_num, scheduler_t *scheduler, int priority, 
+static slab_cache_t vm_cache = SLAB_CACHE_INIT("vm_t", sizeof(vm_t), 0);
+ID_SPACE_DEFINE(vm_ids, VM_MAX_NUM);
+static vm_t *vm_table[VM_MAX_NUM];
+
+/* Return the vm of the ID, or NULL */
+vm_t *vm_get_by_id(int id){
+  if(id < 0 || id >= VM_MAX_NUM || vm_table[id] == 0)
+    return NULL;
+
+  return vm_table[id];
+}
+
+void vm_create(char *name, uint8_t vcpu_num, scheduler_t *scheduler, vm_sched_param_t *sched_param, 
             phys_addr_t entry_addr, mmp_t *mmp, int mmp_size, 
-            uint64_t sec_opt, uint64_t excl_intr_opt, uint64_t excl_mmio_opt, uint64_t assigned_gpio){
+            uint64_t sec_opt, uint64_t excl_intr_opt, uint64_t excl_mmio_opt, uint64_t assigned_gpio,
+            uint64_t vm_opt){
 
   
   log_info("Create vm; name : %s\n", name);
@@ -25,47 +46,72 @@ void vm_create(char *name, uint8_t vcpu_num, scheduler_t *scheduler, int priorit
   if(vcpu_num > CPU_NUM)
     hyp_panic("Required vcpu num is too large!");
   
-  /* find free a vm_t block*/
-  int i;
-  for(i=0; i<VM_MAX_NUM; i++){
-    if(vms[i].free == 0)break;
+  if(scheduler->admit != NULL && scheduler->admit(sched_param, vcpu_num) != 0){
+    log_error("The scheduler rejected vm %s\n", name);
+    return;
   }
-  /*if tehre isn't a free vm_t block */
-  if(i == VM_MAX_NUM)
-    hyp_panic("Not found a free vm_t block\n");
 
-  vm_t *vm = &vms[i]; 
+  int i;
+  int id = id_alloc(&vm_ids);
+  if(id < 0)
+    hyp_panic("Not found a free vm ID\n");
 
-  /* TODO : VMを再利用できるようにする */
-  vm->free = 1;
+  /* slab_cache_alloc() zeroes the vm_t */
+  vm_t *vm = slab_cache_alloc(&vm_cache);
+  vm->vm_id = id;
+  vm_table[id] = vm;
 
   vm->name = name;
   vm->vcpu_num = vcpu_num;
 
   vm->scheduler = scheduler;
-  vm->priority = priority;
+  vm->sched_param = *sched_param;
+  vm->opt = vm_opt;
+  vm->hyp_ring_lock = 0;
 
   // map pagetable
   vm->vttbr = alloc_vttbr();
+  /* A VMID is allocated when a vcpu of this vm is switched in first */
+  vm->vmid = 0;
+
+  vm->mmp = mmp;
+  vm->mmp_size = mmp_size;
+  vm->dirty_log = 0;
+  vm->dirty_bitmap = NULL;
+  vm->dirty_page_num = 0;
+  vm->snapshot = NULL;
+  vm->balloon_page_num = 0;
+  vm->mem_lock = 0;
 
   log_info("VM memory map init\n");
   for(i = 0; i < mmp_size; i++){
     log_info("mmp[%d]; mem_start : %#8x, mem_end : %#8x\n",
         i, mmp[i].mem_start, mmp[i].mem_end);
-    mmp[i].phys_addr = malloc(mmp[i].mem_end + 1 - mmp[i].mem_start);
-    map_page_table(vm->vttbr, mmp[i].mem_start, mmp[i].phys_addr, 
-                      mmp[i].mem_end + 1 - mmp[i].mem_start);
+
+    /* Allocated and mapped on the first access, see vm_mem_fault() */
+    if(mmp[i].flag == MEM_ON_DEMAND){
+      mmp[i].phys_addr = 0;
+      continue;
+    }
+
+    /* Mapped read only and shared with vms of the same image */
+    if(mmp[i].flag == MEM_VM_IMG){
+      mmp[i].phys_addr = vm_mem_img_map(vm, &mmp[i]);
+      continue;
+    }
+
+    mmp[i].phys_addr = vm_mem_alloc(mmp[i].mem_start, mmp[i].mem_end + 1 - mmp[i].mem_start);
+    map_page_table_attr(vm->vttbr, vm->vmid, mmp[i].mem_start, mmp[i].phys_addr, 
+                      mmp[i].mem_end + 1 - mmp[i].mem_start, vm_mem_attr(&mmp[i]));
 
     switch(mmp[i].flag){
       case 0:
         break;
-      case MEM_VM_IMG:
-        /* copy image */
-        memcpy(mmp[i].phys_addr, mmp[i].img_start, (uint64_t)(mmp[i].img_end - mmp[i].img_start));
-        break;
       case MEM_HYP_VM_MSG:
         vm->hyp_msg = mmp[i].phys_addr;
-        map_page_table(vm->vttbr, mmp[i].mem_start, vm->hyp_msg, HYP_VM_MSG_SIZE);
+        /* The hypervisor and the running guest share the page, so it is not cached */
+        map_page_table_attr(vm->vttbr, vm->vmid, mmp[i].mem_start, vm->hyp_msg, HYP_VM_MSG_SIZE,
+            (vm_mem_attr(&mmp[i]) & ~S2_MEMATTR_MASK) | S2_MEMATTR_NORMAL_NC);
         break;
       default:
         hyp_panic("Illegal flag in mmp\n");
@@ -87,7 +133,43 @@ void vm_create(char *name, uint8_t vcpu_num, scheduler_t *scheduler, int priorit
   vm->vcpu[0] =  vcpu_create(vm, 0, vm->vttbr, vm->hyp_msg, (phys_addr_t)entry_addr);
   
   /* Add to ready que */
-  vcpu_ready(vm->vcpu[0]);
+  vcpu_boot(vm->vcpu[0]);
+}
+
+/*
+ * Free the guest memory, the stage 2 page tables, vm_t, its vcpu_t
+ * and their IDs after vm_force_shutdown().
+ * A vcpu of the vm may still run on another cpu until its next exit,
+ * and a physical cpu may refer to it, e.g. as last_vcpu,
+ * so this is a timer event which is retried until no cpu does.
+ */
+static void vm_free(pcpu_t *phys_cpu, uint64_t arg){
+  vm_t *vm = (vm_t *)arg;
+  int i;
+
+  for(i=0; i<vm->vcpu_num; i++){
+    if(vm->vcpu[i] != 0 && (vcpu_is_referenced(vm->vcpu[i])
+          || vtimer_release(vm->vcpu[i]) != 0)){
+      timer_event_add(phys_cpu, vm_free, VM_FREE_RETRY_MSEC, arg);
+      return;
+    }
+  }
+
+  /* No vcpu of the vm runs, drop its translations before the pages go */
+  tlb_flush_vmid(vm->vmid);
+  vm_checkpoint_release(vm);
+  vm_mem_release(vm);
+  free_vttbr(vm->vttbr, vm->vmid);
+  vm->vttbr = 0;
+
+  for(i=0; i<vm->vcpu_num; i++){
+    if(vm->vcpu[i] != 0)
+      vcpu_free(vm->vcpu[i]);
+  }
+
+  log_info("Freed vm %s\n", vm->name);
+  id_free(&vm_ids, vm->vm_id);
+  slab_cache_free(&vm_cache, vm);
 }
 
 void vm_force_shutdown(vm_t *vm){
@@ -99,8 +181,20 @@ void vm_force_shutdown(vm_t *vm){
   log_info("Shutdown vm:%s\n", vm->name);
 
   /* off and release each vcpu which this vm has */
-  for(i=0; i < vm->vcpu_num; i++)
-    vcpu_off(vm->vcpu[i]);
+  for(i=0; i < vm->vcpu_num; i++){
+    if(vm->vcpu[i] != 0)
+      vcpu_off(vm->vcpu[i]);
+  }
+
+  /* The schedulers scan vm_table with their lock */
+  spin_lock(&vm->scheduler->lock);
+  vm_table[vm->vm_id] = 0;
+  spin_unlock(&vm->scheduler->lock);
+
+  /* Release devices. vm_free() releases the memory once no vcpu runs */
+  virt_device_intr_release(vm);
+  virt_mmio_reg_release(vm);
+  excl_mmio_release(vm);
 
-  /* TODO : freen vm_t block memory */
+  timer_event_add(get_current_phys_cpu(), vm_free, VM_FREE_RETRY_MSEC, (uint64_t)vm);
 }
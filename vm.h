@@ -8,16 +8,64 @@ typedef struct _vm_t vm_t;
 #include "schedule.h"
 #include "hyp_security.h"
 
+typedef enum _mmp_attr_t {
+  MEM = 0,
+  MEM_HYP_VM_MSG,
+  MEM_VM_IMG,
+  MEM_ON_DEMAND,  // Populated on the first access, see vm_mem.c
+} mmp_attr_t;
+
+typedef struct _mmp_t {
+  phys_addr_t phys_addr;
+  phys_addr_t mem_start;
+  phys_addr_t mem_end;
+  phys_addr_t img_start;
+  phys_addr_t img_end;
+  mmp_attr_t flag;
+  uint64_t attr;  // Stage 2 attributes, S2_ATTR_* in hyp_mmu.h. 0 means S2_ATTR_RAM
+  struct _vm_img_t *img;  // shared image of MEM_VM_IMG, see vm_mem.c
+} mmp_t;
+
+/* Criticality of a vm in edf_scheduler */
+#define VM_CRIT_LO  0
+#define VM_CRIT_HI  1
+
+/* Scheduling parameters of a vm, given to vm_create() */
+typedef struct _vm_sched_param_t {
+  int priority;     // fcfs_scheduler : 0 (highest) ~ 15
+  uint32_t weight;  // credit_scheduler : share of cpu time, 0 means CREDIT_DEFAULT_WEIGHT
+  uint32_t cap;     // credit_scheduler : max % of one cpu, 0 means no cap
+  uint32_t budget_usec; // edf_scheduler : CBS budget of each vcpu per period
+  uint32_t period_usec; // edf_scheduler : CBS period of each vcpu
+  int criticality;      // edf_scheduler : VM_CRIT_LO or VM_CRIT_HI
+} vm_sched_param_t;
+
+#define VM_MAX_NUM  64  /* Number of vm IDs, see vm_create() */
+
+/* Options of a vm, given to vm_create() */
+#define VM_OPT_CHECKPOINT (1 << 0)  /* The guest may take checkpoints by HYP_CALL_CHECKPOINT */
+
 typedef struct _vm_t {
-  int free;
+  int vm_id;  // ID in the hypervisor, see vm_get_by_id()
   uint8_t *phys_addr;
   char *name;
   uint32_t vcpu_num;
   vcpu_t *vcpu[4];
   scheduler_t *scheduler;
-  int priority;
+  vm_sched_param_t sched_param;
   phys_addr_t vttbr;
+  uint64_t vmid;  // generation and VMID, see vmid_update()
+  mmp_t *mmp;     // memory map given to vm_create()
+  int mmp_size;
+  uint64_t opt;   // VM_OPT_*
+  int dirty_log;  // dirty page tracking is running, see vm_checkpoint.c
+  uint64_t *dirty_bitmap; // a bit per page of ipa
+  uint64_t dirty_page_num;
+  struct _vm_snapshot_t *snapshot;
+  uint64_t balloon_page_num;  // pages given back by the balloon, see vm_mem.c
+  int mem_lock;       // serializes stage 2 faults and the balloon, see vm_mem.c
   char *hyp_msg;
+  int hyp_ring_lock;  // lock of the hyp_ring in hyp_msg, see hyp_ring.c
   uint64_t assigned_gpio;
   struct{
     uint64_t assigned_gpu_irq;
@@ -26,25 +74,12 @@ typedef struct _vm_t {
   }vic;
 } vm_t;
 
-typedef enum _mmp_attr_t {
-  MEM = 0,
-  MEM_HYP_VM_MSG,
-  MEM_VM_IMG,
-} mmp_attr_t;
-
-typedef struct _mmp_t {
-  phys_addr_t phys_addr;
-  phys_addr_t mem_start;
-  phys_addr_t mem_end;
-  phys_addr_t img_start;
-  phys_addr_t img_end;
-  mmp_attr_t flag;
-} mmp_t;
-
-void vm_create(char *name, uint8_t vcpu_num, scheduler_t *scheduler, int priority, 
+void vm_create(char *name, uint8_t vcpu_num, scheduler_t *scheduler, vm_sched_param_t *sched_param, 
             phys_addr_t entry_addr, mmp_t *mmp, int mmp_size, 
-            uint64_t sec_opt, uint64_t excl_intr_opt, uint64_t excl_mmio_opt, uint64_t assigned_gpio);
+            uint64_t sec_opt, uint64_t excl_intr_opt, uint64_t excl_mmio_opt, uint64_t assigned_gpio,
+            uint64_t vm_opt);
 
 void vm_force_shutdown(vm_t *vm);
+vm_t *vm_get_by_id(int id);
 
 #endif
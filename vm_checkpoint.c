@@ -0,0 +1,245 @@
+/*
+ * vm_checkpoint.c
+ * Incremental checkpoints of a vm with stage 2 dirty page tracking
+ *
+ * vm_dirty_log_start() write-protects the memory of a vm in stage 2.
+ * The first write to each page causes a stage 2 permission fault,
+ * and vm_mem_fault() makes the page writable and marks it in vm->dirty_bitmap.
+ * vm_checkpoint() copies only the pages written since the last checkpoint
+ * to the snapshot area of the vm, write-protects them again
+ * and saves the registers of the vcpus.
+ * Only a vm created with VM_OPT_CHECKPOINT may take checkpoints,
+ * as the snapshot area is as large as the memory of the vm.
+ */
+
+#include "typedef.h"
+#include "lib.h"
+#include "log.h"
+#include "malloc.h"
+#include "asm_func.h"
+#include "hyp_mmu.h"
+#include "vcpu.h"
+#include "vm.h"
+#include "hyp_call.h"
+#include "vm_mem.h"
+#include "vm_checkpoint.h"
+
+#define DIRTY_BITMAP_TEST(bitmap, n)  ((bitmap)[(n) / 64] & (1ULL << ((n) % 64)))
+#define DIRTY_BITMAP_SET(bitmap, n)   ((bitmap)[(n) / 64] |= (1ULL << ((n) % 64)))
+#define DIRTY_BITMAP_CLEAR(bitmap, n) ((bitmap)[(n) / 64] &= ~(1ULL << ((n) % 64)))
+
+/*
+ * The hypervisor writes the hyp_msg page directly, not through stage 2,
+ * so it is copied on every checkpoint instead of being write-protected.
+ */
+static int mmp_is_dirty_logged(mmp_t *mmp){
+  return mmp->flag != MEM_HYP_VM_MSG;
+}
+
+/*
+ * Allocate the snapshot area of vm.
+ * Return -1 if the host has not enough memory, then nothing is allocated.
+ */
+static int vm_snapshot_alloc(vm_t *vm){
+  vm_snapshot_t *snapshot;
+  int i;
+
+  snapshot = malloc_try(sizeof(vm_snapshot_t));
+  if(snapshot == 0)
+    return -1;
+  snapshot->seq = 0;
+  snapshot->mem = malloc_try(vm->mmp_size * sizeof(phys_addr_t));
+  if(snapshot->mem == 0){
+    free(snapshot);
+    return -1;
+  }
+
+  for(i=0; i<vm->mmp_size; i++){
+    snapshot->mem[i] = (phys_addr_t)malloc_try(vm->mmp[i].mem_end + 1 - vm->mmp[i].mem_start);
+    if(snapshot->mem[i] == 0){
+      while(--i >= 0)
+        free((void *)snapshot->mem[i]);
+      free(snapshot->mem);
+      free(snapshot);
+      return -1;
+    }
+  }
+
+  vm->snapshot = snapshot;
+  return 0;
+}
+
+/*
+ * Start dirty page tracking of vm.
+ * Every page is dirty at first, so the next checkpoint is a full copy.
+ * Return 0, or VM_MEM_ENOMEM if there is no memory for the snapshot.
+ */
+int vm_dirty_log_start(vm_t *vm){
+  uint64_t page_num = 0;
+  int i;
+
+  if(vm->dirty_log)
+    return 0;
+
+  if(vm->snapshot == NULL && vm_snapshot_alloc(vm) < 0){
+    log_warn("No memory for the snapshot of vm %s\n", vm->name);
+    return VM_MEM_ENOMEM;
+  }
+
+  if(vm->dirty_bitmap == NULL){
+    for(i=0; i<vm->mmp_size; i++){
+      if((vm->mmp[i].mem_end + 1) / PAGE_SIZE > page_num)
+        page_num = (vm->mmp[i].mem_end + 1) / PAGE_SIZE;
+    }
+    vm->dirty_bitmap = malloc_try((page_num + 63) / 64 * sizeof(uint64_t));
+    if(vm->dirty_bitmap == 0){
+      vm->dirty_bitmap = NULL;
+      log_warn("No memory for the dirty bitmap of vm %s\n", vm->name);
+      return VM_MEM_ENOMEM;
+    }
+    vm->dirty_page_num = page_num;
+  }
+
+  log_info("Start dirty page tracking of vm %s\n", vm->name);
+
+  vm->dirty_log = 1;
+  for(i=0; i<vm->mmp_size; i++){
+    if(!mmp_is_dirty_logged(&vm->mmp[i]))
+      continue;
+
+    vm_dirty_log_mark(vm, vm->mmp[i].mem_start,
+        vm->mmp[i].mem_end + 1 - vm->mmp[i].mem_start);
+    set_page_table_attr(vm->vttbr, vm->vmid, vm->mmp[i].mem_start,
+        vm->mmp[i].mem_end + 1 - vm->mmp[i].mem_start, S2AP_RO);
+  }
+
+  return 0;
+}
+
+/*
+ * Stop dirty page tracking of vm.
+ * Write-protected pages are made writable lazily by vm_mem_fault().
+ */
+void vm_dirty_log_stop(vm_t *vm){
+  log_info("Stop dirty page tracking of vm %s\n", vm->name);
+  vm->dirty_log = 0;
+}
+
+/* Free the dirty bitmap and the snapshot of vm */
+void vm_checkpoint_release(vm_t *vm){
+  int i;
+
+  vm->dirty_log = 0;
+
+  if(vm->dirty_bitmap != NULL){
+    free(vm->dirty_bitmap);
+    vm->dirty_bitmap = NULL;
+    vm->dirty_page_num = 0;
+  }
+
+  if(vm->snapshot != NULL){
+    for(i=0; i<vm->mmp_size; i++)
+      free((void *)vm->snapshot->mem[i]);
+    free(vm->snapshot->mem);
+    free(vm->snapshot);
+    vm->snapshot = NULL;
+  }
+}
+
+/* Mark [ipa, ipa + size) of vm as dirty if the tracking is running */
+void vm_dirty_log_mark(vm_t *vm, phys_addr_t ipa, uint64_t size){
+  uint64_t n;
+
+  if(!vm->dirty_log)
+    return;
+
+  for(n = ipa / PAGE_SIZE; n < (ipa + size + PAGE_SIZE - 1) / PAGE_SIZE
+      && n < vm->dirty_page_num; n++)
+    DIRTY_BITMAP_SET(vm->dirty_bitmap, n);
+}
+
+/*
+ * Copy the pages of vm written since the last checkpoint
+ * and the registers of its vcpus to vm->snapshot.
+ * The first call starts dirty page tracking and copies all the memory.
+ * No other vcpu of vm may run during this, e.g. it is called by its only vcpu.
+ * Return the number of copied pages, -1 if vm was not created with
+ * VM_OPT_CHECKPOINT, or VM_MEM_ENOMEM if there is no memory for the snapshot.
+ */
+int64_t vm_checkpoint(vm_t *vm){
+  vm_snapshot_t *snapshot;
+  vcpu_snapshot_t *vcpu_snapshot;
+  vcpu_t *vcpu;
+  mmp_t *mmp;
+  phys_addr_t ipa;
+  phys_addr_t pa;
+  uint64_t n;
+  int64_t copied = 0;
+  int i;
+
+  if(!(vm->opt & VM_OPT_CHECKPOINT)){
+    log_warn("vm %s is not allowed to take checkpoints\n", vm->name);
+    return -1;
+  }
+
+  if(vm_dirty_log_start(vm) < 0)
+    return VM_MEM_ENOMEM;
+  snapshot = vm->snapshot;
+
+  for(i=0; i<vm->mmp_size; i++){
+    mmp = &vm->mmp[i];
+
+    if(!mmp_is_dirty_logged(mmp)){
+      memcpy(snapshot->mem[i], vm->hyp_msg, HYP_VM_MSG_SIZE);
+      copied++;
+      continue;
+    }
+
+    for(ipa = mmp->mem_start; ipa <= mmp->mem_end; ipa += PAGE_SIZE){
+      n = ipa / PAGE_SIZE;
+
+      /* Skip clean 64 pages at once */
+      if(vm->dirty_bitmap[n / 64] == 0 && n % 64 == 0
+          && ipa + 64 * PAGE_SIZE - 1 <= mmp->mem_end){
+        ipa += 63 * PAGE_SIZE;
+        continue;
+      }
+
+      if(!DIRTY_BITMAP_TEST(vm->dirty_bitmap, n))
+        continue;
+      DIRTY_BITMAP_CLEAR(vm->dirty_bitmap, n);
+
+      /* A page of on demand memory which is not populated yet is zero */
+      pa = lookup_page_table(vm->vttbr, ipa);
+      if(pa != 0){
+        /* The guest may still have the page in the data cache */
+        dcache_clean_inval_range(pa, PAGE_SIZE);
+        memcpy(snapshot->mem[i] + (ipa - mmp->mem_start), pa, PAGE_SIZE);
+      }else
+        memset(snapshot->mem[i] + (ipa - mmp->mem_start), 0, PAGE_SIZE);
+      copied++;
+    }
+
+    /* Write-protect the copied pages again */
+    set_page_table_attr(vm->vttbr, vm->vmid, mmp->mem_start,
+        mmp->mem_end + 1 - mmp->mem_start, S2AP_RO);
+  }
+
+  for(i=0; i<vm->vcpu_num; i++){
+    vcpu = vm->vcpu[i];
+    if(vcpu == 0)
+      continue;
+    vcpu_snapshot = &snapshot->vcpu[i];
+
+    vcpu_context_sync(vcpu);
+    memcpy(&vcpu_snapshot->reg, &vcpu->reg, sizeof(vcpu_reg_t));
+    memcpy(&vcpu_snapshot->sysreg, &vcpu->sysreg, sizeof(vcpu_sysreg_t));
+    memcpy(&vcpu_snapshot->cold_sysreg, &vcpu->cold_sysreg, sizeof(vcpu_cold_sysreg_t));
+    memcpy(&vcpu_snapshot->freg, &vcpu->freg, sizeof(vcpu_freg_t));
+  }
+
+  snapshot->seq++;
+  log_debug("Checkpoint %d of vm %s; copied pages : %d\n", snapshot->seq, vm->name, copied);
+
+  return copied;
+}
@@ -0,0 +1,33 @@
+/*
+ * vm_checkpoint.h
+ * Incremental checkpoints of a vm
+ */
+
+#ifndef _VM_CHECKPOINT_H_INCLUDED_
+#define _VM_CHECKPOINT_H_INCLUDED_
+
+#include "typedef.h"
+#include "vcpu.h"
+#include "vm.h"
+
+/* Registers of a vcpu at a checkpoint */
+typedef struct _vcpu_snapshot_t {
+  vcpu_reg_t reg;
+  vcpu_sysreg_t sysreg;
+  vcpu_cold_sysreg_t cold_sysreg;
+  vcpu_freg_t freg;
+} vcpu_snapshot_t;
+
+typedef struct _vm_snapshot_t {
+  uint64_t seq;   // number of checkpoints taken
+  phys_addr_t *mem;   // copy of each mmp_t region of the vm
+  vcpu_snapshot_t vcpu[4];  // vm_t.vcpu[]
+} vm_snapshot_t;
+
+int  vm_dirty_log_start(vm_t *vm);
+void vm_dirty_log_stop(vm_t *vm);
+void vm_dirty_log_mark(vm_t *vm, phys_addr_t ipa, uint64_t size);
+int64_t vm_checkpoint(vm_t *vm);
+void vm_checkpoint_release(vm_t *vm);
+
+#endif
@@ -0,0 +1,534 @@
+/* 
+ * vm_mem.c
+ * Guest memory allocation
+ *
+ * MEM_ON_DEMAND regions of mmp_t are not allocated nor mapped by vm_create().
+ * The first access to each page or 2MB block causes
+ * a stage 2 translation fault, and then it is allocated, zeroed and mapped.
+ *
+ * MEM_VM_IMG regions loaded from the same image are shared by vms.
+ * They are mapped read only, and the first write to each page causes
+ * a stage 2 permission fault, and then the page is copied for the vm.
+ * The last vm which shares a page takes it over instead of copying it,
+ * and frees it with its other memory. An image is freed when no vm maps it.
+ * With CONFIG_VM_IMG_ZERO_COPY, a page aligned image embedded in the hypervisor
+ * is mapped as it is instead of being copied. Only its last partial page is copied,
+ * and the rest of the region is populated with zeroed pages on the first access.
+ *
+ * Pages of MEM and MEM_ON_DEMAND regions can be returned by the guest
+ * with the balloon hypervisor calls, and they are unmapped and freed.
+ */
+
+#include "typedef.h"
+#include "hyp_config.h"
+#include "lib.h"
+#include "log.h"
+#include "malloc.h"
+#include "spinlock.h"
+#include "hyp_mmu.h"
+#include "vcpu.h"
+#include "vm.h"
+#include "vm_checkpoint.h"
+#include "vm_mem.h"
+
+/* FSC of a translation or permission fault at any level */
+#define ISS_FSC_TRANSLATION_FAULT(iss)  (((iss)&0x3C) == 0x04)
+#define ISS_FSC_PERMISSION_FAULT(iss)   (((iss)&0x3C) == 0x0C)
+#define ISS_WNR   (1 << 6)  // Data abort caused by a write
+
+#define VM_IMG_MAX_NUM  8
+
+/* page_refcnt[] of an image page taken over by its last vm */
+#define VM_IMG_PAGE_TAKEN 0xFFFF
+
+/* Pages unmapped at once by vm_mem_balloon_inflate() */
+#define BALLOON_BATCH_NUM 64
+
+/* Guest image shared by vms */
+typedef struct _vm_img_t {
+  phys_addr_t img_start;
+  phys_addr_t img_end;
+  uint64_t size;        // size of the mmp_t region
+  uint64_t offset;      // offset of the region in a 2MB block
+  phys_addr_t phys_addr;
+  uint64_t shared_size; // bytes from phys_addr shared by the vms
+  uint16_t *page_refcnt;  // number of vms which map each page read only, or VM_IMG_PAGE_TAKEN
+  int vm_num;   // number of vms which map the image, the slot is free if 0
+  int sealed;   // a page was taken over by the last vm, do not share it with new vms
+  int embedded; // phys_addr is the image in the hypervisor, it is never written nor freed
+} vm_img_t;
+
+static vm_img_t vm_imgs[VM_IMG_MAX_NUM];
+static int vm_img_lock = 0;
+
+/* Stage 2 attributes of the region mmp */
+uint64_t vm_mem_attr(mmp_t *mmp){
+  return (mmp->attr == 0)? S2_ATTR_RAM : mmp->attr;
+}
+
+/* Whether the guest may write the region mmp */
+static int vm_mem_is_writable(mmp_t *mmp){
+  return (vm_mem_attr(mmp) & S2AP_WO) != 0;
+}
+
+/*
+ * Allocate guest memory for [ipa, ipa + size).
+ * A region of 2MB or more gets the same offset in a 2MB block as its ipa,
+ * so that map_page_table() can map it with block descriptors.
+ */
+phys_addr_t vm_mem_alloc(phys_addr_t ipa, uint64_t size){
+  uint64_t offset;
+  phys_addr_t pa;
+
+  if(size < BLOCK_2M_SIZE)
+    return (phys_addr_t)malloc(size);
+
+  offset = ipa & (BLOCK_2M_SIZE - 1);
+  pa = (phys_addr_t)malloc_aligned(size + offset, BLOCK_2M_SIZE);
+
+  /* Return the pages before the region */
+  for(; offset > 0; offset -= PAGE_SIZE, pa += PAGE_SIZE)
+    free_page((void *)pa);
+
+  return pa;
+}
+
+/* Whether the image of mmp can be mapped without copying it */
+static int vm_mem_img_is_embeddable(mmp_t *mmp){
+#if CONFIG_VM_IMG_ZERO_COPY
+  return (mmp->img_start % PAGE_SIZE) == 0;
+#else
+  return 0;
+#endif
+}
+
+/*
+ * Map the MEM_VM_IMG region mmp of vm read only.
+ * A vm_img_t loaded from the same image into a region of the same size
+ * is reused, otherwise the image is loaded into new memory
+ * or used in place if vm_mem_img_is_embeddable().
+ * Return the physical address of the region.
+ */
+phys_addr_t vm_mem_img_map(vm_t *vm, mmp_t *mmp){
+  vm_img_t *img;
+  uint64_t size = mmp->mem_end + 1 - mmp->mem_start;
+  uint64_t offset = mmp->mem_start & (BLOCK_2M_SIZE - 1);
+  uint64_t img_size = (uint64_t)(mmp->img_end - mmp->img_start);
+  int embedded = vm_mem_img_is_embeddable(mmp);
+  phys_addr_t pa;
+  uint64_t i;
+
+  if(img_size > size)
+    hyp_panic("Image %#x is larger than its region\n", mmp->img_start);
+
+  spin_lock(&vm_img_lock);
+
+  for(i=0; i<VM_IMG_MAX_NUM; i++){
+    img = &vm_imgs[i];
+    if(img->vm_num > 0 && img->img_start == mmp->img_start && img->img_end == mmp->img_end
+        && img->size == size && img->embedded == embedded
+        && (embedded || img->offset == offset) && !img->sealed)
+      break;
+  }
+
+  if(i == VM_IMG_MAX_NUM){
+    for(i=0; i<VM_IMG_MAX_NUM; i++){
+      if(vm_imgs[i].vm_num == 0)
+        break;
+    }
+    if(i == VM_IMG_MAX_NUM)
+      hyp_panic("There is no free vm_img_t\n");
+
+    img = &vm_imgs[i];
+    img->img_start = mmp->img_start;
+    img->img_end = mmp->img_end;
+    img->size = size;
+    img->offset = offset;
+    img->sealed = 0;
+    img->embedded = embedded;
+
+    if(embedded){
+      /* The bytes after the image in its last page are not given to the vms */
+      img->phys_addr = img->img_start;
+      img->shared_size = img_size & ~((uint64_t)PAGE_SIZE - 1);
+      log_info("vm %s maps image %#x without copying it\n", vm->name, img->img_start);
+    }else{
+      img->phys_addr = vm_mem_alloc(mmp->mem_start, size);
+      img->shared_size = size;
+
+      /* copy image */
+      memcpy(img->phys_addr, img->img_start, img_size);
+    }
+    img->page_refcnt = malloc(img->shared_size / PAGE_SIZE * sizeof(uint16_t));
+  }else{
+    log_info("vm %s shares image %#x with other vms\n", vm->name, img->img_start);
+  }
+
+  for(i=0; i<img->shared_size / PAGE_SIZE; i++)
+    img->page_refcnt[i]++;
+  img->vm_num++;
+
+  mmp->img = img;
+  if(img->shared_size != 0)
+    map_page_table_attr(vm->vttbr, vm->vmid, mmp->mem_start, img->phys_addr, img->shared_size,
+        (vm_mem_attr(mmp) & ~S2AP_RW) | S2AP_RO);
+
+  /* The last partial page of an embedded image is copied for each vm */
+  if(img->shared_size < img_size){
+    pa = (phys_addr_t)malloc(PAGE_SIZE);
+    memcpy(pa, img->img_start + img->shared_size, img_size - img->shared_size);
+    map_page_table_attr(vm->vttbr, vm->vmid, mmp->mem_start + img->shared_size, pa, PAGE_SIZE,
+        vm_mem_attr(mmp));
+  }
+
+  spin_unlock(&vm_img_lock);
+
+  return img->phys_addr;
+}
+
+/*
+ * Free the memory of img which no vm maps any more and its slot.
+ * The pages taken over by vms were freed by them.
+ * Called with vm_img_lock.
+ */
+static void vm_img_free(vm_img_t *img){
+  uint64_t i;
+
+  if(!img->embedded){
+    for(i=0; i<img->shared_size / PAGE_SIZE; i++){
+      if(img->page_refcnt[i] != VM_IMG_PAGE_TAKEN)
+        free_page((void *)(img->phys_addr + i * PAGE_SIZE));
+    }
+  }
+  free(img->page_refcnt);
+
+  log_debug("Released image %#x\n", img->img_start);
+  memset(img, 0, sizeof(vm_img_t));
+}
+
+/*
+ * Release the guest memory of vm.
+ * Shared image pages are unreferenced and the other mapped pages,
+ * including image pages taken over by vm, are freed.
+ * Called before the page tables of vm are released.
+ */
+void vm_mem_release(vm_t *vm){
+  vm_img_t *img;
+  mmp_t *mmp;
+  phys_addr_t ipa, pa;
+  uint64_t index;
+  int i;
+
+  spin_lock(&vm_img_lock);
+
+  for(i=0; i<vm->mmp_size; i++){
+    mmp = &vm->mmp[i];
+    img = (mmp->flag == MEM_VM_IMG)? mmp->img : NULL;
+
+    for(ipa = mmp->mem_start; ipa < mmp->mem_end; ipa += PAGE_SIZE){
+      pa = lookup_page_table(vm->vttbr, ipa);
+      if(pa == 0)
+        continue;
+
+      if(img != NULL && pa >= img->phys_addr && pa < img->phys_addr + img->shared_size){
+        index = (pa - img->phys_addr) / PAGE_SIZE;
+        if(img->page_refcnt[index] == VM_IMG_PAGE_TAKEN)
+          free_page((void *)pa);
+        else if(img->page_refcnt[index] > 0)
+          img->page_refcnt[index]--;
+        continue;
+      }
+
+      free_page((void *)pa);
+    }
+
+    if(img != NULL && --img->vm_num == 0)
+      vm_img_free(img);
+    mmp->img = NULL;
+  }
+
+  spin_unlock(&vm_img_lock);
+
+  log_debug("Released memory of vm %s\n", vm->name);
+}
+
+/*
+ * Break the sharing of the image page at ipa for the write by vcpu.
+ * The page is copied unless vcpu's vm is its last user.
+ * Return -1 if the page is not shared by vcpu's vm,
+ * or VM_MEM_ENOMEM if there is no memory for the copy.
+ */
+static int vm_mem_img_cow(vcpu_t *vcpu, mmp_t *mmp, phys_addr_t ipa){
+  vm_t *vm = vcpu->vm;
+  vm_img_t *img = mmp->img;
+  uint64_t index;
+  phys_addr_t shared_pa;
+  phys_addr_t pa;
+
+  ipa &= ~((phys_addr_t)PAGE_SIZE - 1);
+  index = (ipa - mmp->mem_start) / PAGE_SIZE;
+  shared_pa = img->phys_addr + ipa - mmp->mem_start;
+
+  spin_lock(&vm_img_lock);
+
+  /* Another vcpu of this vm may have broken it already */
+  if(lookup_page_table(vm->vttbr, ipa) != shared_pa || img->page_refcnt[index] == 0
+      || img->page_refcnt[index] == VM_IMG_PAGE_TAKEN){
+    spin_unlock(&vm_img_lock);
+    return -1;
+  }
+
+  if(img->page_refcnt[index] > 1 || img->embedded){
+    pa = (phys_addr_t)malloc_try(PAGE_SIZE);
+    if(pa == 0){
+      spin_unlock(&vm_img_lock);
+      log_warn("No memory to copy ipa %#8x of vm %s\n", ipa, vm->name);
+      return VM_MEM_ENOMEM;
+    }
+    memcpy(pa, shared_pa, PAGE_SIZE);
+    img->page_refcnt[index]--;
+  }else{
+    /*
+     * The last user takes over the page and frees it in vm_mem_release(),
+     * so the image is not pristine any more
+     */
+    pa = shared_pa;
+    img->page_refcnt[index] = VM_IMG_PAGE_TAKEN;
+    img->sealed = 1;
+  }
+
+  map_page_table_attr(vm->vttbr, vm->vmid, ipa, pa, PAGE_SIZE, vm_mem_attr(mmp));
+
+  spin_unlock(&vm_img_lock);
+
+  return 0;
+}
+
+/* Make the page at ipa of the region mmp writable again after dirty page tracking */
+static void vm_mem_write_enable(vm_t *vm, mmp_t *mmp, phys_addr_t ipa){
+  phys_addr_t pa;
+
+  ipa &= ~((phys_addr_t)PAGE_SIZE - 1);
+  pa = lookup_page_table(vm->vttbr, ipa);
+  if(pa == 0)
+    return;
+
+  map_page_table_attr(vm->vttbr, vm->vmid, ipa, pa, PAGE_SIZE, vm_mem_attr(mmp));
+}
+
+static mmp_t *vm_mem_find(vm_t *vm, phys_addr_t ipa){
+  int i;
+
+  for(i=0; i<vm->mmp_size; i++){
+    if(ipa >= vm->mmp[i].mem_start && ipa <= vm->mmp[i].mem_end)
+      return &vm->mmp[i];
+  }
+
+  return NULL;
+}
+
+/* Called by vm_mem_fault() with vm->mem_lock */
+static int vm_mem_fault_locked(vcpu_t *vcpu, mmp_t *mmp, phys_addr_t ipa, uint32_t iss){
+  vm_t *vm = vcpu->vm;
+  phys_addr_t start;
+  phys_addr_t pa;
+  uint64_t size;
+  int ret;
+
+  /* A write to a shared image page or a page write-protected for dirty tracking */
+  if(ISS_FSC_PERMISSION_FAULT(iss) && (iss & ISS_WNR)
+      && mmp->flag != MEM_HYP_VM_MSG && vm_mem_is_writable(mmp)){
+    ret = -1;
+    if(mmp->flag == MEM_VM_IMG && mmp->img != NULL)
+      ret = vm_mem_img_cow(vcpu, mmp, ipa);
+    if(ret == VM_MEM_ENOMEM)
+      return ret;
+    if(ret < 0)
+      vm_mem_write_enable(vm, mmp, ipa);
+
+    vm_dirty_log_mark(vm, ipa, PAGE_SIZE);
+    return 0;
+  }
+
+  if(!ISS_FSC_TRANSLATION_FAULT(iss))
+    return -1;
+
+  /*
+   * Another vcpu of this vm populated it before we took the lock,
+   * or the fault was taken while a block was split (see next_ttbl()).
+   */
+  if(lookup_page_table(vm->vttbr, ipa) != 0)
+    return 0;
+
+  /* MEM_VM_IMG regions of embedded images have unmapped pages after the image */
+  if(mmp->flag != MEM_ON_DEMAND && mmp->flag != MEM_VM_IMG)
+    return -1;
+
+  /* 
+   * Use a 2MB block if the whole block is in the region
+   * and no page of it is mapped (e.g. after the balloon returned a part of it),
+   * or a page if no free 2MB block is left.
+   * malloc_aligned_try() zeroes the memory.
+   */
+  pa = 0;
+  start = ipa & ~((phys_addr_t)BLOCK_2M_SIZE - 1);
+  size = BLOCK_2M_SIZE;
+  if(start >= mmp->mem_start && start + BLOCK_2M_SIZE - 1 <= mmp->mem_end
+      && !page_table_2m_is_used(vm->vttbr, start))
+    pa = (phys_addr_t)malloc_aligned_try(size, size);
+
+  if(pa == 0){
+    start = ipa & ~((phys_addr_t)PAGE_SIZE - 1);
+    size = PAGE_SIZE;
+    pa = (phys_addr_t)malloc_aligned_try(size, size);
+  }
+
+  if(pa == 0){
+    log_warn("No memory to populate ipa %#8x of vm %s\n", ipa, vm->name);
+    return VM_MEM_ENOMEM;
+  }
+
+  map_page_table_attr(vm->vttbr, vm->vmid, start, pa, size, vm_mem_attr(mmp));
+  vm_dirty_log_mark(vm, start, size);
+
+  log_debug("vm %s populated ipa : %#8x, pa : %#8x, size : %#x\n",
+      vm->name, start, pa, size);
+
+  return 0;
+}
+
+/*
+ * Called on a stage 2 fault of a data or instruction abort.
+ * Return 0 if ipa was populated or copied and the instruction should be retried,
+ * VM_MEM_ENOMEM if there is no memory to populate it,
+ * or -1 if the fault is not for on demand memory nor a shared image.
+ * The faults of the vcpus of a vm are serialized by vm->mem_lock.
+ */
+int vm_mem_fault(vcpu_t *vcpu, phys_addr_t ipa, uint32_t iss){
+  vm_t *vm = vcpu->vm;
+  mmp_t *mmp;
+  int ret;
+
+  mmp = vm_mem_find(vm, ipa);
+  if(mmp == NULL)
+    return -1;
+
+  spin_lock(&vm->mem_lock);
+  ret = vm_mem_fault_locked(vcpu, mmp, ipa, iss);
+  spin_unlock(&vm->mem_lock);
+
+  return ret;
+}
+
+/* Return the MEM or MEM_ON_DEMAND region which has [ipa, ipa + size) */
+static mmp_t *vm_mem_balloon_find(vm_t *vm, phys_addr_t ipa, uint64_t size){
+  mmp_t *mmp;
+
+  if(size == 0 || (ipa % PAGE_SIZE) != 0 || (size % PAGE_SIZE) != 0)
+    return NULL;
+
+  mmp = vm_mem_find(vm, ipa);
+  if(mmp == NULL || (mmp->flag != MEM && mmp->flag != MEM_ON_DEMAND)
+      || size > mmp->mem_end + 1 - ipa)
+    return NULL;
+
+  return mmp;
+}
+
+/*
+ * Balloon inflation : the guest gives [ipa, ipa + size) back.
+ * The pages are unmapped, and freed after the TLB is invalidated.
+ * Return the number of freed pages, or -1 if the range is illegal.
+ */
+int64_t vm_mem_balloon_inflate(vm_t *vm, phys_addr_t ipa, uint64_t size){
+  phys_addr_t pa[BALLOON_BATCH_NUM];
+  phys_addr_t batch_ipa;
+  uint64_t batch_size;
+  int64_t freed = 0;
+  int i, n;
+
+  if(vm_mem_balloon_find(vm, ipa, size) == NULL){
+    log_warn("Illegal balloon range of vm %s; ipa : %#x, size : %#x\n", vm->name, ipa, size);
+    return -1;
+  }
+
+  spin_lock(&vm->mem_lock);
+  for(batch_ipa = ipa; batch_ipa < ipa + size; batch_ipa += batch_size){
+    batch_size = ipa + size - batch_ipa;
+    if(batch_size > BALLOON_BATCH_NUM * PAGE_SIZE)
+      batch_size = BALLOON_BATCH_NUM * PAGE_SIZE;
+
+    n = 0;
+    for(i=0; i<batch_size / PAGE_SIZE; i++){
+      pa[n] = lookup_page_table(vm->vttbr, batch_ipa + i * PAGE_SIZE);
+      if(pa[n] != 0)
+        n++;
+    }
+
+    unmap_page_table(vm->vttbr, vm->vmid, batch_ipa, batch_size);
+
+    for(i=0; i<n; i++)
+      free_page((void *)pa[i]);
+    freed += n;
+  }
+
+  vm->balloon_page_num += freed;
+  /* The next checkpoint records them as zero */
+  vm_dirty_log_mark(vm, ipa, size);
+  spin_unlock(&vm->mem_lock);
+
+  log_debug("vm %s inflated balloon; ipa : %#x, size : %#x, freed pages : %d\n",
+      vm->name, ipa, size, freed);
+
+  return freed;
+}
+
+/*
+ * Balloon deflation : the guest takes [ipa, ipa + size) again.
+ * MEM_ON_DEMAND pages are populated on the next access,
+ * MEM pages are allocated and mapped now.
+ * Return 0, -1 if the range is illegal, or VM_MEM_ENOMEM if the host
+ * has no memory for a MEM page; the pages before it are taken back then.
+ */
+int64_t vm_mem_balloon_deflate(vm_t *vm, phys_addr_t ipa, uint64_t size){
+  mmp_t *mmp;
+  phys_addr_t page_ipa;
+  phys_addr_t pa;
+  uint64_t num = 0;
+  int64_t ret = 0;
+
+  mmp = vm_mem_balloon_find(vm, ipa, size);
+  if(mmp == NULL){
+    log_warn("Illegal balloon range of vm %s; ipa : %#x, size : %#x\n", vm->name, ipa, size);
+    return -1;
+  }
+
+  spin_lock(&vm->mem_lock);
+  for(page_ipa = ipa; page_ipa < ipa + size; page_ipa += PAGE_SIZE){
+    if(lookup_page_table(vm->vttbr, page_ipa) != 0)
+      continue;
+
+    if(mmp->flag == MEM){
+      pa = (phys_addr_t)malloc_try(PAGE_SIZE);
+      if(pa == 0){
+        ret = VM_MEM_ENOMEM;
+        break;
+      }
+      map_page_table_attr(vm->vttbr, vm->vmid, page_ipa, pa, PAGE_SIZE, vm_mem_attr(mmp));
+    }
+    num++;
+  }
+
+  if(vm->balloon_page_num < num)
+    vm->balloon_page_num = 0;
+  else
+    vm->balloon_page_num -= num;
+  vm_dirty_log_mark(vm, ipa, page_ipa - ipa);
+  spin_unlock(&vm->mem_lock);
+
+  if(ret != 0)
+    log_warn("No memory to deflate balloon of vm %s at ipa %#x\n", vm->name, page_ipa);
+  log_debug("vm %s deflated balloon; ipa : %#x, size : %#x\n", vm->name, ipa, page_ipa - ipa);
+
+  return ret;
+}
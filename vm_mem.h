@@ -0,0 +1,19 @@
+#ifndef _VM_MEM_H_INCLUDED_
+#define _VM_MEM_H_INCLUDED_
+
+#include "typedef.h"
+#include "vcpu.h"
+#include "vm.h"
+
+/* Out of host memory, returned by vm_mem_fault() and to the guest */
+#define VM_MEM_ENOMEM (-2)
+
+uint64_t vm_mem_attr(mmp_t *mmp);
+phys_addr_t vm_mem_alloc(phys_addr_t ipa, uint64_t size);
+phys_addr_t vm_mem_img_map(vm_t *vm, mmp_t *mmp);
+void vm_mem_release(vm_t *vm);
+int64_t vm_mem_balloon_inflate(vm_t *vm, phys_addr_t ipa, uint64_t size);
+int64_t vm_mem_balloon_deflate(vm_t *vm, phys_addr_t ipa, uint64_t size);
+int vm_mem_fault(vcpu_t *vcpu, phys_addr_t ipa, uint32_t iss);
+
+#endif
@@ -56,9 +56,11 @@ void vtimer_reg_reset(void){
   WRITE_SYSREG(CNTV_CVAL_EL0, 0);
 }
 
-static void emulate_vtimer_handler(pcpu_t *phys_cpu, vcpu_t *vcpu){
+static void emulate_vtimer_handler(pcpu_t *phys_cpu, uint64_t arg){
+  vcpu_t *vcpu = (vcpu_t *)arg;
+
   log_info("emulate_vtimer_handler()\n");
-  vcpu->sysreg.cntv_ctl_el0 |= CNTxx_CTL_ISTATUS;
+  vcpu->cold_sysreg.cntv_ctl_el0 |= CNTxx_CTL_ISTATUS;
   vcpu_do_virq(vcpu);
 }
 
@@ -74,18 +76,26 @@ void emulate_vtimer(vcpu_t *vcpu){
   READ_SYSREG(cntvct_el0, cntvct_el0);
 
   log_info("cntv_ctl_el0 : %d, cntv_tval_el0 : %d, cntv_cval_el0 : %d, cntv_off : %d\n",
-      cntv_ctl_el0, cntv_tval_el0, cntv_cval_el0, vcpu->sysreg.cntvoff_el2);
+      cntv_ctl_el0, cntv_tval_el0, cntv_cval_el0, VCPU_COLD_SYSREG_READ(vcpu, cntvoff_el2, CNTVOFF_EL2));
 
   if(vcpu->phys_cpu->scheduler->emulate_vtimer == 1){
-    if(vcpu->sysreg.cntv_ctl_el0&CNTxx_CTL_ENABLE){
+    if(cntv_ctl_el0&CNTxx_CTL_ENABLE){
       timer_event_add(get_current_phys_cpu(), emulate_vtimer_handler,
-          hyp_timer_tick2msec(cntv_cval_el0 - cntvct_el0), vcpu);
+          hyp_timer_tick2msec(cntv_cval_el0 - cntvct_el0), (uint64_t)vcpu);
       log_debug("emule vtimer() %dticks %dmsec\n",
         cntv_tval_el0 - cntvct_el0, hyp_timer_tick2msec(cntv_cval_el0 - cntvct_el0));
     }
   }
 }
 
+/*
+ * Cancel the emulated timer interrupts of vcpu before it is freed.
+ * Return 1 if one is being delivered on another cpu, see timer_event_cancel().
+ */
+int vtimer_release(vcpu_t *vcpu){
+  return timer_event_cancel(emulate_vtimer_handler, (uint64_t)vcpu);
+}
+
 void vtimer_context_save(vcpu_t *vcpu){
   /*TODO*/
   asm volatile("isb");
@@ -8,6 +8,7 @@
 void vtimer_init(void);
 void vtimer_reg_reset(void);
 void emulate_vtimer(vcpu_t *vcpu);
+int  vtimer_release(vcpu_t *vcpu);
 void vtimer_context_save(vcpu_t *vcpu);
 void vtimer_context_restore(vcpu_t *vcpu);
 